@@ -0,0 +1,2961 @@
+#include "makaka.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lzma.h>
+#include <lz4frame.h>
+#include <lz4hc.h>
+#include <zstd.h>
+
+namespace {
+
+// Контексты кодеков, переиспользуемые всеми вызовами в пределах одного потока: не нужно
+// заново выделять их на каждую запись, и потоки не делят между собой никакого состояния.
+struct ThreadCodecContexts {
+    ZSTD_CCtx* zstd_compress = nullptr;
+    ZSTD_DCtx* zstd_decompress = nullptr;
+    lzma_stream lzma = LZMA_STREAM_INIT;
+    LZ4F_cctx* lz4_compress = nullptr;
+    LZ4F_dctx* lz4_decompress = nullptr;
+
+    ~ThreadCodecContexts() {
+        ZSTD_freeCCtx(zstd_compress);
+        ZSTD_freeDCtx(zstd_decompress);
+        lzma_end(&lzma);
+        LZ4F_freeCompressionContext(lz4_compress);
+        LZ4F_freeDecompressionContext(lz4_decompress);
+    }
+
+    ZSTD_CCtx* zstdCompressor() {
+        if (!zstd_compress && !(zstd_compress = ZSTD_createCCtx())) throw std::bad_alloc();
+        return zstd_compress;
+    }
+
+    ZSTD_DCtx* zstdDecompressor() {
+        if (!zstd_decompress && !(zstd_decompress = ZSTD_createDCtx())) throw std::bad_alloc();
+        return zstd_decompress;
+    }
+
+    LZ4F_cctx* lz4Compressor() {
+        if (!lz4_compress && LZ4F_isError(LZ4F_createCompressionContext(&lz4_compress, LZ4F_VERSION))) {
+            throw std::bad_alloc();
+        }
+        return lz4_compress;
+    }
+
+    LZ4F_dctx* lz4Decompressor() {
+        if (!lz4_decompress && LZ4F_isError(LZ4F_createDecompressionContext(&lz4_decompress, LZ4F_VERSION))) {
+            throw std::bad_alloc();
+        }
+        return lz4_decompress;
+    }
+};
+
+thread_local ThreadCodecContexts codec_contexts;
+
+}  // namespace
+
+const char* filterName(FilterType type) {
+    switch (type) {
+        case FILTER_X86: return "x86";
+        case FILTER_ARM64: return "arm64";
+        case FILTER_DELTA: return "delta";
+        default: return "none";
+    }
+}
+
+namespace {
+
+// Энтропия нулевого порядка (бит на байт) потока p[i] - p[i - distance]; distance == 0 — сырые байты.
+double sampleEntropy(const uint8_t* data, size_t size, size_t distance) {
+    size_t histogram[256] = {};
+    for (size_t i = distance; i < size; ++i) {
+        histogram[static_cast<uint8_t>(data[i] - (distance ? data[i - distance] : 0))]++;
+    }
+
+    double total = static_cast<double>(size - distance);
+    double entropy = 0;
+    for (size_t count : histogram) {
+        if (count) {
+            double p = count / total;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy;
+}
+
+}  // namespace
+
+EntryFilter detectFilter(const std::vector<uint8_t>& data) {
+    EntryFilter filter;
+
+    // ELF little-endian: e_machine по смещению 18
+    if (data.size() >= 20 && data[0] == 0x7F && data[1] == 'E' && data[2] == 'L' && data[3] == 'F' && data[5] == 1) {
+        uint16_t machine = data[18] | (data[19] << 8);
+        if (machine == 0x3E || machine == 0x03) filter.type = FILTER_X86;
+        else if (machine == 0xB7) filter.type = FILTER_ARM64;
+        return filter;
+    }
+
+    // Таблицы чисел фиксированной ширины: дельта по ширине поля/записи заметно снижает энтропию
+    if (data.size() < 4096) return filter;
+
+    size_t sample = std::min<size_t>(data.size(), 1 << 16);
+    double raw = sampleEntropy(data.data(), sample, 0);
+    double best = raw;
+    size_t best_distance = 0;
+    for (size_t distance : {1, 2, 3, 4, 6, 8, 12, 16}) {
+        double entropy = sampleEntropy(data.data(), sample, distance);
+        if (entropy < best) {
+            best = entropy;
+            best_distance = distance;
+        }
+    }
+
+    if (best_distance && best < raw * 0.85) {
+        filter.type = FILTER_DELTA;
+        filter.param = static_cast<uint8_t>(best_distance - 1);
+    }
+    return filter;
+}
+
+namespace {
+
+// Автономные реализации фильтров для кодеков без собственной цепочки фильтров (ZSTD).
+// Каждая функция обратима: encode == false восстанавливает исходные данные.
+
+// E8/E9 (call/jmp rel32): относительный адрес переводится в абсолютный по модулю 2^25,
+// старший байт остаётся 0x00/0xFF. Четыре байта после E8/E9 пропускаются, даже если адрес
+// не переведён: иначе перевод следующего E8/E9 внутри них меняет байт, по которому решалось
+// здесь, и декодер решает иначе, чем кодер. Так просматриваются ровно те байты, которые
+// фильтр не меняет.
+void filterX86(uint8_t* data, size_t size, bool encode) {
+    size_t i = 0;
+    while (i + 5 <= size) {
+        uint8_t opcode = data[i];
+        if (opcode != 0xE8 && opcode != 0xE9) {
+            ++i;
+            continue;
+        }
+        if (data[i + 4] == 0x00 || data[i + 4] == 0xFF) {
+            uint32_t value = data[i + 1] | (data[i + 2] << 8) | (data[i + 3] << 16)
+                           | (data[i + 4] == 0xFF ? 1u << 24 : 0);
+            uint32_t position = static_cast<uint32_t>(i + 5);
+            value = (encode ? value + position : value - position) & 0x1FFFFFF;
+
+            data[i + 1] = value & 0xFF;
+            data[i + 2] = (value >> 8) & 0xFF;
+            data[i + 3] = (value >> 16) & 0xFF;
+            data[i + 4] = (value & (1u << 24)) ? 0xFF : 0x00;
+        }
+        i += 5;
+    }
+}
+
+// BL imm26: смещение в словах переводится в абсолютный номер инструкции.
+void filterARM64(uint8_t* data, size_t size, bool encode) {
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        uint32_t insn = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (uint32_t(data[i + 3]) << 24);
+        if ((insn & 0xFC000000) != 0x94000000) continue;
+
+        uint32_t pc = static_cast<uint32_t>(i >> 2);
+        uint32_t imm = insn & 0x03FFFFFF;
+        imm = (encode ? imm + pc : imm - pc) & 0x03FFFFFF;
+        insn = 0x94000000 | imm;
+
+        data[i] = insn & 0xFF;
+        data[i + 1] = (insn >> 8) & 0xFF;
+        data[i + 2] = (insn >> 16) & 0xFF;
+        data[i + 3] = insn >> 24;
+    }
+}
+
+void filterDelta(uint8_t* data, size_t size, size_t distance, bool encode) {
+    if (encode) {
+        for (size_t i = size; i-- > distance;) data[i] -= data[i - distance];
+    } else {
+        for (size_t i = distance; i < size; ++i) data[i] += data[i - distance];
+    }
+}
+
+}  // namespace
+
+void applyFilter(uint8_t* data, size_t size, EntryFilter filter, bool encode) {
+    switch (filter.type) {
+        case FILTER_X86: filterX86(data, size, encode); break;
+        case FILTER_ARM64: filterARM64(data, size, encode); break;
+        case FILTER_DELTA: filterDelta(data, size, filter.param + 1, encode); break;
+        default: break;
+    }
+}
+
+void applyFilter(std::vector<uint8_t>& data, EntryFilter filter, bool encode) {
+    applyFilter(data.data(), data.size(), filter, encode);
+}
+
+namespace {
+
+// Кодеки. Реализации без состояния: контексты живут в codec_contexts и переиспользуются
+// между вызовами в потоке.
+
+size_t storeBound(size_t size) {
+    return size;
+}
+
+void storeEncode(const uint8_t* input, size_t size, std::vector<uint8_t>& output, EntryFilter, int) {
+    output.insert(output.end(), input, input + size);
+}
+
+void storeDecode(const uint8_t* input, size_t size, uint8_t* output, size_t original_size, EntryFilter) {
+    if (size != original_size) throw std::runtime_error("Stored entry has unexpected size");
+    if (size) std::memcpy(output, input, size);
+}
+
+// Цепочка фильтров для lzma_raw_encoder/lzma_raw_decoder. Словарь ограничен размером записи,
+// чтобы декодер, знающий original_size, мог восстановить те же параметры без хранения их в архиве.
+// lc/lp/pb у всех уровней одинаковые, а словарь декодера (уровень 9) не меньше, чем у кодера.
+struct LZMAFilterChain {
+    lzma_options_lzma lzma_options;
+    lzma_options_delta delta_options;
+    lzma_filter filters[3];
+
+    LZMAFilterChain(EntryFilter filter, uint64_t original_size, uint32_t preset) {
+        lzma_lzma_preset(&lzma_options, preset);
+        if (original_size < lzma_options.dict_size) {
+            lzma_options.dict_size = std::max<uint32_t>(LZMA_DICT_SIZE_MIN, static_cast<uint32_t>(original_size));
+        }
+
+        std::memset(&delta_options, 0, sizeof(delta_options));
+        delta_options.type = LZMA_DELTA_TYPE_BYTE;
+        delta_options.dist = filter.param + 1;
+
+        switch (filter.type) {
+            case FILTER_X86: filters[0] = {LZMA_FILTER_X86, nullptr}; break;
+            case FILTER_ARM64: filters[0] = {LZMA_FILTER_ARM64, nullptr}; break;
+            case FILTER_DELTA: filters[0] = {LZMA_FILTER_DELTA, &delta_options}; break;
+            default: throw std::runtime_error("LZMA filter chain requires a filter");
+        }
+        filters[1] = {LZMA_FILTER_LZMA2, &lzma_options};
+        filters[2] = {LZMA_VLI_UNKNOWN, nullptr};
+    }
+};
+
+// Прогоняет весь вход через подготовленный lzma_stream, дописывая в output и расширяя его по мере
+// необходимости (потоковый кодер на несжимаемых данных выходит и за lzma_stream_buffer_bound).
+// Поток не освобождается: это контекст потока, который следующая инициализация переиспользует.
+void runLZMA(lzma_stream& stream, const uint8_t* input, size_t size, std::vector<uint8_t>& output, size_t size_hint) {
+    size_t start = output.size();
+    output.resize(start + std::max<size_t>(size_hint, 64));
+    stream.next_in = input;
+    stream.avail_in = size;
+    stream.next_out = output.data() + start;
+    stream.avail_out = output.size() - start;
+
+    lzma_ret ret;
+    while ((ret = lzma_code(&stream, LZMA_FINISH)) == LZMA_OK) {
+        if (stream.avail_out == 0) {
+            size_t used = output.size();
+            output.resize(used + std::max<size_t>((used - start) / 8, 4096));
+            stream.next_out = output.data() + used;
+            stream.avail_out = output.size() - used;
+        }
+    }
+    if (ret != LZMA_STREAM_END) {
+        throw std::runtime_error("LZMA coding failed (error " + std::to_string(ret) + ")");
+    }
+    output.resize(output.size() - stream.avail_out);
+}
+
+size_t lzmaBound(size_t size) {
+    return lzma_stream_buffer_bound(size);
+}
+
+void lzmaEncode(const uint8_t* input, size_t size, std::vector<uint8_t>& output, EntryFilter filter, int level) {
+    lzma_stream& stream = codec_contexts.lzma;
+    uint32_t preset = static_cast<uint32_t>(level) | LZMA_PRESET_EXTREME;
+    if (filter.type == FILTER_NONE) {
+        if (lzma_easy_encoder(&stream, preset, LZMA_CHECK_CRC64) != LZMA_OK) {
+            throw std::runtime_error("LZMA compression initialization failed");
+        }
+    } else {
+        LZMAFilterChain chain(filter, size, preset);
+        if (lzma_raw_encoder(&stream, chain.filters) != LZMA_OK) {
+            throw std::runtime_error("LZMA compression initialization failed");
+        }
+    }
+    runLZMA(stream, input, size, output, lzmaBound(size));
+}
+
+void lzmaDecode(const uint8_t* input, size_t size, uint8_t* output, size_t original_size, EntryFilter filter) {
+    lzma_stream& stream = codec_contexts.lzma;
+    if (filter.type == FILTER_NONE) {
+        if (lzma_stream_decoder(&stream, UINT64_MAX, 0) != LZMA_OK) {
+            throw std::runtime_error("LZMA decompression initialization failed");
+        }
+    } else {
+        LZMAFilterChain chain(filter, original_size, 9 | LZMA_PRESET_EXTREME);
+        if (lzma_raw_decoder(&stream, chain.filters) != LZMA_OK) {
+            throw std::runtime_error("LZMA decompression initialization failed");
+        }
+    }
+    stream.next_in = input;
+    stream.avail_in = size;
+    stream.next_out = output;
+    stream.avail_out = original_size;
+    // Выход ровно original_size: если данных больше, lzma_code без продвижения вернёт LZMA_BUF_ERROR.
+    lzma_ret ret;
+    while ((ret = lzma_code(&stream, LZMA_FINISH)) == LZMA_OK) {}
+    if (ret != LZMA_STREAM_END) {
+        throw std::runtime_error("LZMA decompression failed (error " + std::to_string(ret) + ")");
+    }
+    if (stream.avail_out != 0) throw std::runtime_error("LZMA decompression produced unexpected size");
+}
+
+size_t zstdBound(size_t size) {
+    return ZSTD_compressBound(size);
+}
+
+void zstdEncode(const uint8_t* input, size_t size, std::vector<uint8_t>& output, EntryFilter, int level) {
+    size_t start = output.size();
+    output.resize(start + zstdBound(size));
+    size_t compressed_size = ZSTD_compressCCtx(codec_contexts.zstdCompressor(), output.data() + start,
+                                               output.size() - start, input, size, level);
+    if (ZSTD_isError(compressed_size)) {
+        throw std::runtime_error("ZSTD compression failed: " + std::string(ZSTD_getErrorName(compressed_size)));
+    }
+    output.resize(start + compressed_size);
+}
+
+void zstdDecode(const uint8_t* input, size_t size, uint8_t* output, size_t original_size, EntryFilter) {
+    size_t result = ZSTD_decompressDCtx(codec_contexts.zstdDecompressor(), output, original_size, input, size);
+    if (ZSTD_isError(result)) {
+        throw std::runtime_error("ZSTD decompression failed: " + std::string(ZSTD_getErrorName(result)));
+    }
+    if (result != original_size) throw std::runtime_error("ZSTD decompression produced unexpected size");
+}
+
+// Один кадр LZ4 на запись (кусок), с размером содержимого в заголовке кадра. Блоки связаны:
+// кадр и так декодируется целиком, а сжатие от этого лучше. Уровень 0 — быстрый LZ4,
+// от LZ4HC_CLEVEL_MIN — LZ4-HC; формат кадра от уровня не зависит.
+LZ4F_preferences_t lz4Preferences(size_t size, int level) {
+    LZ4F_preferences_t preferences;
+    std::memset(&preferences, 0, sizeof(preferences));
+    preferences.frameInfo.blockSizeID = LZ4F_max4MB;
+    preferences.frameInfo.blockMode = LZ4F_blockLinked;
+    preferences.frameInfo.contentSize = size;
+    preferences.compressionLevel = level;
+    return preferences;
+}
+
+size_t lz4Bound(size_t size) {
+    LZ4F_preferences_t preferences = lz4Preferences(size, 0);
+    return LZ4F_compressFrameBound(size, &preferences);
+}
+
+void lz4Encode(const uint8_t* input, size_t size, std::vector<uint8_t>& output_buffer, EntryFilter, int level) {
+    LZ4F_preferences_t preferences = lz4Preferences(size, level);
+    LZ4F_cctx* context = codec_contexts.lz4Compressor();
+    size_t start = output_buffer.size();
+    output_buffer.resize(start + LZ4F_compressFrameBound(size, &preferences));
+    uint8_t* output = output_buffer.data() + start;
+    size_t capacity = output_buffer.size() - start;
+    size_t written = LZ4F_compressBegin(context, output, capacity, &preferences);
+    if (!LZ4F_isError(written)) {
+        size_t n = LZ4F_compressUpdate(context, output + written, capacity - written, input, size, nullptr);
+        written = LZ4F_isError(n) ? n : written + n;
+    }
+    if (!LZ4F_isError(written)) {
+        size_t n = LZ4F_compressEnd(context, output + written, capacity - written, nullptr);
+        written = LZ4F_isError(n) ? n : written + n;
+    }
+    if (LZ4F_isError(written)) {
+        throw std::runtime_error("LZ4 compression failed: " + std::string(LZ4F_getErrorName(written)));
+    }
+    output_buffer.resize(start + written);
+}
+
+void lz4Decode(const uint8_t* input, size_t size, uint8_t* output, size_t original_size, EntryFilter) {
+    LZ4F_dctx* context = codec_contexts.lz4Decompressor();
+    LZ4F_resetDecompressionContext(context);  // после ошибки в прошлой записи
+    size_t in = 0, out = 0, hint = 1;
+    while (hint != 0) {
+        size_t src_size = size - in;
+        size_t dst_size = original_size - out;
+        hint = LZ4F_decompress(context, output + out, &dst_size, input + in, &src_size, nullptr);
+        if (LZ4F_isError(hint)) {
+            throw std::runtime_error("LZ4 decompression failed: " + std::string(LZ4F_getErrorName(hint)));
+        }
+        in += src_size;
+        out += dst_size;
+        if (hint != 0 && src_size == 0 && dst_size == 0) throw std::runtime_error("LZ4 decompression failed: truncated frame");
+    }
+    if (out != original_size) throw std::runtime_error("LZ4 decompression produced unexpected size");
+}
+
+// Индекс — значение CompressionType.
+constexpr Codec CODECS[] = {
+    {"none", 0, storeBound, storeEncode, storeDecode},
+    {"lzma", CODEC_COMPRESSES | CODEC_FILTER_CHAIN, lzmaBound, lzmaEncode, lzmaDecode},
+    {"zstd", CODEC_COMPRESSES, zstdBound, zstdEncode, zstdDecode},
+    {"lz4", CODEC_COMPRESSES, lz4Bound, lz4Encode, lz4Decode},
+};
+
+constexpr CodecPreset CODEC_PRESETS[] = {
+    {"lzma", COMPRESS_LZMA, 9},
+    {"zstd", COMPRESS_ZSTD, 22},
+    {"lz4", COMPRESS_LZ4, 0},
+    {"lz4hc", COMPRESS_LZ4, LZ4HC_CLEVEL_MAX},
+    {"none", COMPRESS_NONE, 0},
+};
+
+}  // namespace
+
+const Codec* findCodec(uint16_t compression) {
+    return compression < std::size(CODECS) ? &CODECS[compression] : nullptr;
+}
+
+const CodecPreset* findCodecPreset(const std::string& name) {
+    for (const auto& preset : CODEC_PRESETS) {
+        if (name == preset.name) return &preset;
+    }
+    return nullptr;
+}
+
+std::string codecPresetNames() {
+    std::string names;
+    for (const auto& preset : CODEC_PRESETS) {
+        if (!names.empty()) names += '|';
+        names += preset.name;
+    }
+    return names;
+}
+
+std::vector<uint8_t> encodeEntryData(uint16_t compression, int level, EntryFilter filter, std::vector<uint8_t>& data) {
+    const Codec* codec = findCodec(compression);
+    if (!codec) throw std::runtime_error("Unsupported compression " + std::to_string(compression));
+    if (!(codec->capabilities & CODEC_FILTER_CHAIN)) applyFilter(data, filter, true);
+    std::vector<uint8_t> output;
+    codec->encode(data.data(), data.size(), output, filter, level);
+    return output;
+}
+
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+void appendVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+size_t sharedPrefixLength(const std::string& a, const std::string& b) {
+    size_t limit = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < limit && a[i] == b[i]) ++i;
+    return i;
+}
+
+// Кодирует заголовок записи версии 2.0; previous_name — имя предыдущей записи ("" для первой).
+std::string paddedVarint(uint64_t value) {
+    std::string out;
+    for (size_t i = 0; i + 1 < ENTRY_SIZE_FIELD_BYTES; ++i) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value & 0x7F));
+    return out;
+}
+
+std::string encodeEntryHeader(const std::string& previous_name, const EntryHeader& entry, size_t* size_field) {
+    std::string header;
+    size_t shared = sharedPrefixLength(previous_name, entry.name);
+    appendVarint(header, shared);
+    appendVarint(header, entry.name.size() - shared);
+    header.append(entry.name, shared, std::string::npos);
+    appendVarint(header, entry.original_size);
+    if (size_field) {
+        *size_field = header.size();
+        header += paddedVarint(entry.compressed_size);
+    } else {
+        appendVarint(header, entry.compressed_size);
+    }
+    uint8_t type = entry.filter.type;
+    if (entry.flags & ENTRY_CHUNKED) type |= ENTRY_CHUNKED_BIT;
+    if (entry.flags & ENTRY_REFERENCES) type |= ENTRY_REFERENCES_BIT;
+    if (entry.flags & ENTRY_COMPRESSION) type |= ENTRY_COMPRESSION_BIT;
+    header.push_back(static_cast<char>(type));
+    if (entry.filter.type == FILTER_DELTA) header.push_back(static_cast<char>(entry.filter.param));
+    if (entry.flags & ENTRY_COMPRESSION) header.push_back(static_cast<char>(entry.compression));
+    return header;
+}
+
+uint16_t recordFlags(const EntryHeader& entry) {
+    uint16_t flags = entry.flags & (ENTRY_CHUNKED | ENTRY_REFERENCES);
+    if (entry.flags & ENTRY_COMPRESSION) {
+        if (entry.compression + 1 > (RECORD_COMPRESSION_MASK >> RECORD_COMPRESSION_SHIFT)) {
+            throw std::runtime_error("Unsupported compression " + std::to_string(entry.compression));
+        }
+        flags |= (entry.compression + 1) << RECORD_COMPRESSION_SHIFT;
+    }
+    return flags;
+}
+
+ArchiveInput::ArchiveInput(const std::string& path) : ArchiveInput(std::vector<std::string>{path}) {}
+
+ArchiveInput::ArchiveInput(const std::vector<std::string>& volume_paths) : buffer_(BUFFER_SIZE) {
+    uint64_t offset = 0;
+    for (const auto& path : volume_paths) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            for (const auto& volume : volumes_) close(volume.fd);
+            throw std::runtime_error("Failed to open archive");
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        volumes_.push_back({fd, offset});
+        offset += st.st_size;
+    }
+}
+
+ArchiveInput::~ArchiveInput() {
+    for (const auto& volume : volumes_) close(volume.fd);
+}
+
+void ArchiveInput::read(void* destination, size_t size) {
+    auto* out = static_cast<uint8_t*>(destination);
+    while (size > 0) {
+        if (pos_ == end_) fill();
+        size_t n = std::min(size, end_ - pos_);
+        std::memcpy(out, buffer_.data() + pos_, n);
+        pos_ += n;
+        out += n;
+        size -= n;
+    }
+}
+
+uint8_t ArchiveInput::readByte() {
+    if (pos_ == end_) fill();
+    return buffer_[pos_++];
+}
+
+uint64_t ArchiveInput::readVarint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = readByte();
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Corrupted archive: varint too long");
+}
+
+void ArchiveInput::skip(uint64_t size) {
+    if (size <= end_ - pos_) {
+        pos_ += size;
+        return;
+    }
+    size -= end_ - pos_;
+    pos_ = end_ = 0;
+    offset_ += size;
+    while (volume_ + 1 < volumes_.size() && volumes_[volume_ + 1].offset <= offset_) ++volume_;
+    const Volume& volume = volumes_[volume_];
+    if (lseek(volume.fd, static_cast<off_t>(offset_ - volume.offset), SEEK_SET) < 0) {
+        throw std::runtime_error("Failed to seek in archive");
+    }
+}
+
+void ArchiveInput::fill() {
+    ssize_t n;
+    for (;;) {
+        n = ::read(volumes_[volume_].fd, buffer_.data(), buffer_.size());
+        if (n < 0 && errno == EINTR) continue;
+        // Конец тома — переход к следующему (с его начала: дескриптор ещё не читался).
+        if (n == 0 && volume_ + 1 < volumes_.size() && volumes_[volume_ + 1].offset == offset_) {
+            ++volume_;
+            continue;
+        }
+        break;
+    }
+    if (n <= 0) throw std::runtime_error("Unexpected end of archive");
+    pos_ = 0;
+    end_ = static_cast<size_t>(n);
+    offset_ += end_;
+}
+
+ArchiveHeader readArchiveHeader(ArchiveInput& in) {
+    uint32_t signature;
+    in.read(&signature, 4);
+    if (signature != MAKAKA_SIGNATURE) {
+        throw std::runtime_error("Invalid file format");
+    }
+
+    ArchiveHeader header;
+    in.read(&header.version, 2);
+    in.read(&header.compression, 2);
+    if (header.version > MAKAKA_VERSION) {
+        throw std::runtime_error("Unsupported archive version");
+    }
+    in.read(&header.file_count, 4);
+    return header;
+}
+
+// Читает заголовок очередной записи. Для версии 2.0 entry.name должен содержать имя
+// предыдущей записи — новое имя собирается поверх него.
+void readEntryHeader(ArchiveInput& in, uint16_t version, EntryHeader& entry) {
+    if (version >= MAKAKA_VERSION_2_0) {
+        uint64_t shared = in.readVarint();
+        uint64_t suffix_length = in.readVarint();
+        if (shared > entry.name.size()) throw std::runtime_error("Corrupted archive: bad name prefix");
+        entry.name.resize(shared + suffix_length);
+        in.read(&entry.name[shared], suffix_length);
+        entry.original_size = in.readVarint();
+        entry.compressed_size = in.readVarint();
+        uint8_t type = in.readByte();
+        entry.flags = 0;
+        if (version >= MAKAKA_VERSION_2_2 && (type & ENTRY_CHUNKED_BIT)) entry.flags |= ENTRY_CHUNKED;
+        if (version >= MAKAKA_VERSION_2_3 && (type & ENTRY_REFERENCES_BIT)) entry.flags |= ENTRY_REFERENCES;
+        if (version >= MAKAKA_VERSION_2_4 && (type & ENTRY_COMPRESSION_BIT)) entry.flags |= ENTRY_COMPRESSION;
+        if (version >= MAKAKA_VERSION_2_2) type &= ~ENTRY_CHUNKED_BIT;
+        if (version >= MAKAKA_VERSION_2_3) type &= ~ENTRY_REFERENCES_BIT;
+        if (version >= MAKAKA_VERSION_2_4) type &= ~ENTRY_COMPRESSION_BIT;
+        entry.filter.type = static_cast<FilterType>(type);
+        entry.filter.param = entry.filter.type == FILTER_DELTA ? in.readByte() : 0;
+        entry.compression = COMPRESS_NONE;
+        if (entry.flags & ENTRY_COMPRESSION) entry.compression = in.readByte();
+        return;
+    }
+
+    uint32_t name_length;
+    in.read(&name_length, 4);
+    entry.name.resize(name_length);
+    in.read(&entry.name[0], name_length);
+    in.read(&entry.original_size, 8);
+    in.read(&entry.compressed_size, 8);
+
+    entry.flags = 0;
+    entry.filter = EntryFilter();
+    if (version >= MAKAKA_VERSION_1_1) {
+        entry.filter.type = static_cast<FilterType>(in.readByte());
+        entry.filter.param = in.readByte();
+    }
+}
+
+// Минимальная совершенная хеш-функция по схеме hash-and-displace (CHD): имена раскладываются
+// по корзинам (~MPH_BUCKET_LOAD имён на корзину), для каждой корзины подбирается смещение,
+// при котором все её имена попадают в свободные ячейки таблицы из ровно key_count ячеек.
+// Ячейка хранит 32-битный отпечаток имени и номер записи индекса: поиск — одно чтение смещения
+// корзины и одно чтение ячейки. Имя вне архива совпадает с отпечатком с вероятностью 2^-32.
+//   MphHeader, uint32 displacement[bucket_count], MphSlot slots[key_count]
+namespace {
+
+constexpr uint64_t MPH_BUCKET_LOAD = 4;
+constexpr uint32_t MPH_MAX_DISPLACEMENT = 1u << 26;
+
+struct MphSlot {
+    uint32_t fingerprint;
+    uint32_t record;
+};
+
+uint64_t hashName(const std::string& name, uint64_t seed) {
+    uint64_t h = seed ^ (name.size() * 0x9E3779B97F4A7C15ULL);
+    size_t i = 0;
+    for (; i + 8 <= name.size(); i += 8) {
+        uint64_t chunk;
+        std::memcpy(&chunk, name.data() + i, 8);
+        h = mix64(h ^ chunk) * 0xBF58476D1CE4E5B9ULL;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, name.data() + i, name.size() - i);
+    return mix64(h ^ tail ^ (static_cast<uint64_t>(name.size() - i) << 56));
+}
+
+inline uint64_t reduceRange(uint64_t hash, uint64_t range) {
+    return static_cast<uint64_t>((static_cast<__uint128_t>(hash) * range) >> 64);
+}
+
+inline uint64_t mphBucket(uint64_t hash, uint64_t bucket_count) {
+    return reduceRange(hash, bucket_count);
+}
+
+inline uint64_t mphSlot(uint64_t hash, uint32_t displacement, uint64_t key_count) {
+    return reduceRange(mix64(hash + (displacement + 1) * 0x9E3779B97F4A7C15ULL), key_count);
+}
+
+inline uint32_t mphFingerprint(uint64_t hash) {
+    return static_cast<uint32_t>(mix64(hash ^ 0xD6E8FEB86659FD93ULL));
+}
+
+// names отсортированы; повторяющиеся имена отображаются на первое вхождение, как в ArchiveIndex::find.
+std::string buildHashIndex(const std::vector<IndexEntry>& entries) {
+    std::vector<uint32_t> records;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (i == 0 || entries[i].name != entries[i - 1].name) records.push_back(static_cast<uint32_t>(i));
+    }
+
+    uint64_t key_count = records.size();
+    uint64_t bucket_count = std::max<uint64_t>(1, (key_count + MPH_BUCKET_LOAD - 1) / MPH_BUCKET_LOAD);
+
+    for (uint64_t seed = 0x6D616B616B61ULL;; seed = mix64(seed + 1)) {
+        std::vector<uint64_t> hashes(key_count);
+        std::vector<uint64_t> bucket_start(bucket_count + 1, 0);
+        for (uint64_t k = 0; k < key_count; ++k) {
+            hashes[k] = hashName(entries[records[k]].name, seed);
+            bucket_start[mphBucket(hashes[k], bucket_count) + 1]++;
+        }
+        for (uint64_t b = 0; b < bucket_count; ++b) bucket_start[b + 1] += bucket_start[b];
+
+        std::vector<uint32_t> bucket_keys(key_count);
+        std::vector<uint64_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+        for (uint64_t k = 0; k < key_count; ++k) {
+            bucket_keys[fill[mphBucket(hashes[k], bucket_count)]++] = static_cast<uint32_t>(k);
+        }
+
+        std::vector<uint64_t> bucket_order(bucket_count);
+        for (uint64_t b = 0; b < bucket_count; ++b) bucket_order[b] = b;
+        std::stable_sort(bucket_order.begin(), bucket_order.end(), [&](uint64_t a, uint64_t b) {
+            return bucket_start[a + 1] - bucket_start[a] > bucket_start[b + 1] - bucket_start[b];
+        });
+
+        std::vector<uint32_t> displacements(bucket_count, 0);
+        std::vector<MphSlot> slots(key_count, MphSlot{0, UINT32_MAX});
+        std::vector<uint64_t> positions;
+        bool placed_all = true;
+
+        for (uint64_t b : bucket_order) {
+            uint64_t first = bucket_start[b], last = bucket_start[b + 1];
+            if (first == last) continue;
+
+            bool placed = false;
+            for (uint32_t d = 0; d < MPH_MAX_DISPLACEMENT && !placed; ++d) {
+                positions.clear();
+                placed = true;
+                for (uint64_t i = first; i < last && placed; ++i) {
+                    uint64_t slot = mphSlot(hashes[bucket_keys[i]], d, key_count);
+                    if (slots[slot].record != UINT32_MAX
+                        || std::find(positions.begin(), positions.end(), slot) != positions.end()) {
+                        placed = false;
+                    }
+                    positions.push_back(slot);
+                }
+                if (placed) {
+                    displacements[b] = d;
+                    for (uint64_t i = first; i < last; ++i) {
+                        uint32_t key = bucket_keys[i];
+                        slots[positions[i - first]] = MphSlot{mphFingerprint(hashes[key]), records[key]};
+                    }
+                }
+            }
+            if (!placed) {
+                placed_all = false;
+                break;
+            }
+        }
+        if (!placed_all) continue;
+
+        MphHeader header = {seed, key_count, bucket_count};
+        std::string table;
+        appendPod(table, header);
+        table.append(reinterpret_cast<const char*>(displacements.data()), displacements.size() * sizeof(uint32_t));
+        table.append(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(MphSlot));
+        return table;
+    }
+}
+
+// Хеши для фильтра Блума: имена и содержимое берутся с разными затравками, чтобы не смешивались.
+constexpr uint64_t BLOOM_NAME_SEED = 0x426C6F6F6D4E616DULL;
+constexpr uint64_t BLOOM_CONTENT_SEED = 0x426C6F6F6D437263ULL;
+
+inline uint64_t bloomContentHash(uint64_t content_hash) {
+    return mix64(content_hash ^ BLOOM_CONTENT_SEED);
+}
+
+// Двойное хеширование: k позиций вида h1 + i*h2 из одного 64-битного хеша.
+template <typename F>
+void bloomPositions(uint64_t hash, uint32_t hash_count, uint64_t bit_count, F&& f) {
+    uint64_t h1 = hash, h2 = mix64(hash) | 1;
+    for (uint32_t i = 0; i < hash_count; ++i) f(reduceRange(h1 + i * h2, bit_count));
+}
+
+std::string buildBloomFilter(const std::vector<IndexEntry>& entries) {
+    bool with_content = std::all_of(entries.begin(), entries.end(), [](const IndexEntry& entry) {
+        return entry.has_content_hash;
+    });
+    uint64_t key_count = entries.size() * (with_content ? 2 : 1);
+
+    BloomHeader header = {};
+    header.bit_count = std::max<uint64_t>(64, (key_count * BLOOM_BITS_PER_KEY + 63) / 64 * 64);
+    header.hash_count = BLOOM_HASH_COUNT;
+    header.flags = with_content ? BLOOM_HAS_CONTENT : 0;
+
+    std::vector<uint64_t> bits(header.bit_count / 64, 0);
+    auto add = [&](uint64_t hash) {
+        bloomPositions(hash, header.hash_count, header.bit_count, [&](uint64_t bit) {
+            bits[bit / 64] |= 1ULL << (bit % 64);
+        });
+    };
+    for (const auto& entry : entries) {
+        add(hashName(entry.name, BLOOM_NAME_SEED));
+        if (with_content) add(bloomContentHash(entry.content_hash));
+    }
+
+    std::string filter;
+    appendPod(filter, header);
+    filter.append(reinterpret_cast<const char*>(bits.data()), bits.size() * sizeof(uint64_t));
+    return filter;
+}
+
+}  // namespace
+
+uint64_t contentHash(const std::vector<uint8_t>& data) {
+    return lzma_crc64(data.data(), data.size(), 0);
+}
+
+uint64_t contentHash(const uint8_t* data, size_t size, uint64_t crc) {
+    return lzma_crc64(data, size, crc);
+}
+
+std::string buildCentralIndex(std::vector<IndexEntry>& entries, bool with_hash_index) {
+    std::stable_sort(entries.begin(), entries.end(), [](const IndexEntry& a, const IndexEntry& b) {
+        return a.name < b.name;
+    });
+
+    std::string records, blocks, keys, names;
+    for (auto& entry : entries) {
+        if (entry.has_content_hash) {
+            entry.record.content_hash = entry.content_hash;
+            entry.record.flags |= RECORD_CONTENT_HASH;
+        }
+        appendPod(records, entry.record);
+    }
+
+    for (size_t first = 0; first < entries.size(); first += INDEX_BLOCK_ENTRIES) {
+        size_t last = std::min<size_t>(entries.size(), first + INDEX_BLOCK_ENTRIES);
+        std::string raw;
+        std::vector<uint32_t> restarts;
+        for (size_t i = first; i < last; ++i) {
+            size_t shared = 0;
+            if ((i - first) % INDEX_RESTART_INTERVAL == 0) {
+                restarts.push_back(static_cast<uint32_t>(raw.size()));
+            } else {
+                shared = sharedPrefixLength(entries[i - 1].name, entries[i].name);
+            }
+            appendVarint(raw, shared);
+            appendVarint(raw, entries[i].name.size() - shared);
+            raw.append(entries[i].name, shared, std::string::npos);
+        }
+        for (uint32_t restart : restarts) appendPod(raw, restart);
+        appendPod(raw, static_cast<uint32_t>(restarts.size()));
+
+        std::string compressed(ZSTD_compressBound(raw.size()), '\0');
+        size_t compressed_size = ZSTD_compressCCtx(codec_contexts.zstdCompressor(), &compressed[0], compressed.size(),
+                                                   raw.data(), raw.size(), INDEX_ZSTD_LEVEL);
+        if (ZSTD_isError(compressed_size)) {
+            throw std::runtime_error("Index compression failed: " + std::string(ZSTD_getErrorName(compressed_size)));
+        }
+
+        IndexBlock block;
+        block.offset = names.size();
+        block.compressed_size = static_cast<uint32_t>(compressed_size);
+        block.raw_size = static_cast<uint32_t>(raw.size());
+        block.key_offset = static_cast<uint32_t>(keys.size());
+        block.key_length = static_cast<uint32_t>(entries[first].name.size());
+        appendPod(blocks, block);
+        keys += entries[first].name;
+        names.append(compressed, 0, compressed_size);
+    }
+
+    IndexHeader header = {};
+    header.magic = INDEX_MAGIC;
+    header.format_version = INDEX_FORMAT_VERSION;
+    header.record_size = sizeof(IndexRecord);
+    header.entry_count = entries.size();
+    header.block_entries = INDEX_BLOCK_ENTRIES;
+    header.restart_interval = INDEX_RESTART_INTERVAL;
+    header.block_count = blocks.size() / sizeof(IndexBlock);
+    header.records_offset = sizeof(IndexHeader);
+    header.blocks_offset = header.records_offset + records.size();
+    header.keys_offset = header.blocks_offset + blocks.size();
+    header.names_offset = header.keys_offset + keys.size();
+
+    std::string hash_table;
+    if (with_hash_index && !entries.empty()) {
+        hash_table = buildHashIndex(entries);
+        header.hash_offset = header.names_offset + names.size();
+        header.hash_size = hash_table.size();
+    }
+
+    std::string bloom = buildBloomFilter(entries);
+    header.bloom_offset = header.names_offset + names.size() + hash_table.size();
+    header.bloom_size = bloom.size();
+
+    std::string index;
+    appendPod(index, header);
+    index += records;
+    index += blocks;
+    index += keys;
+    index += names;
+    index += hash_table;
+    index += bloom;
+    return index;
+}
+
+MappedFile::MappedFile(int fd, uint64_t offset, uint64_t length) {
+    uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    uint64_t aligned = offset - offset % page;
+    map_length_ = length + (offset - aligned);
+    if (map_length_ == 0) return;
+    map_ = mmap(nullptr, map_length_, PROT_READ, MAP_SHARED, fd, static_cast<off_t>(aligned));
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        throw std::runtime_error("Failed to map archive index");
+    }
+    data_ = static_cast<const uint8_t*>(map_) + (offset - aligned);
+    size_ = length;
+}
+
+MappedFile::~MappedFile() {
+    if (map_) munmap(map_, map_length_);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    std::swap(map_, other.map_);
+    std::swap(map_length_, other.map_length_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+}
+
+namespace {
+
+// Разбор варинта из памяти; pos сдвигается за прочитанное значение.
+uint64_t decodeVarint(const uint8_t* data, size_t size, size_t& pos) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64 && pos < size; shift += 7) {
+        uint8_t byte = data[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Corrupted index: bad varint");
+}
+
+}  // namespace
+
+ArchiveIndex::ArchiveIndex(const uint8_t* data, uint64_t size) : data_(data), size_(size) {
+    if (size < INDEX_HEADER_V1_SIZE) throw std::runtime_error("Corrupted index: too small");
+    header_ = {};
+    std::memcpy(&header_, data, INDEX_HEADER_V1_SIZE);
+    if (header_.format_version >= 2) {
+        size_t header_size = header_.format_version >= 3 ? sizeof(IndexHeader) : INDEX_HEADER_V2_SIZE;
+        if (size < header_size) throw std::runtime_error("Corrupted index: too small");
+        std::memcpy(&header_, data, header_size);
+    }
+    if (header_.magic != INDEX_MAGIC || header_.format_version == 0 || header_.format_version > INDEX_FORMAT_VERSION
+        || header_.record_size < INDEX_RECORD_V1_SIZE || header_.block_entries == 0 || header_.restart_interval == 0) {
+        throw std::runtime_error("Corrupted index: bad header");
+    }
+    if (header_.block_count != (header_.entry_count + header_.block_entries - 1) / header_.block_entries
+        || header_.records_offset + header_.entry_count * header_.record_size > header_.blocks_offset
+        || header_.blocks_offset + header_.block_count * sizeof(IndexBlock) > header_.keys_offset
+        || header_.keys_offset > header_.names_offset || header_.names_offset > size
+        || header_.hash_offset + header_.hash_size > size
+        || header_.bloom_offset + header_.bloom_size > size) {
+        throw std::runtime_error("Corrupted index: bad layout");
+    }
+
+    if (header_.bloom_size) {
+        if (header_.bloom_size < sizeof(BloomHeader)) throw std::runtime_error("Corrupted index: bad bloom filter");
+        std::memcpy(&bloom_, data_ + header_.bloom_offset, sizeof(bloom_));
+        if (bloom_.bit_count == 0 || bloom_.bit_count % 64 != 0 || bloom_.hash_count == 0
+            || sizeof(BloomHeader) + bloom_.bit_count / 8 != header_.bloom_size) {
+            throw std::runtime_error("Corrupted index: bad bloom filter");
+        }
+    }
+
+    if (header_.hash_size) {
+        if (header_.hash_size < sizeof(MphHeader)) throw std::runtime_error("Corrupted index: bad hash table");
+        std::memcpy(&mph_, data_ + header_.hash_offset, sizeof(mph_));
+        if (mph_.key_count == 0 || mph_.key_count > header_.entry_count || mph_.bucket_count == 0
+            || sizeof(MphHeader) + mph_.bucket_count * sizeof(uint32_t) + mph_.key_count * sizeof(MphSlot) != header_.hash_size) {
+            throw std::runtime_error("Corrupted index: bad hash table");
+        }
+    }
+}
+
+bool ArchiveIndex::lookup(const std::string& name, IndexRecord& result) const {
+    if (!hasHashIndex()) return find(name, result);
+
+    const uint8_t* table = data_ + header_.hash_offset;
+    uint64_t hash = hashName(name, mph_.seed);
+    uint32_t displacement;
+    std::memcpy(&displacement, table + sizeof(MphHeader) + mphBucket(hash, mph_.bucket_count) * sizeof(uint32_t), 4);
+
+    MphSlot slot;
+    uint64_t slots_offset = sizeof(MphHeader) + mph_.bucket_count * sizeof(uint32_t);
+    std::memcpy(&slot, table + slots_offset + mphSlot(hash, displacement, mph_.key_count) * sizeof(MphSlot), sizeof(slot));
+    if (slot.fingerprint != mphFingerprint(hash) || slot.record >= header_.entry_count) return false;
+
+    result = record(slot.record);
+    return true;
+}
+
+bool ArchiveIndex::bloomTest(uint64_t hash) const {
+    const uint8_t* bits = data_ + header_.bloom_offset + sizeof(BloomHeader);
+    bool present = true;
+    bloomPositions(hash, bloom_.hash_count, bloom_.bit_count, [&](uint64_t bit) {
+        if (!(bits[bit / 8] & (1u << (bit % 8)))) present = false;
+    });
+    return present;
+}
+
+bool ArchiveIndex::mayContainName(const std::string& name) const {
+    return !hasBloomFilter() || bloomTest(hashName(name, BLOOM_NAME_SEED));
+}
+
+bool ArchiveIndex::mayContainContent(uint64_t content_hash) const {
+    return !hasBloomFilter() || !(bloom_.flags & BLOOM_HAS_CONTENT) || bloomTest(bloomContentHash(content_hash));
+}
+
+bool ArchiveIndex::find(const std::string& name, IndexRecord& result) const {
+    // Нижняя граница: повторяющееся имя может начинать следующий блок или группу рестарта, поэтому
+    // поиск начинается с последнего ключа строго меньше name и идёт вперёд до первого вхождения.
+    uint64_t lo = 0, hi = header_.block_count;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (blockKey(mid) < name) lo = mid + 1;
+        else hi = mid;
+    }
+
+    std::string candidate;
+    for (uint64_t b = lo > 0 ? lo - 1 : 0; b < header_.block_count; ++b) {
+        std::string raw = decodeBlock(b);
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(raw.data());
+        size_t names_end = namesEnd(raw);
+        size_t pos = 0;
+        uint64_t i = b * header_.block_entries;
+
+        if (b + 1 == lo) {
+            uint32_t restart_count;
+            std::memcpy(&restart_count, raw.data() + raw.size() - 4, 4);
+            auto restartOffset = [&](uint32_t r) {
+                uint32_t offset;
+                std::memcpy(&offset, raw.data() + names_end + r * 4, 4);
+                return offset;
+            };
+            uint32_t rlo = 0, rhi = restart_count;
+            while (rlo < rhi) {
+                uint32_t mid = (rlo + rhi) / 2;
+                size_t restart_pos = restartOffset(mid);
+                nextName(p, names_end, restart_pos, candidate);
+                if (candidate < name) rlo = mid + 1;
+                else rhi = mid;
+            }
+            if (rlo > 0) {
+                pos = restartOffset(rlo - 1);
+                i += uint64_t(rlo - 1) * header_.restart_interval;
+            }
+        }
+
+        for (; pos < names_end; ++i) {
+            checkBlockRecord(b, i);
+            nextName(p, names_end, pos, candidate);
+            if (candidate == name) {
+                result = record(i);
+                return true;
+            }
+            if (candidate > name) return false;
+        }
+    }
+    return false;
+}
+
+IndexBlock ArchiveIndex::block(uint64_t b) const {
+    IndexBlock block;
+    std::memcpy(&block, data_ + header_.blocks_offset + b * sizeof(IndexBlock), sizeof(block));
+    return block;
+}
+
+std::string ArchiveIndex::blockKey(uint64_t b) const {
+    IndexBlock info = block(b);
+    if (header_.keys_offset + info.key_offset + info.key_length > header_.names_offset) {
+        throw std::runtime_error("Corrupted index: bad block key");
+    }
+    return std::string(reinterpret_cast<const char*>(data_ + header_.keys_offset + info.key_offset), info.key_length);
+}
+
+std::string ArchiveIndex::decodeBlock(uint64_t b) const {
+    IndexBlock info = block(b);
+    if (header_.names_offset + info.offset + info.compressed_size > size_ || info.raw_size < 4) {
+        throw std::runtime_error("Corrupted index: bad block");
+    }
+    std::string raw(info.raw_size, '\0');
+    size_t result = ZSTD_decompressDCtx(codec_contexts.zstdDecompressor(), &raw[0], raw.size(),
+                                        data_ + header_.names_offset + info.offset, info.compressed_size);
+    if (ZSTD_isError(result) || result != raw.size()) {
+        throw std::runtime_error("Corrupted index: block decompression failed");
+    }
+    return raw;
+}
+
+size_t ArchiveIndex::namesEnd(const std::string& raw) {
+    uint32_t restart_count;
+    std::memcpy(&restart_count, raw.data() + raw.size() - 4, 4);
+    if (uint64_t(restart_count) * 4 + 4 > raw.size()) throw std::runtime_error("Corrupted index: bad restarts");
+    return raw.size() - 4 - restart_count * 4;
+}
+
+void ArchiveIndex::nextName(const uint8_t* p, size_t end, size_t& pos, std::string& name) {
+    uint64_t shared = decodeVarint(p, end, pos);
+    uint64_t suffix = decodeVarint(p, end, pos);
+    if (shared > name.size() || suffix > end - pos) throw std::runtime_error("Corrupted index: bad name");
+    name.resize(shared);
+    name.append(reinterpret_cast<const char*>(p + pos), suffix);
+    pos += suffix;
+}
+
+std::string scanArchiveIndex(const std::string& path) {
+    ArchiveInput in(path);
+    ArchiveHeader archive = readArchiveHeader(in);
+
+    std::vector<IndexEntry> entries;
+    EntryHeader entry;
+    for (uint32_t i = 0; i < archive.file_count; ++i) {
+        readEntryHeader(in, archive.version, entry);
+
+        IndexEntry index_entry;
+        index_entry.name = entry.name;
+        index_entry.record = {};
+        index_entry.record.data_offset = in.position();
+        index_entry.record.original_size = entry.original_size;
+        index_entry.record.compressed_size = entry.compressed_size;
+        index_entry.record.archive_position = i;
+        index_entry.record.filter_type = entry.filter.type;
+        index_entry.record.filter_param = entry.filter.param;
+        index_entry.record.flags = recordFlags(entry);
+        entries.push_back(std::move(index_entry));
+
+        in.skip(entry.compressed_size);
+    }
+    return buildCentralIndex(entries);
+}
+
+// Sidecar-индекс "<архив>.idx": SidecarHeader, затем центральный индекс в формате 2.1.
+// Действителен, пока совпадают размер архива, mtime и CRC64 первых SIDECAR_HASHED_BYTES байт.
+constexpr uint64_t SIDECAR_MAGIC = 0x3143454449534B4DULL;  // "MKSIDEC1"
+constexpr size_t SIDECAR_HASHED_BYTES = 64 * 1024;
+
+struct SidecarHeader {
+    uint64_t magic;
+    uint64_t archive_size;
+    int64_t archive_mtime_ns;
+    uint64_t header_hash;
+    uint16_t version;
+    uint16_t compression;
+    uint32_t file_count;
+};
+
+static_assert(sizeof(SidecarHeader) == 40, "SidecarHeader layout");
+
+std::string sidecarPath(const std::string& archive_path) {
+    return archive_path + ".idx";
+}
+
+int64_t mtimeNanoseconds(const struct stat& st) {
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+namespace {
+
+uint64_t archiveHeaderHash(int fd, uint64_t archive_size) {
+    std::vector<uint8_t> head(std::min<uint64_t>(archive_size, SIDECAR_HASHED_BYTES));
+    if (pread(fd, head.data(), head.size(), 0) != static_cast<ssize_t>(head.size())) {
+        throw std::runtime_error("Failed to read archive header");
+    }
+    return lzma_crc64(head.data(), head.size(), 0);
+}
+
+ArchiveHeader readArchiveHeaderAt(int fd) {
+    uint8_t raw[12];
+    if (pread(fd, raw, sizeof(raw), 0) != sizeof(raw)) {
+        throw std::runtime_error("Failed to read archive header");
+    }
+
+    uint32_t signature;
+    ArchiveHeader header;
+    std::memcpy(&signature, raw, 4);
+    std::memcpy(&header.version, raw + 4, 2);
+    std::memcpy(&header.compression, raw + 6, 2);
+    std::memcpy(&header.file_count, raw + 8, 4);
+    if (signature != MAKAKA_SIGNATURE) {
+        throw std::runtime_error("Invalid file format");
+    }
+    if (header.version > MAKAKA_VERSION) {
+        throw std::runtime_error("Unsupported archive version");
+    }
+    return header;
+}
+
+// Записывает sidecar атомарно (через временный файл и rename); false — каталог недоступен для записи.
+bool writeSidecar(const std::string& archive_path, const SidecarHeader& header, const std::string& index) {
+    std::string final_path = sidecarPath(archive_path);
+    std::string temp_path = final_path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(temp_path, std::ios::binary);
+        if (!out) return false;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(index.data(), index.size());
+        if (!out) {
+            out.close();
+            std::remove(temp_path.c_str());
+            return false;
+        }
+    }
+    if (std::rename(temp_path.c_str(), final_path.c_str()) != 0) {
+        std::remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+std::string volumePath(const std::string& base_path, const std::string& dir, uint32_t volume) {
+    char suffix[16];
+    std::snprintf(suffix, sizeof(suffix), ".%03u", volume);
+    std::string name = base_path.substr(base_path.find_last_of('/') + 1) + suffix;
+    return dir.empty() ? name : dir + "/" + name;
+}
+
+std::vector<std::string> findVolumes(const std::string& path, const std::vector<std::string>& volume_dirs) {
+    struct stat st;
+    bool numbered = path.size() > 4 && path.compare(path.size() - 4, 4, ".001") == 0;
+    if (!numbered && ::stat(path.c_str(), &st) == 0) return {path};
+
+    std::string base = numbered ? path.substr(0, path.size() - 4) : path;
+    size_t slash = base.find_last_of('/');
+    std::vector<std::string> dirs = {slash == std::string::npos ? std::string() : base.substr(0, slash)};
+    dirs.insert(dirs.end(), volume_dirs.begin(), volume_dirs.end());
+
+    std::vector<std::string> volumes;
+    for (uint32_t volume = 1;; ++volume) {
+        auto dir = std::find_if(dirs.begin(), dirs.end(), [&](const std::string& candidate) {
+            return ::stat(volumePath(base, candidate, volume).c_str(), &st) == 0;
+        });
+        if (dir == dirs.end()) break;
+        volumes.push_back(volumePath(base, *dir, volume));
+    }
+    if (volumes.empty()) return {path};
+    return volumes;
+}
+
+IndexedArchive::IndexedArchive(const std::string& path, IndexBuild build, const std::vector<std::string>& volume_dirs) {
+    try {
+        openVolumes(findVolumes(path, volume_dirs));
+        openIndex(path, build);
+    } catch (...) {
+        for (const auto& volume : volumes_) close(volume.fd);
+        throw;
+    }
+}
+
+IndexedArchive::~IndexedArchive() {
+    for (const auto& volume : volumes_) close(volume.fd);
+}
+
+void IndexedArchive::openVolumes(const std::vector<std::string>& paths) {
+    for (const auto& volume_path : paths) {
+        int fd = open(volume_path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Failed to open archive");
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to stat archive");
+        }
+        volumes_.push_back({fd, total_size_, static_cast<uint64_t>(st.st_size)});
+        total_size_ += st.st_size;
+    }
+    // Все тома, кроме последнего, одного размера: иначе набор неполный или перемешан.
+    for (size_t i = 1; i + 1 < volumes_.size(); ++i) {
+        if (volumes_[i].size != volumes_[0].size) throw std::runtime_error("Corrupted archive: volume size mismatch");
+    }
+}
+
+size_t IndexedArchive::volumeAt(uint64_t offset) const {
+    return std::upper_bound(volumes_.begin(), volumes_.end(), offset, [](uint64_t value, const Volume& v) {
+        return value < v.offset;
+    }) - volumes_.begin() - 1;
+}
+
+void IndexedArchive::readAt(void* data, uint64_t size, uint64_t offset) const {
+    uint8_t* out = static_cast<uint8_t*>(data);
+    auto volume = volumes_.begin() + volumeAt(offset);
+    while (size > 0) {
+        if (volume == volumes_.end() || offset >= volume->offset + volume->size) {
+            throw std::runtime_error("Failed to read archive entry");
+        }
+        uint64_t chunk = std::min(size, volume->offset + volume->size - offset);
+        ssize_t n = pread(volume->fd, out, chunk, offset - volume->offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error("Failed to read archive entry");
+        out += n;
+        offset += n;
+        size -= n;
+        if (offset == volume->offset + volume->size) ++volume;
+    }
+}
+
+std::vector<uint8_t> IndexedArchive::readCompressed(const IndexRecord& record) const {
+    return readRaw(record.data_offset, record.compressed_size);
+}
+
+std::vector<uint8_t> IndexedArchive::readRaw(uint64_t offset, uint64_t size) const {
+    std::vector<uint8_t> data(size);
+    readAt(data.data(), data.size(), offset);
+    return data;
+}
+
+ChunkTable IndexedArchive::readChunkTable(const IndexRecord& record) const {
+    ChunkTableHeader header;
+    if (record.compressed_size < sizeof(header)) throw std::runtime_error("Corrupted archive: bad chunk table");
+    readAt(&header, sizeof(header), record.data_offset);
+    uint64_t table_size = sizeof(header) + static_cast<uint64_t>(header.chunk_count) * sizeof(uint32_t);
+    if (table_size > record.compressed_size) throw std::runtime_error("Corrupted archive: bad chunk table");
+    std::vector<uint8_t> table = readRaw(record.data_offset, table_size);
+    return parseChunkTable(table.data(), table.size(), record.compressed_size, record.original_size);
+}
+
+void IndexedArchive::openIndex(const std::string& path, IndexBuild build) {
+    int fd = volumes_[0].fd;
+    header_ = readArchiveHeaderAt(fd);
+
+    if (header_.version >= MAKAKA_VERSION_2_1) {
+        ArchiveFooter footer;
+        if (total_size_ < 12 + sizeof(footer)) throw std::runtime_error("Corrupted archive: bad footer");
+        readAt(&footer, sizeof(footer), total_size_ - sizeof(footer));
+        if (footer.magic != FOOTER_MAGIC || footer.index_offset + footer.index_size + sizeof(footer) != total_size_) {
+            throw std::runtime_error("Corrupted archive: bad footer");
+        }
+
+        // Индекс, целиком лежащий в одном томе, отображается; разрезанный границей томов — читается.
+        source_ = INDEX_EMBEDDED;
+        for (const auto& volume : volumes_) {
+            if (footer.index_offset >= volume.offset && footer.index_offset + footer.index_size <= volume.offset + volume.size) {
+                map_ = MappedFile(volume.fd, footer.index_offset - volume.offset, footer.index_size);
+                index_.reset(new ArchiveIndex(map_.data(), map_.size()));
+                return;
+            }
+        }
+        owned_index_.resize(footer.index_size);
+        readAt(&owned_index_[0], owned_index_.size(), footer.index_offset);
+        index_.reset(new ArchiveIndex(reinterpret_cast<const uint8_t*>(owned_index_.data()), owned_index_.size()));
+        return;
+    }
+    if (volumes_.size() > 1) throw std::runtime_error("Multi-volume archive has no index");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) throw std::runtime_error("Failed to stat archive");
+
+    SidecarHeader expected = {};
+    expected.magic = SIDECAR_MAGIC;
+    expected.archive_size = st.st_size;
+    expected.archive_mtime_ns = mtimeNanoseconds(st);
+    expected.header_hash = archiveHeaderHash(fd, st.st_size);
+    expected.version = header_.version;
+    expected.compression = header_.compression;
+    expected.file_count = header_.file_count;
+
+    if (openSidecar(path, expected)) return;
+    if (build == INDEX_BUILD_NONE) throw std::runtime_error("Archive has no index");
+
+    owned_index_ = scanArchiveIndex(path);
+    if (build == INDEX_BUILD_SIDECAR && writeSidecar(path, expected, owned_index_) && openSidecar(path, expected)) {
+        owned_index_.clear();
+        return;
+    }
+    index_.reset(new ArchiveIndex(reinterpret_cast<const uint8_t*>(owned_index_.data()), owned_index_.size()));
+    source_ = INDEX_IN_MEMORY;
+}
+
+bool IndexedArchive::openSidecar(const std::string& path, const SidecarHeader& expected) {
+    int fd = open(sidecarPath(path).c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    SidecarHeader header;
+    bool valid = fstat(fd, &st) == 0 && st.st_size > static_cast<off_t>(sizeof(header))
+              && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+              && std::memcmp(&header, &expected, sizeof(header)) == 0;
+    try {
+        if (valid) {
+            map_ = MappedFile(fd, sizeof(header), st.st_size - sizeof(header));
+            index_.reset(new ArchiveIndex(map_.data(), map_.size()));
+            source_ = INDEX_SIDECAR;
+        }
+    } catch (const std::exception&) {
+        valid = false;
+    }
+    close(fd);
+    return valid;
+}
+
+std::string encodeChunkTable(uint32_t chunk_size, const std::vector<uint32_t>& compressed_sizes) {
+    ChunkTableHeader header = {static_cast<uint32_t>(compressed_sizes.size()), chunk_size};
+    std::string table;
+    appendPod(table, header);
+    table.append(reinterpret_cast<const char*>(compressed_sizes.data()), compressed_sizes.size() * sizeof(uint32_t));
+    return table;
+}
+
+ChunkTable parseChunkTable(const uint8_t* data, size_t size, uint64_t compressed_size, uint64_t original_size) {
+    ChunkTableHeader header;
+    if (size < sizeof(header)) throw std::runtime_error("Corrupted archive: bad chunk table");
+    std::memcpy(&header, data, sizeof(header));
+    uint64_t table_size = sizeof(header) + static_cast<uint64_t>(header.chunk_count) * sizeof(uint32_t);
+    if (header.chunk_size == 0 || size < table_size
+        || header.chunk_count != (original_size + header.chunk_size - 1) / header.chunk_size) {
+        throw std::runtime_error("Corrupted archive: bad chunk table");
+    }
+
+    ChunkTable table;
+    table.chunk_size = header.chunk_size;
+    table.offsets.push_back(table_size);
+    for (uint32_t k = 0; k < header.chunk_count; ++k) {
+        uint32_t chunk;
+        std::memcpy(&chunk, data + sizeof(header) + k * sizeof(uint32_t), sizeof(chunk));
+        table.offsets.push_back(table.offsets.back() + chunk);
+    }
+    if (table.offsets.back() != compressed_size) throw std::runtime_error("Corrupted archive: bad chunk table");
+    return table;
+}
+
+namespace {
+
+// Умножение вектора на матрицу над GF(2) и возведение матрицы в квадрат — как в crc32_combine zlib.
+uint64_t gf2MatrixTimes(const uint64_t* matrix, uint64_t vector) {
+    uint64_t sum = 0;
+    for (; vector; vector >>= 1, ++matrix) {
+        if (vector & 1) sum ^= *matrix;
+    }
+    return sum;
+}
+
+void gf2MatrixSquare(uint64_t* square, const uint64_t* matrix) {
+    for (int n = 0; n < 64; ++n) square[n] = gf2MatrixTimes(matrix, matrix[n]);
+}
+
+}  // namespace
+
+uint64_t crc64Combine(uint64_t crc1, uint64_t crc2, uint64_t length2) {
+    if (length2 == 0) return crc1;
+
+    // Оператор "дописать один нулевой бит" для отражённого полинома CRC-64/XZ (ECMA-182).
+    uint64_t odd[64], even[64];
+    odd[0] = 0xC96C5795D7870F42ULL;
+    for (int n = 1; n < 64; ++n) odd[n] = 1ULL << (n - 1);
+    gf2MatrixSquare(even, odd);  // два нулевых бита
+    gf2MatrixSquare(odd, even);  // четыре
+
+    // Как и в crc32_combine, инверсии начального и конечного значения взаимно гасятся: достаточно
+    // сдвинуть crc1 на length2 нулевых байт и сложить с crc2.
+    do {
+        gf2MatrixSquare(even, odd);
+        if (length2 & 1) crc1 = gf2MatrixTimes(even, crc1);
+        length2 >>= 1;
+        if (length2 == 0) break;
+        gf2MatrixSquare(odd, even);
+        if (length2 & 1) crc1 = gf2MatrixTimes(odd, crc1);
+        length2 >>= 1;
+    } while (length2 != 0);
+    return crc1 ^ crc2;
+}
+
+std::vector<uint8_t> decodeEntryData(uint16_t compression, EntryFilter filter, uint64_t original_size,
+                                     const std::vector<uint8_t>& compressed_data, uint16_t flags) {
+    if (flags & ENTRY_REFERENCES) throw std::runtime_error("Entry is stored in a chunk repository");
+    const Codec* codec = findCodec(compression);
+    if (!codec) throw std::runtime_error("Unsupported compression " + std::to_string(compression));
+    bool separate_filter = !(codec->capabilities & CODEC_FILTER_CHAIN);
+    std::vector<uint8_t> file_data(original_size);
+
+    // Куски записи с ENTRY_CHUNKED декодируются сразу на свои места в результате.
+    if (flags & ENTRY_CHUNKED) {
+        ChunkTable table = parseChunkTable(compressed_data.data(), compressed_data.size(), compressed_data.size(),
+                                           original_size);
+        for (size_t k = 0; k < table.count(); ++k) {
+            uint8_t* chunk = file_data.data() + static_cast<uint64_t>(k) * table.chunk_size;
+            size_t chunk_size = table.originalSize(k, original_size);
+            codec->decode(compressed_data.data() + table.offsets[k], table.compressedSize(k), chunk, chunk_size, filter);
+            if (separate_filter) applyFilter(chunk, chunk_size, filter, false);
+        }
+        return file_data;
+    }
+
+    codec->decode(compressed_data.data(), compressed_data.size(), file_data.data(), original_size, filter);
+    if (separate_filter) applyFilter(file_data, filter, false);
+    return file_data;
+}
+
+namespace {
+
+std::string readFirstLine(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+// Значения лимитов cgroup выше этого порога означают "без лимита" (v1 пишет почти 2^63).
+constexpr uint64_t CGROUP_UNLIMITED = 1ULL << 60;
+
+struct CgroupLimits {
+    double cpu_quota = 0;
+    uint64_t memory_limit = 0;
+
+    void addCpu(double quota) {
+        if (quota > 0 && (cpu_quota == 0 || quota < cpu_quota)) cpu_quota = quota;
+    }
+
+    void addMemory(uint64_t limit) {
+        if (limit > 0 && limit < CGROUP_UNLIMITED && (memory_limit == 0 || limit < memory_limit)) memory_limit = limit;
+    }
+};
+
+// Каталоги группы процесса от листа до корня иерархии. Внутри контейнера путь из /proc/self/cgroup
+// может не существовать (корень смонтирован в неймспейсе) — тогда действуют лимиты корня.
+std::vector<std::string> cgroupDirs(const std::string& mount, std::string path) {
+    std::vector<std::string> dirs;
+    while (!path.empty() && path != "/") {
+        dirs.push_back(mount + path);
+        path = path.substr(0, path.find_last_of('/'));
+    }
+    dirs.push_back(mount);
+    return dirs;
+}
+
+CgroupLimits detectCgroupLimits() {
+    CgroupLimits limits;
+    std::ifstream in("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t first = line.find(':'), second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) continue;
+        std::string controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+        std::string path = line.substr(second + 1);
+
+        if (controllers == ",,") {
+            for (const auto& dir : cgroupDirs("/sys/fs/cgroup", path)) {
+                std::istringstream cpu(readFirstLine(dir + "/cpu.max"));
+                std::string quota;
+                double period = 0;
+                if (cpu >> quota >> period && quota != "max" && period > 0) limits.addCpu(std::stod(quota) / period);
+
+                std::string memory = readFirstLine(dir + "/memory.max");
+                if (!memory.empty() && memory != "max") limits.addMemory(std::stoull(memory));
+            }
+        }
+        if (controllers.find(",cpu,") != std::string::npos) {
+            for (const auto& mount : {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+                for (const auto& dir : cgroupDirs(mount, path)) {
+                    std::string quota = readFirstLine(dir + "/cpu.cfs_quota_us");
+                    std::string period = readFirstLine(dir + "/cpu.cfs_period_us");
+                    if (!quota.empty() && !period.empty() && std::stoll(quota) > 0 && std::stoll(period) > 0) {
+                        limits.addCpu(static_cast<double>(std::stoll(quota)) / std::stoll(period));
+                    }
+                }
+            }
+        }
+        if (controllers.find(",memory,") != std::string::npos) {
+            for (const auto& dir : cgroupDirs("/sys/fs/cgroup/memory", path)) {
+                std::string limit = readFirstLine(dir + "/memory.limit_in_bytes");
+                if (!limit.empty()) limits.addMemory(std::stoull(limit));
+            }
+        }
+    }
+    return limits;
+}
+
+int cpuNode(int cpu) {
+    DIR* dir = opendir(("/sys/devices/system/cpu/cpu" + std::to_string(cpu)).c_str());
+    if (!dir) return -1;
+    int node = -1;
+    while (dirent* entry = readdir(dir)) {
+        if (std::strncmp(entry->d_name, "node", 4) == 0 && std::isdigit(static_cast<unsigned char>(entry->d_name[4]))) {
+            node = std::atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+std::atomic<unsigned> worker_limit{0};
+std::atomic<int> pin_mode{PIN_NONE};
+
+}  // namespace
+
+CpuLayout detectCpuLayout() {
+    CpuLayout layout;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &mask)) layout.cpus.push_back(cpu);
+        }
+    }
+    if (layout.cpus.empty()) {
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) layout.cpus.push_back(cpu);
+    }
+    for (int cpu : layout.cpus) layout.cpu_nodes.push_back(cpuNode(cpu));
+
+    try {
+        CgroupLimits limits = detectCgroupLimits();
+        layout.cpu_quota = limits.cpu_quota;
+        layout.memory_limit = limits.memory_limit;
+    } catch (const std::exception&) {
+        // Нечитаемые файлы cgroup — считаем, что лимитов нет.
+    }
+
+    uint64_t workers = layout.cpus.size();
+    if (layout.cpu_quota > 0) workers = std::min<uint64_t>(workers, static_cast<uint64_t>(std::ceil(layout.cpu_quota)));
+    if (layout.memory_limit > 0) workers = std::min<uint64_t>(workers, layout.memory_limit / WORKER_MEMORY_ESTIMATE);
+    layout.workers = static_cast<unsigned>(std::max<uint64_t>(1, workers));
+    return layout;
+}
+
+const CpuLayout& cpuLayout() {
+    static const CpuLayout layout = detectCpuLayout();
+    return layout;
+}
+
+void setWorkerLimit(unsigned workers) {
+    worker_limit = workers;
+}
+
+void setPinMode(PinMode mode) {
+    pin_mode = mode;
+}
+
+PinMode pinMode() {
+    return static_cast<PinMode>(pin_mode.load());
+}
+
+unsigned workerCount(size_t tasks) {
+    unsigned workers = worker_limit > 0 ? worker_limit.load() : cpuLayout().workers;
+    return static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(workers, tasks)));
+}
+
+void pinCurrentWorker(unsigned worker) {
+    const CpuLayout& layout = cpuLayout();
+    PinMode mode = pinMode();
+    if (mode == PIN_NONE || layout.cpus.empty()) return;
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    std::vector<int> nodes(layout.cpu_nodes);
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    if (mode == PIN_NUMA && !nodes.empty() && nodes.front() >= 0) {
+        int node = nodes[worker % nodes.size()];
+        for (size_t i = 0; i < layout.cpus.size(); ++i) {
+            if (layout.cpu_nodes[i] == node) CPU_SET(layout.cpus[i], &mask);
+        }
+    } else {
+        CPU_SET(layout.cpus[worker % layout.cpus.size()], &mask);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+}
+
+namespace {
+
+// Пул и номер потока, на котором выполняется задача: submit из задачи ставит в очередь этого потока.
+thread_local WorkStealingPool* current_pool = nullptr;
+thread_local size_t current_worker = 0;
+
+}  // namespace
+
+WorkStealingPool::WorkStealingPool(unsigned worker_count) {
+    if (worker_count == 0) worker_count = workerCount();
+    for (unsigned i = 0; i < worker_count; ++i) workers_.emplace_back(new Worker());
+    for (unsigned i = 0; i < worker_count; ++i) {
+        threads_.emplace_back([this, i] {
+            pinCurrentWorker(i);
+            current_pool = this;
+            current_worker = i;
+            workerLoop(i);
+        });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    work_available_.notify_all();
+    for (auto& thread : threads_) thread.join();
+}
+
+void WorkStealingPool::submit(Task task) {
+    // Счётчики растут до того, как задача станет видна: иначе взявший её поток уменьшил бы их раньше.
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++queued_;
+    ++unfinished_;
+    if (current_pool == this) {
+        lock.unlock();
+        Worker& worker = *workers_[current_worker];
+        std::lock_guard<std::mutex> worker_lock(worker.mutex);
+        worker.tasks.push_back(std::move(task));
+    } else {
+        injected_.push_back(std::move(task));
+        lock.unlock();
+    }
+    work_available_.notify_one();
+}
+
+bool WorkStealingPool::take(size_t worker, Task& task) {
+    {
+        Worker& own = *workers_[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+        }
+    }
+    for (size_t i = 1; !task && i < workers_.size(); ++i) {
+        Worker& victim = *workers_[(worker + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!task && !injected_.empty()) {
+        task = std::move(injected_.front());
+        injected_.pop_front();
+    }
+    if (!task) return false;
+    --queued_;
+    return true;
+}
+
+void WorkStealingPool::workerLoop(size_t worker) {
+    for (;;) {
+        Task task;
+        if (!take(worker, task)) {
+            // queued_ > 0 без задачи в очередях — задача вот-вот будет добавлена, пробуем снова.
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_available_.wait(lock, [&] { return stop_ || queued_ > 0; });
+            if (stop_ && queued_ == 0) return;
+            continue;
+        }
+
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_) error_ = std::current_exception();
+        }
+        task = nullptr;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--unfinished_ == 0) all_done_.notify_all();
+    }
+}
+
+void WorkStealingPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    all_done_.wait(lock, [&] { return unfinished_ == 0; });
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+BlockCache::BlockCache(uint64_t capacity_bytes, size_t shard_count)
+    : capacity_(capacity_bytes) {
+    if (shard_count == 0) shard_count = 1;
+    shard_capacity_ = capacity_bytes / shard_count;
+    for (size_t i = 0; i < shard_count; ++i) {
+        shards_.emplace_back(new Shard());
+    }
+}
+
+size_t BlockCache::KeyHash::operator()(const BlockKey& key) const {
+    return static_cast<size_t>(mix64(key.archive * 0x9E3779B97F4A7C15ULL ^ key.block));
+}
+
+BlockCache::Shard& BlockCache::shardFor(const BlockKey& key) {
+    // Старшие биты хэша — для шарда, младшие остаются unordered_map внутри шарда.
+    return *shards_[(KeyHash()(key) >> 32) % shards_.size()];
+}
+
+BlockCache::Block BlockCache::find(const BlockKey& key) {
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.blocks.find(key);
+    if (it == shard.blocks.end()) {
+        ++shard.misses;
+        return nullptr;
+    }
+    ++shard.hits;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+}
+
+void BlockCache::insert(const BlockKey& key, Block block) {
+    if (!block || block->size() > shard_capacity_) return;
+
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto it = shard.blocks.find(key);
+    if (it != shard.blocks.end()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return;
+    }
+
+    while (!shard.lru.empty() && shard.bytes + block->size() > shard_capacity_) {
+        shard.bytes -= shard.lru.back().second->size();
+        shard.blocks.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+        ++shard.evictions;
+    }
+    shard.bytes += block->size();
+    shard.lru.emplace_front(key, std::move(block));
+    shard.blocks[key] = shard.lru.begin();
+}
+
+void BlockCache::clear() {
+    for (auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->lru.clear();
+        shard->blocks.clear();
+        shard->bytes = 0;
+    }
+}
+
+BlockCacheStats BlockCache::stats() const {
+    BlockCacheStats stats;
+    for (const auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        stats.hits += shard->hits;
+        stats.misses += shard->misses;
+        stats.evictions += shard->evictions;
+        stats.bytes += shard->bytes;
+        stats.blocks += shard->lru.size();
+    }
+    return stats;
+}
+
+ArchiveReader::ArchiveReader(const std::string& path, std::shared_ptr<BlockCache> cache,
+                             const std::vector<std::string>& volume_dirs,
+                             std::shared_ptr<const ChunkRepository> repository)
+    : archive_(path, INDEX_BUILD_MEMORY, volume_dirs), cache_(std::move(cache)), repository_(std::move(repository)) {
+    static std::atomic<uint64_t> next_cache_id{1};
+    cache_id_ = next_cache_id++;
+    access_slots_ = std::max<uint64_t>(archive_.header().file_count, archive_.index().size());
+    access_counts_.reset(new std::atomic<uint64_t>[access_slots_]());
+}
+
+EntryInfo ArchiveReader::toEntryInfo(const IndexRecord& record) {
+    EntryInfo info;
+    info.original_size = record.original_size;
+    info.compressed_size = record.compressed_size;
+    info.filter = record.filter();
+    info.archive_position = record.archive_position;
+    info.mtime_ns = record.mtime_ns;
+    info.content_hash = record.content_hash;
+    info.has_content_hash = record.flags & RECORD_CONTENT_HASH;
+    return info;
+}
+
+IndexRecord ArchiveReader::findRecord(const std::string& name) const {
+    IndexRecord record;
+    if (!archive_.index().lookup(name, record)) {
+        throw std::runtime_error("Entry not found: " + name);
+    }
+    if (record.archive_position < access_slots_) {
+        access_counts_[record.archive_position].fetch_add(1, std::memory_order_relaxed);
+    }
+    return record;
+}
+
+bool ArchiveReader::stat(const std::string& name, EntryInfo& info) const {
+    IndexRecord record;
+    if (!archive_.index().lookup(name, record)) return false;
+    info = toEntryInfo(record);
+    return true;
+}
+
+BlockCache::Block ArchiveReader::readBlock(const IndexRecord& record) const {
+    // Блок — запись целиком, адресуется смещением её данных; куски записи с ENTRY_CHUNKED
+    // кэшируются отдельно (см. readChunk).
+    BlockKey key{cache_id_, record.data_offset};
+    if (cache_) {
+        if (BlockCache::Block block = cache_->find(key)) return block;
+    }
+
+    auto block = std::make_shared<const std::vector<uint8_t>>(
+        (record.flags & ENTRY_REFERENCES)
+            ? readReferenced(record, 0, record.original_size)
+            : decodeEntryData(record.compression(archive_.header().compression), record.filter(), record.original_size,
+                              archive_.readCompressed(record), record.flags));
+    if (cache_) cache_->insert(key, block);
+    return block;
+}
+
+BlockCache::Block ArchiveReader::readChunk(const IndexRecord& record, const ChunkTable& table, size_t k) const {
+    BlockKey key{cache_id_, record.data_offset + table.offsets[k]};
+    if (cache_) {
+        if (BlockCache::Block block = cache_->find(key)) return block;
+    }
+
+    auto block = std::make_shared<const std::vector<uint8_t>>(
+        decodeEntryData(record.compression(archive_.header().compression), record.filter(),
+                        table.originalSize(k, record.original_size),
+                        archive_.readRaw(record.data_offset + table.offsets[k], table.compressedSize(k))));
+    if (cache_) cache_->insert(key, block);
+    return block;
+}
+
+std::vector<uint8_t> ArchiveReader::readReferenced(const IndexRecord& record, uint64_t offset, uint64_t end) const {
+    if (!repository_) throw std::runtime_error("Entry is stored in a chunk repository");
+    std::vector<uint8_t> list = archive_.readCompressed(record);
+    std::vector<uint8_t> out;
+    out.reserve(end - offset);
+    uint64_t start = 0;
+    for (const auto& reference : parseChunkReferences(list.data(), list.size(), record.original_size)) {
+        uint64_t chunk_end = start + reference.size;
+        if (chunk_end > offset && start < end) {
+            std::vector<uint8_t> chunk = repository_->read(reference.id);
+            if (chunk.size() != reference.size) throw std::runtime_error("Chunk " + chunkIdHex(reference.id) + " has wrong size");
+            out.insert(out.end(), chunk.begin() + (std::max(offset, start) - start),
+                       chunk.begin() + (std::min(end, chunk_end) - start));
+        }
+        start = chunk_end;
+    }
+    return out;
+}
+
+std::vector<uint8_t> ArchiveReader::read(const std::string& name) const {
+    IndexRecord record = findRecord(name);
+    if (record.flags & ENTRY_REFERENCES) return cache_ ? *readBlock(record) : readReferenced(record, 0, record.original_size);
+    if (!cache_) {
+        return decodeEntryData(record.compression(archive_.header().compression), record.filter(), record.original_size,
+                               archive_.readCompressed(record), record.flags);
+    }
+    return *readBlock(record);
+}
+
+std::vector<uint8_t> ArchiveReader::readRange(const std::string& name, uint64_t offset, uint64_t length) const {
+    IndexRecord record = findRecord(name);
+    if (offset >= record.original_size) return {};
+    uint64_t end = offset + std::min<uint64_t>(length, record.original_size - offset);
+
+    // Из хранилища кусков — только куски, покрывающие диапазон, в обход кэша.
+    if (record.flags & ENTRY_REFERENCES) return readReferenced(record, offset, end);
+
+    if (!(record.flags & ENTRY_CHUNKED)) {
+        BlockCache::Block data = readBlock(record);
+        return std::vector<uint8_t>(data->begin() + offset, data->begin() + end);
+    }
+
+    // Распаковываются только куски, покрывающие диапазон.
+    ChunkTable table = archive_.readChunkTable(record);
+    std::vector<uint8_t> out;
+    out.reserve(end - offset);
+    for (size_t k = offset / table.chunk_size; k < table.count() && k * table.chunk_size < end; ++k) {
+        BlockCache::Block chunk = readChunk(record, table, k);
+        uint64_t start = static_cast<uint64_t>(k) * table.chunk_size;
+        uint64_t from = std::max(offset, start) - start;
+        uint64_t to = std::min<uint64_t>(end - start, chunk->size());
+        out.insert(out.end(), chunk->begin() + from, chunk->begin() + to);
+    }
+    return out;
+}
+
+AsyncReader::AsyncReader(unsigned worker_count, size_t queue_limit) : queue_limit_(queue_limit) {
+    completion_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (completion_fd_ < 0) throw std::runtime_error("Failed to create eventfd");
+
+    if (worker_count == 0) worker_count = workerCount();
+    for (unsigned i = 0; i < worker_count; ++i) {
+        workers_.emplace_back([this, i] {
+            pinCurrentWorker(i);
+            workerLoop();
+        });
+    }
+}
+
+AsyncReader::~AsyncReader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    ready_.notify_all();
+    // Уже принятые задания дорабатываются, чтобы ни один future не остался без результата.
+    for (auto& worker : workers_) worker.join();
+    close(completion_fd_);
+}
+
+std::exception_ptr AsyncReader::queueFullError() {
+    return std::make_exception_ptr(std::runtime_error("Async read queue is full"));
+}
+
+bool AsyncReader::enqueue(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ || tasks_.size() >= queue_limit_) return false;
+        tasks_.push_back(std::move(task));
+    }
+    ready_.notify_one();
+    return true;
+}
+
+void AsyncReader::workerLoop() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) return;
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
+
+void AsyncReader::postCompletion(std::function<void()> completion) {
+    {
+        std::lock_guard<std::mutex> lock(completion_mutex_);
+        completions_.push_back(std::move(completion));
+    }
+    uint64_t one = 1;
+    ssize_t written = write(completion_fd_, &one, sizeof(one));
+    (void)written;
+}
+
+size_t AsyncReader::runCompletions() {
+    uint64_t counter;
+    ssize_t drained = ::read(completion_fd_, &counter, sizeof(counter));
+    (void)drained;
+
+    std::vector<std::function<void()>> completions;
+    {
+        std::lock_guard<std::mutex> lock(completion_mutex_);
+        completions.swap(completions_);
+    }
+    for (auto& completion : completions) completion();
+    return completions.size();
+}
+
+namespace {
+
+auto openWork(const std::string& path, std::shared_ptr<BlockCache> cache) {
+    return [path, cache]() { return std::make_shared<ArchiveReader>(path, cache); };
+}
+
+auto statWork(std::shared_ptr<const ArchiveReader> reader, const std::string& name) {
+    return [reader, name]() {
+        EntryInfo info;
+        if (!reader->stat(name, info)) throw std::runtime_error("Entry not found: " + name);
+        return info;
+    };
+}
+
+auto readRangeWork(std::shared_ptr<const ArchiveReader> reader, const std::string& name,
+                   uint64_t offset, uint64_t length) {
+    return [reader, name, offset, length]() { return reader->readRange(name, offset, length); };
+}
+
+}  // namespace
+
+std::future<std::shared_ptr<ArchiveReader>> AsyncReader::open(const std::string& path,
+                                                              std::shared_ptr<BlockCache> cache) {
+    return submit<std::shared_ptr<ArchiveReader>>(openWork(path, cache));
+}
+
+std::future<EntryInfo> AsyncReader::stat(std::shared_ptr<const ArchiveReader> reader, const std::string& name) {
+    return submit<EntryInfo>(statWork(reader, name));
+}
+
+std::future<AsyncReader::Data> AsyncReader::readRange(std::shared_ptr<const ArchiveReader> reader,
+                                                      const std::string& name, uint64_t offset, uint64_t length) {
+    return submit<Data>(readRangeWork(reader, name, offset, length));
+}
+
+void AsyncReader::open(const std::string& path, std::shared_ptr<BlockCache> cache,
+                       Callback<std::shared_ptr<ArchiveReader>> done) {
+    submit<std::shared_ptr<ArchiveReader>>(openWork(path, cache), done);
+}
+
+void AsyncReader::stat(std::shared_ptr<const ArchiveReader> reader, const std::string& name, Callback<EntryInfo> done) {
+    submit<EntryInfo>(statWork(reader, name), done);
+}
+
+void AsyncReader::readRange(std::shared_ptr<const ArchiveReader> reader, const std::string& name,
+                            uint64_t offset, uint64_t length, Callback<Data> done) {
+    submit<Data>(readRangeWork(reader, name, offset, length), done);
+}
+
+namespace {
+
+constexpr uint64_t CATALOG_NAME_SEED = 0x436174616C6F674EULL;
+
+struct CatalogItem {
+    std::string name;
+    uint64_t data_offset;
+};
+
+struct CatalogSource {
+    std::string path;
+    uint64_t archive_size = 0;
+    int64_t archive_mtime_ns = 0;
+    bool reused = false;
+    std::string error;
+    std::vector<CatalogItem> items;
+};
+
+}  // namespace
+
+Catalog::Catalog(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Failed to open catalog " + path);
+
+    struct stat st;
+    try {
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(CatalogHeader))) {
+            throw std::runtime_error("Corrupted catalog: too small");
+        }
+        map_ = MappedFile(fd, 0, st.st_size);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    std::memcpy(&header_, map_.data(), sizeof(header_));
+    uint64_t size = map_.size();
+    if (header_.magic != CATALOG_MAGIC || header_.format_version != CATALOG_FORMAT_VERSION) {
+        throw std::runtime_error("Corrupted catalog: bad header");
+    }
+    if (header_.archives_offset + header_.archive_count * sizeof(CatalogArchive) > header_.entries_offset
+        || header_.entries_offset + header_.entry_count * sizeof(CatalogEntry) > header_.strings_offset
+        || header_.strings_offset > size) {
+        throw std::runtime_error("Corrupted catalog: bad layout");
+    }
+}
+
+std::string Catalog::string(uint64_t offset, uint64_t size) const {
+    if (offset + size > map_.size() - header_.strings_offset) throw std::runtime_error("Corrupted catalog: bad string");
+    return std::string(reinterpret_cast<const char*>(map_.data() + header_.strings_offset + offset), size);
+}
+
+CatalogArchive Catalog::archive(uint64_t i) const {
+    CatalogArchive archive;
+    std::memcpy(&archive, map_.data() + header_.archives_offset + i * sizeof(CatalogArchive), sizeof(archive));
+    return archive;
+}
+
+std::string Catalog::archivePath(uint64_t i) const {
+    CatalogArchive entry = archive(i);
+    return string(entry.path_offset, entry.path_size);
+}
+
+CatalogEntry Catalog::entry(uint64_t i) const {
+    CatalogEntry entry;
+    std::memcpy(&entry, map_.data() + header_.entries_offset + i * sizeof(CatalogEntry), sizeof(entry));
+    return entry;
+}
+
+std::string Catalog::entryName(const CatalogEntry& entry) const {
+    return string(entry.name_offset, entry.name_size);
+}
+
+std::vector<CatalogMatch> Catalog::locate(const std::string& name) const {
+    uint64_t hash = hashName(name, CATALOG_NAME_SEED);
+    uint64_t lo = 0, hi = header_.entry_count;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (entry(mid).name_hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+
+    std::vector<CatalogMatch> matches;
+    for (uint64_t i = lo; i < header_.entry_count; ++i) {
+        CatalogEntry candidate = entry(i);
+        if (candidate.name_hash != hash) break;
+        if (candidate.name_size != name.size() || entryName(candidate) != name) continue;
+        if (candidate.archive >= header_.archive_count) throw std::runtime_error("Corrupted catalog: bad archive");
+        matches.push_back({archivePath(candidate.archive), candidate.data_offset});
+    }
+    return matches;
+}
+
+CatalogUpdate updateCatalog(const std::string& catalog_path, const std::vector<std::string>& archive_paths,
+                            const std::vector<std::string>& volume_dirs, unsigned worker_count) {
+    CatalogUpdate update;
+
+    std::vector<CatalogSource> sources;
+    std::map<std::string, size_t> source_ids;
+    for (const auto& path : archive_paths) {
+        if (source_ids.emplace(path, sources.size()).second) {
+            sources.emplace_back();
+            sources.back().path = path;
+        }
+    }
+    for (auto& source : sources) {
+        struct stat st;
+        if (::stat(source.path.c_str(), &st) != 0) {
+            source.error = std::strerror(errno);
+            continue;
+        }
+        source.archive_size = st.st_size;
+        source.archive_mtime_ns = mtimeNanoseconds(st);
+    }
+
+    // Записи неизменившихся архивов берутся из прежнего каталога за один проход по нему.
+    std::unique_ptr<Catalog> previous;
+    struct stat catalog_stat;
+    if (::stat(catalog_path.c_str(), &catalog_stat) == 0) {
+        try {
+            previous.reset(new Catalog(catalog_path));
+        } catch (const std::exception&) {
+            // Повреждённый каталог строится заново.
+        }
+    }
+    if (previous) {
+        std::vector<int64_t> reuse(previous->archiveCount(), -1);
+        for (uint64_t a = 0; a < previous->archiveCount(); ++a) {
+            CatalogArchive old = previous->archive(a);
+            auto it = source_ids.find(previous->archivePath(a));
+            if (it == source_ids.end()) {
+                ++update.removed;
+                continue;
+            }
+            CatalogSource& source = sources[it->second];
+            if (source.error.empty() && source.archive_size == old.archive_size
+                && source.archive_mtime_ns == old.archive_mtime_ns) {
+                source.reused = true;
+                source.items.reserve(old.entry_count);
+                reuse[a] = static_cast<int64_t>(it->second);
+            }
+        }
+        for (uint64_t i = 0; i < previous->size(); ++i) {
+            CatalogEntry entry = previous->entry(i);
+            if (entry.archive < reuse.size() && reuse[entry.archive] >= 0) {
+                sources[reuse[entry.archive]].items.push_back({previous->entryName(entry), entry.data_offset});
+            }
+        }
+    }
+
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        if (sources[i].error.empty() && !sources[i].reused) pending.push_back(i);
+    }
+
+    if (worker_count == 0) worker_count = workerCount();
+    worker_count = std::max<unsigned>(1, std::min<size_t>(worker_count, pending.size()));
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < worker_count; ++w) {
+        workers.emplace_back([&, w] {
+            pinCurrentWorker(w);
+            for (size_t i; (i = next++) < pending.size();) {
+                CatalogSource& source = sources[pending[i]];
+                try {
+                    IndexedArchive archive(source.path, INDEX_BUILD_MEMORY, volume_dirs);
+                    source.items.reserve(archive.index().size());
+                    archive.index().forEach([&](const std::string& name, const IndexRecord& record) {
+                        source.items.push_back({name, record.data_offset});
+                    });
+                } catch (const std::exception& e) {
+                    source.items.clear();
+                    source.error = e.what();
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+
+    std::string archives, strings;
+    std::vector<CatalogEntry> entries;
+    std::unordered_map<std::string, uint64_t> string_offsets;
+    auto intern = [&](const std::string& value) {
+        auto it = string_offsets.emplace(value, strings.size());
+        if (it.second) strings += value;
+        return it.first->second;
+    };
+
+    uint32_t archive_count = 0;
+    for (auto& source : sources) {
+        if (!source.error.empty()) {
+            update.errors.push_back(source.path + ": " + source.error);
+            continue;
+        }
+        if (source.reused) ++update.unchanged;
+        else ++update.scanned;
+
+        CatalogArchive archive = {};
+        archive.path_offset = intern(source.path);
+        archive.path_size = static_cast<uint32_t>(source.path.size());
+        archive.archive_size = source.archive_size;
+        archive.archive_mtime_ns = source.archive_mtime_ns;
+        archive.entry_count = source.items.size();
+        appendPod(archives, archive);
+
+        for (const auto& item : source.items) {
+            CatalogEntry entry = {};
+            entry.name_hash = hashName(item.name, CATALOG_NAME_SEED);
+            entry.name_offset = intern(item.name);
+            entry.name_size = static_cast<uint32_t>(item.name.size());
+            entry.archive = archive_count;
+            entry.data_offset = item.data_offset;
+            entries.push_back(entry);
+        }
+        source.items = std::vector<CatalogItem>();
+        ++archive_count;
+    }
+    std::sort(entries.begin(), entries.end(), [](const CatalogEntry& a, const CatalogEntry& b) {
+        if (a.name_hash != b.name_hash) return a.name_hash < b.name_hash;
+        return a.archive < b.archive;
+    });
+    update.entry_count = entries.size();
+
+    CatalogHeader header = {};
+    header.magic = CATALOG_MAGIC;
+    header.format_version = CATALOG_FORMAT_VERSION;
+    header.archive_count = archive_count;
+    header.entry_count = entries.size();
+    header.archives_offset = sizeof(CatalogHeader);
+    header.entries_offset = header.archives_offset + archives.size();
+    header.strings_offset = header.entries_offset + entries.size() * sizeof(CatalogEntry);
+
+    std::string temp_path = catalog_path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(temp_path, std::ios::binary);
+        if (!out) throw std::runtime_error("Failed to create " + temp_path);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(archives.data(), archives.size());
+        out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(CatalogEntry));
+        out.write(strings.data(), strings.size());
+        if (!out) {
+            out.close();
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Failed to write catalog");
+        }
+    }
+    previous.reset();
+    if (std::rename(temp_path.c_str(), catalog_path.c_str()) != 0) {
+        std::remove(temp_path.c_str());
+        throw std::runtime_error("Failed to replace " + catalog_path);
+    }
+    return update;
+}
+
+namespace {
+
+constexpr uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline uint32_t rotateRight(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void sha256Block(uint32_t* state, const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = static_cast<uint32_t>(block[4 * i]) << 24 | static_cast<uint32_t>(block[4 * i + 1]) << 16
+             | static_cast<uint32_t>(block[4 * i + 2]) << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) + ((e & f) ^ (~e & g))
+                    + SHA256_K[i] + w[i];
+        uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// Таблица gear для FastCDC. Сид фиксирован: границы кусков должны совпадать между запусками.
+const uint64_t* gearTable() {
+    static const std::array<uint64_t, 256> table = [] {
+        std::array<uint64_t, 256> gear;
+        for (size_t i = 0; i < gear.size(); ++i) gear[i] = mix64(0x4D4B4B4147454152ULL + i);
+        return gear;
+    }();
+    return table.data();
+}
+
+// Хеш сдвигается влево, поэтому старшие биты зависят от последних 64 байт, а младшие — от
+// нескольких: маски берутся из старших. Для среднего 2^20 — на 2 бита строже и слабее (NC-2).
+constexpr uint64_t CDC_MASK_STRICT = ~0ULL << (64 - 22);
+constexpr uint64_t CDC_MASK_LOOSE = ~0ULL << (64 - 18);
+
+}  // namespace
+
+ChunkId chunkId(const uint8_t* data, size_t size) {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    size_t full = size / 64 * 64;
+    for (size_t offset = 0; offset < full; offset += 64) sha256Block(state, data + offset);
+
+    // Хвост, бит 1 и длина в битах (big-endian) — в один или два последних блока.
+    uint8_t tail[128] = {};
+    size_t rest = size - full;
+    std::memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+    size_t tail_size = rest + 9 <= 64 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(size) * 8;
+    for (int i = 0; i < 8; ++i) tail[tail_size - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+    for (size_t offset = 0; offset < tail_size; offset += 64) sha256Block(state, tail + offset);
+
+    ChunkId id;
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 4; ++j) id[4 * i + j] = static_cast<uint8_t>(state[i] >> (24 - 8 * j));
+    }
+    return id;
+}
+
+std::string chunkIdHex(const ChunkId& id) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (uint8_t byte : id) {
+        hex.push_back(digits[byte >> 4]);
+        hex.push_back(digits[byte & 15]);
+    }
+    return hex;
+}
+
+size_t cdcChunkLength(const uint8_t* data, size_t size) {
+    size_t limit = std::min(size, CDC_MAX_CHUNK);
+    if (limit <= CDC_MIN_CHUNK) return limit;
+
+    const uint64_t* gear = gearTable();
+    size_t normal = std::min(limit, CDC_AVERAGE_CHUNK);
+    uint64_t hash = 0;
+    size_t i = CDC_MIN_CHUNK;
+    for (; i < normal; ++i) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & CDC_MASK_STRICT)) return i + 1;
+    }
+    for (; i < limit; ++i) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & CDC_MASK_LOOSE)) return i + 1;
+    }
+    return limit;
+}
+
+std::string encodeChunkReferences(const std::vector<ChunkReference>& references) {
+    std::string out;
+    appendVarint(out, references.size());
+    for (const auto& reference : references) {
+        out.append(reinterpret_cast<const char*>(reference.id.data()), reference.id.size());
+        appendVarint(out, reference.size);
+    }
+    return out;
+}
+
+std::vector<ChunkReference> parseChunkReferences(const uint8_t* data, size_t size, uint64_t original_size) {
+    size_t pos = 0;
+    uint64_t count = decodeVarint(data, size, pos);
+    if (count > size / (sizeof(ChunkId) + 1)) throw std::runtime_error("Corrupted archive: bad chunk references");
+
+    std::vector<ChunkReference> references(count);
+    uint64_t total = 0;
+    for (auto& reference : references) {
+        if (size - pos < reference.id.size()) throw std::runtime_error("Corrupted archive: bad chunk references");
+        std::memcpy(reference.id.data(), data + pos, reference.id.size());
+        pos += reference.id.size();
+        uint64_t chunk_size = decodeVarint(data, size, pos);
+        if (chunk_size == 0 || chunk_size > UINT32_MAX) throw std::runtime_error("Corrupted archive: bad chunk references");
+        reference.size = static_cast<uint32_t>(chunk_size);
+        total += chunk_size;
+    }
+    if (pos != size || total != original_size) throw std::runtime_error("Corrupted archive: bad chunk references");
+    return references;
+}
+
+namespace {
+
+bool readFully(int fd, void* data, size_t size, uint64_t offset) {
+    uint8_t* p = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool writeFully(int fd, const void* data, size_t size, uint64_t offset) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+void syncPath(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+// Атомарная замена с сохранением на диск: временный файл сбрасывается и переименовывается поверх.
+void replaceFile(const std::string& path, const std::string& dir, const std::string& data) {
+    std::string temp_path = path + ".tmp" + std::to_string(getpid());
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw std::runtime_error("Failed to create " + temp_path);
+    bool written = writeFully(fd, data.data(), data.size(), 0) && fdatasync(fd) == 0;
+    if (close(fd) != 0 || !written) {
+        unlink(temp_path.c_str());
+        throw std::runtime_error("Failed to write " + path);
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        throw std::runtime_error("Failed to replace " + path);
+    }
+    syncPath(dir);
+}
+
+// -1 — файла нет (и create не задан).
+int lockFile(const std::string& path, bool create, int operation) {
+    int fd = open(path.c_str(), create ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    while (flock(fd, operation) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            throw std::runtime_error("Failed to lock " + path);
+        }
+    }
+    return fd;
+}
+
+// Номера паков в каталоге: файлы "NNNNNNNN.pack".
+std::vector<uint32_t> listPacks(const std::string& packs_dir) {
+    std::vector<uint32_t> packs;
+    DIR* dir = opendir(packs_dir.c_str());
+    if (!dir) return packs;
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() != 13 || name.compare(8, 5, ".pack") != 0
+            || !std::all_of(name.begin(), name.begin() + 8, [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+            continue;
+        }
+        packs.push_back(static_cast<uint32_t>(std::stoul(name.substr(0, 8))));
+    }
+    closedir(dir);
+    std::sort(packs.begin(), packs.end());
+    return packs;
+}
+
+}  // namespace
+
+ChunkRepository::ChunkRepository(const std::string& dir, RepositoryMode mode) : dir_(dir), mode_(mode) {
+    bool writable = mode != REPOSITORY_READ;
+    if (writable) {
+        // Если каталог не создался, сообщит открытие блокировки.
+        mkdir(dir_.c_str(), 0755);
+        mkdir((dir_ + "/packs").c_str(), 0755);
+    }
+    try {
+        // Сначала общая блокировка (gc берёт её исключительно), затем очередь упаковок.
+        lock_fd_ = lockFile(dir_ + "/lock", writable, mode == REPOSITORY_COLLECT ? LOCK_EX : LOCK_SH);
+        if (lock_fd_ < 0) throw std::runtime_error("Not a chunk repository: " + dir_);
+        if (mode == REPOSITORY_APPEND) {
+            append_lock_fd_ = lockFile(dir_ + "/append.lock", true, LOCK_EX);
+            if (append_lock_fd_ < 0) throw std::runtime_error("Failed to lock " + dir_);
+        }
+        loadIndex();
+
+        std::ifstream in(dir_ + "/archives");
+        for (std::string line; std::getline(in, line);) {
+            if (!line.empty()) archives_.push_back(line);
+        }
+        if (writable) {
+            std::vector<uint32_t> packs = listPacks(dir_ + "/packs");
+            next_pack_ = packs.empty() ? 1 : packs.back() + 1;
+        }
+    } catch (...) {
+        if (append_lock_fd_ >= 0) close(append_lock_fd_);
+        if (lock_fd_ >= 0) close(lock_fd_);
+        throw;
+    }
+}
+
+ChunkRepository::~ChunkRepository() {
+    for (const auto& pack : pack_fds_) close(pack.second);
+    if (append_lock_fd_ >= 0) close(append_lock_fd_);
+    if (lock_fd_ >= 0) close(lock_fd_);
+}
+
+void ChunkRepository::loadIndex() {
+    std::string path = dir_ + "/index";
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) return;  // в хранилище ещё ничего не сохранено
+        throw std::runtime_error("Failed to open " + path);
+    }
+    struct stat st;
+    std::string data;
+    bool read_ok = fstat(fd, &st) == 0;
+    if (read_ok) {
+        data.resize(st.st_size);
+        read_ok = readFully(fd, &data[0], data.size(), 0);
+    }
+    close(fd);
+    if (!read_ok) throw std::runtime_error("Failed to read " + path);
+
+    RepositoryIndexHeader header;
+    if (data.size() < sizeof(header)) throw std::runtime_error("Corrupted chunk repository: bad index");
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != REPOSITORY_INDEX_MAGIC || header.format_version != REPOSITORY_FORMAT_VERSION
+        || header.chunk_count != (data.size() - sizeof(header)) / sizeof(RepositoryIndexEntry)
+        || (data.size() - sizeof(header)) % sizeof(RepositoryIndexEntry) != 0) {
+        throw std::runtime_error("Corrupted chunk repository: bad index");
+    }
+    index_.reserve(header.chunk_count);
+    for (uint64_t i = 0; i < header.chunk_count; ++i) {
+        RepositoryIndexEntry entry;
+        std::memcpy(&entry, data.data() + sizeof(header) + i * sizeof(entry), sizeof(entry));
+        ChunkId id;
+        std::memcpy(id.data(), entry.id, id.size());
+        index_[id] = {entry.pack, entry.stored_size, entry.offset};
+    }
+}
+
+std::string ChunkRepository::packPath(uint32_t pack) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/packs/%08u.pack", pack);
+    return dir_ + name;
+}
+
+int ChunkRepository::packFd(uint32_t pack) const {
+    auto it = pack_fds_.find(pack);
+    if (it != pack_fds_.end()) return it->second;
+    int fd = open(packPath(pack).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Failed to open " + packPath(pack));
+    pack_fds_[pack] = fd;
+    return fd;
+}
+
+uint64_t ChunkRepository::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return index_.size();
+}
+
+bool ChunkRepository::contains(const ChunkId& id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return index_.count(id) != 0;
+}
+
+uint64_t ChunkRepository::storedBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stored_bytes_;
+}
+
+ChunkRepository::Location ChunkRepository::reserve(uint32_t stored_size, int& fd) {
+    uint64_t record_size = sizeof(PackChunkHeader) + static_cast<uint64_t>(stored_size);
+    if (current_pack_ == 0 || (current_size_ > sizeof(PackFileHeader) && current_size_ + record_size > PACK_BYTES)) {
+        uint32_t pack = next_pack_++;
+        std::string path = packPath(pack);
+        int pack_fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (pack_fd < 0) throw std::runtime_error("Failed to create " + path);
+        PackFileHeader header = {PACK_FILE_MAGIC, REPOSITORY_FORMAT_VERSION, 0, pack, 0};
+        if (!writeFully(pack_fd, &header, sizeof(header), 0)) {
+            close(pack_fd);
+            throw std::runtime_error("Failed to write " + path);
+        }
+        pack_fds_[pack] = pack_fd;
+        written_packs_.push_back(pack);
+        current_pack_ = pack;
+        current_size_ = sizeof(header);
+        stored_bytes_ += sizeof(header);
+    }
+    Location location = {current_pack_, stored_size, current_size_};
+    fd = pack_fds_[current_pack_];
+    current_size_ += record_size;
+    stored_bytes_ += record_size;
+    return location;
+}
+
+void ChunkRepository::writeRecord(int fd, const Location& location, const PackChunkHeader& header, const uint8_t* data) {
+    if (!writeFully(fd, &header, sizeof(header), location.offset)
+        || !writeFully(fd, data, header.stored_size, location.offset + sizeof(header))) {
+        throw std::runtime_error("Failed to write chunk pack");
+    }
+}
+
+bool ChunkRepository::store(const ChunkId& id, const uint8_t* data, size_t size, uint16_t compression, int level,
+                            EntryFilter filter) {
+    if (mode_ != REPOSITORY_APPEND) throw std::runtime_error("Chunk repository is not open for writing");
+    if (size > UINT32_MAX) throw std::runtime_error("Chunk too large");
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (index_.count(id) || !pending_.insert(id).second) return false;
+    }
+    try {
+        std::vector<uint8_t> work(data, data + size);
+        std::vector<uint8_t> stored = encodeEntryData(compression, level, filter, work);
+        if (stored.size() >= size) {
+            // Несжимаемый кусок хранится как есть.
+            stored.assign(data, data + size);
+            compression = COMPRESS_NONE;
+            filter = EntryFilter();
+        }
+
+        PackChunkHeader header = {};
+        std::memcpy(header.id, id.data(), id.size());
+        header.original_size = static_cast<uint32_t>(size);
+        header.stored_size = static_cast<uint32_t>(stored.size());
+        header.compression = compression;
+        header.filter_type = filter.type;
+        header.filter_param = filter.param;
+
+        int fd;
+        Location location;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            location = reserve(header.stored_size, fd);
+        }
+        writeRecord(fd, location, header, stored.data());
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        index_[id] = location;
+        pending_.erase(id);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.erase(id);
+        throw;
+    }
+    return true;
+}
+
+std::vector<uint8_t> ChunkRepository::read(const ChunkId& id) const {
+    Location location;
+    int fd;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(id);
+        if (it == index_.end()) throw std::runtime_error("Chunk " + chunkIdHex(id) + " is missing from " + dir_);
+        location = it->second;
+        fd = packFd(location.pack);
+    }
+
+    PackChunkHeader header;
+    std::vector<uint8_t> stored(location.stored_size);
+    if (!readFully(fd, &header, sizeof(header), location.offset)
+        || !readFully(fd, stored.data(), stored.size(), location.offset + sizeof(header))
+        || std::memcmp(header.id, id.data(), id.size()) != 0 || header.stored_size != location.stored_size) {
+        throw std::runtime_error("Corrupted chunk repository: bad chunk " + chunkIdHex(id));
+    }
+    EntryFilter filter;
+    filter.type = static_cast<FilterType>(header.filter_type);
+    filter.param = header.filter_param;
+    std::vector<uint8_t> data = decodeEntryData(header.compression, filter, header.original_size, stored);
+    // Ссылки доверяют id, поэтому содержимое сверяется с ним: порча пака без ошибки распаковки
+    // (кодек none, фильтр) не должна уйти в распакованный файл.
+    if (chunkId(data.data(), data.size()) != id) {
+        throw std::runtime_error("Corrupted chunk repository: chunk " + chunkIdHex(id) + " does not match its id");
+    }
+    return data;
+}
+
+void ChunkRepository::commit() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (uint32_t pack : written_packs_) {
+        if (fdatasync(pack_fds_[pack]) != 0) throw std::runtime_error("Failed to sync " + packPath(pack));
+    }
+    if (!written_packs_.empty()) syncPath(dir_ + "/packs");
+    // В текущий пак можно дописывать и дальше, его придётся сбросить снова.
+    written_packs_.clear();
+    if (current_pack_) written_packs_.push_back(current_pack_);
+
+    std::vector<RepositoryIndexEntry> entries;
+    entries.reserve(index_.size());
+    for (const auto& [id, location] : index_) {
+        RepositoryIndexEntry entry = {};
+        std::memcpy(entry.id, id.data(), id.size());
+        entry.pack = location.pack;
+        entry.stored_size = location.stored_size;
+        entry.offset = location.offset;
+        entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(), [](const RepositoryIndexEntry& a, const RepositoryIndexEntry& b) {
+        return std::memcmp(a.id, b.id, sizeof(a.id)) < 0;
+    });
+
+    RepositoryIndexHeader header = {REPOSITORY_INDEX_MAGIC, REPOSITORY_FORMAT_VERSION, 0, entries.size()};
+    std::string data;
+    data.reserve(sizeof(header) + entries.size() * sizeof(RepositoryIndexEntry));
+    appendPod(data, header);
+    data.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(RepositoryIndexEntry));
+    replaceFile(dir_ + "/index", dir_, data);
+}
+
+void ChunkRepository::writeArchives() {
+    std::string data;
+    for (const auto& archive : archives_) data += archive + "\n";
+    replaceFile(dir_ + "/archives", dir_, data);
+}
+
+void ChunkRepository::addArchive(const std::string& archive_path) {
+    if (mode_ == REPOSITORY_READ) throw std::runtime_error("Chunk repository is not open for writing");
+    if (std::find(archives_.begin(), archives_.end(), archive_path) != archives_.end()) return;
+    archives_.push_back(archive_path);
+    writeArchives();
+}
+
+RepositoryCollection ChunkRepository::collectGarbage(const ChunkIdSet& live, const std::vector<std::string>& archives) {
+    if (mode_ != REPOSITORY_COLLECT) throw std::runtime_error("Chunk repository is not open for collection");
+    RepositoryCollection result;
+
+    // Мёртвые куски уходят из индекса сразу; живые байты считаются по пакам.
+    std::map<uint32_t, uint64_t> live_bytes;
+    for (auto it = index_.begin(); it != index_.end();) {
+        if (live.count(it->first)) {
+            live_bytes[it->second.pack] += sizeof(PackChunkHeader) + static_cast<uint64_t>(it->second.stored_size);
+            ++it;
+        } else {
+            ++result.chunks_removed;
+            it = index_.erase(it);
+        }
+    }
+
+    // Паки, которых нет в индексе (остались от прерванной упаковки), тоже мёртвые.
+    std::vector<uint32_t> obsolete;
+    std::set<uint32_t> rewrite;
+    uint64_t obsolete_bytes = 0;
+    for (uint32_t pack : listPacks(dir_ + "/packs")) {
+        struct stat st;
+        if (::stat(packPath(pack).c_str(), &st) != 0) continue;
+        auto it = live_bytes.find(pack);
+        uint64_t used = sizeof(PackFileHeader) + (it == live_bytes.end() ? 0 : it->second);
+        uint64_t file_size = st.st_size;
+        if (it != live_bytes.end() && (file_size <= used || (file_size - used) * 100 < file_size * GC_REWRITE_PERCENT)) {
+            continue;
+        }
+        if (it != live_bytes.end()) rewrite.insert(pack);
+        obsolete.push_back(pack);
+        obsolete_bytes += file_size;
+    }
+
+    // Живые куски переписываемых паков копируются как есть, без перепаковки, в порядке расположения.
+    std::vector<std::pair<Location, ChunkId>> moved;
+    for (const auto& [id, location] : index_) {
+        if (rewrite.count(location.pack)) moved.emplace_back(location, id);
+    }
+    std::sort(moved.begin(), moved.end(), [](const auto& a, const auto& b) {
+        return a.first.pack != b.first.pack ? a.first.pack < b.first.pack : a.first.offset < b.first.offset;
+    });
+    std::vector<uint8_t> data;
+    for (const auto& [old_location, id] : moved) {
+        PackChunkHeader header;
+        data.resize(old_location.stored_size);
+        int source, target;
+        Location location;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            source = packFd(old_location.pack);
+            location = reserve(old_location.stored_size, target);
+        }
+        if (!readFully(source, &header, sizeof(header), old_location.offset)
+            || !readFully(source, data.data(), data.size(), old_location.offset + sizeof(header))
+            || std::memcmp(header.id, id.data(), id.size()) != 0) {
+            throw std::runtime_error("Corrupted chunk repository: bad chunk " + chunkIdHex(id));
+        }
+        writeRecord(target, location, header, data.data());
+        index_[id] = location;
+    }
+
+    // Сначала новый индекс, затем список архивов; старые паки удаляются, когда на них уже ничто не ссылается.
+    commit();
+    archives_ = archives;
+    writeArchives();
+    for (uint32_t pack : obsolete) {
+        auto it = pack_fds_.find(pack);
+        if (it != pack_fds_.end()) {
+            close(it->second);
+            pack_fds_.erase(it);
+        }
+        unlink(packPath(pack).c_str());
+    }
+    syncPath(dir_ + "/packs");
+
+    result.chunks_kept = index_.size();
+    result.packs_rewritten = rewrite.size();
+    result.packs_removed = obsolete.size() - rewrite.size();
+    result.bytes_reclaimed = obsolete_bytes > stored_bytes_ ? obsolete_bytes - stored_bytes_ : 0;
+    return result;
+}
@@ -0,0 +1,1072 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/types.h>
+
+constexpr uint32_t MAKAKA_SIGNATURE = 0x4D4B4B41;
+constexpr uint16_t MAKAKA_VERSION = 0x0204;
+constexpr uint16_t MAKAKA_VERSION_1_0 = 0x0100;
+constexpr uint16_t MAKAKA_VERSION_1_1 = 0x0101;
+constexpr uint16_t MAKAKA_VERSION_2_0 = 0x0200;
+constexpr uint16_t MAKAKA_VERSION_2_1 = 0x0201;
+constexpr uint16_t MAKAKA_VERSION_2_2 = 0x0202;
+constexpr uint16_t MAKAKA_VERSION_2_3 = 0x0203;
+constexpr uint16_t MAKAKA_VERSION_2_4 = 0x0204;
+
+enum CompressionType {
+    COMPRESS_NONE = 0,
+    COMPRESS_LZMA = 1,
+    COMPRESS_ZSTD = 2,
+    COMPRESS_LZ4 = 3   // кадр LZ4; LZ4-HC пишет тот же формат, только сжимает сильнее
+};
+
+// Обратимое преобразование, применяемое к данным записи перед кодеком.
+// Начиная с версии 1.1 тип и параметр фильтра хранятся в заголовке каждой записи.
+enum FilterType : uint8_t {
+    FILTER_NONE = 0,
+    FILTER_X86 = 1,
+    FILTER_ARM64 = 2,
+    FILTER_DELTA = 3
+};
+
+struct EntryFilter {
+    FilterType type = FILTER_NONE;
+    uint8_t param = 0;  // для FILTER_DELTA: расстояние - 1
+};
+
+const char* filterName(FilterType type);
+EntryFilter detectFilter(const std::vector<uint8_t>& data);
+void applyFilter(std::vector<uint8_t>& data, EntryFilter filter, bool encode);
+void applyFilter(uint8_t* data, size_t size, EntryFilter filter, bool encode);
+
+constexpr uint32_t CODEC_COMPRESSES = 1;    // иначе данные хранятся как есть и фильтры не нужны
+constexpr uint32_t CODEC_FILTER_CHAIN = 2;  // фильтр применяет сам кодек (цепочка LZMA), а не applyFilter
+
+// Кодек записей. Таблица кодеков статическая (индекс — CompressionType), так что выбор кодека
+// записи — обращение по индексу. Кодеки без состояния: их контексты живут в потоке и
+// переиспользуются между вызовами. Фильтр передаётся только кодекам с CODEC_FILTER_CHAIN,
+// остальным его применяет encodeEntryData/decodeEntryData.
+struct Codec {
+    const char* name;
+    uint32_t capabilities;  // CODEC_*
+    // Оценка сверху сжатого размера для size байт входа (под неё выделяется выход).
+    size_t (*bound)(size_t size);
+    // Дописывает сжатые данные в конец output.
+    void (*encode)(const uint8_t* input, size_t size, std::vector<uint8_t>& output, EntryFilter filter, int level);
+    // Восстанавливает ровно original_size байт в output.
+    void (*decode)(const uint8_t* input, size_t size, uint8_t* output, size_t original_size, EntryFilter filter);
+};
+
+// Именованный выбор кодека и уровня для -c: "lz4hc" — тот же LZ4 с уровнем HC. Уровни кодеков
+// задаются только здесь.
+struct CodecPreset {
+    const char* name;
+    CompressionType compression;
+    int level;
+};
+
+// nullptr — кодек неизвестен этой сборке.
+const Codec* findCodec(uint16_t compression);
+const CodecPreset* findCodecPreset(const std::string& name);
+std::string codecPresetNames();  // "lzma|zstd|..." для справки
+
+// Сжатие данных записи (куска) с фильтром; data — рабочий буфер, фильтр применяется на месте.
+std::vector<uint8_t> encodeEntryData(uint16_t compression, int level, EntryFilter filter, std::vector<uint8_t>& data);
+// Распаковка данных записи с обратным применением фильтра; flags — флаги записи (ENTRY_CHUNKED).
+// Запись с ENTRY_REFERENCES так не распаковать: её данные в хранилище кусков (ChunkRepository).
+std::vector<uint8_t> decodeEntryData(uint16_t compression, EntryFilter filter, uint64_t original_size,
+                                     const std::vector<uint8_t>& compressed_data, uint16_t flags = 0);
+
+uint64_t mix64(uint64_t x);
+
+// Формат записей.
+//   1.0: name_length(4) name original_size(8) compressed_size(8) data
+//   1.1: то же + filter.type(1) filter.param(1) перед data
+//   2.0: varint shared_prefix, varint suffix_length, suffix, varint original_size,
+//        varint compressed_size, filter.type(1), [filter.param(1) для FILTER_DELTA], data
+//   2.1: записи как в 2.0, после них центральный индекс и ArchiveFooter в конце файла
+//   2.2: старший бит filter.type (ENTRY_CHUNKED_BIT) — запись разбита на куски, см. ChunkTable
+//   2.3: бит ENTRY_REFERENCES_BIT в filter.type — данные записи лежат в хранилище кусков, в архиве
+//        только ссылки на них, см. ChunkRepository
+//   2.4: бит ENTRY_COMPRESSION_BIT в filter.type — запись сжата не кодеком архива, а своим:
+//        байт CompressionType после фильтра
+// Во 2.0 имя хранится относительно имени предыдущей записи: длина общего префикса + остаток.
+struct ArchiveHeader {
+    uint16_t version = 0;
+    uint16_t compression = COMPRESS_NONE;
+    uint32_t file_count = 0;
+};
+
+constexpr uint16_t ENTRY_CHUNKED = 1;
+constexpr uint8_t ENTRY_CHUNKED_BIT = 0x80;
+constexpr uint16_t ENTRY_REFERENCES = 2;
+constexpr uint8_t ENTRY_REFERENCES_BIT = 0x40;
+constexpr uint16_t ENTRY_COMPRESSION = 4;
+constexpr uint8_t ENTRY_COMPRESSION_BIT = 0x20;
+
+struct EntryHeader {
+    std::string name;
+    uint64_t original_size = 0;
+    uint64_t compressed_size = 0;
+    EntryFilter filter;
+    uint16_t flags = 0;
+    uint16_t compression = COMPRESS_NONE;  // при ENTRY_COMPRESSION
+};
+
+// Большая запись (с версии 2.2) хранится кусками, сжатыми независимо: их можно сжимать и
+// распаковывать параллельно и читать по отдельности. Данные такой записи начинаются с таблицы:
+//   ChunkTableHeader, uint32 compressed_size[chunk_count], затем куски подряд
+// Каждый кусок, кроме последнего, содержит chunk_size исходных байт; фильтр применяется к каждому
+// куску отдельно.
+struct ChunkTableHeader {
+    uint32_t chunk_count;
+    uint32_t chunk_size;
+};
+
+struct ChunkTable {
+    uint32_t chunk_size = 0;
+    std::vector<uint64_t> offsets;  // от начала данных записи, offsets[count()] — конец последнего куска
+
+    size_t count() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    uint64_t compressedSize(size_t k) const { return offsets[k + 1] - offsets[k]; }
+    uint64_t originalSize(size_t k, uint64_t entry_size) const {
+        return std::min<uint64_t>(chunk_size, entry_size - static_cast<uint64_t>(k) * chunk_size);
+    }
+};
+
+std::string encodeChunkTable(uint32_t chunk_size, const std::vector<uint32_t>& compressed_sizes);
+
+// Разбирает таблицу из начала данных записи; size — сколько байт доступно, compressed_size и
+// original_size — размеры всей записи (для проверки).
+ChunkTable parseChunkTable(const uint8_t* data, size_t size, uint64_t compressed_size, uint64_t original_size);
+
+// CRC64 конкатенации по CRC64 частей (как crc32_combine в zlib): хеш содержимого большой записи
+// собирается из хешей кусков, посчитанных параллельно.
+uint64_t crc64Combine(uint64_t crc1, uint64_t crc2, uint64_t length2);
+
+void appendVarint(std::string& out, uint64_t value);
+size_t sharedPrefixLength(const std::string& a, const std::string& b);
+
+// Варинт фиксированной длины ENTRY_SIZE_FIELD_BYTES (с незначащими продолжениями): такое поле
+// можно дописать на место, когда значение станет известно.
+constexpr size_t ENTRY_SIZE_FIELD_BYTES = 10;
+std::string paddedVarint(uint64_t value);
+
+// Кодирует заголовок записи версии 2.x; previous_name — имя предыдущей записи ("" для первой).
+// Если size_field не нулевой, compressed_size пишется paddedVarint, а в *size_field возвращается
+// смещение поля внутри заголовка.
+std::string encodeEntryHeader(const std::string& previous_name, const EntryHeader& entry, size_t* size_field = nullptr);
+
+// Последовательное буферизованное чтение архива: заголовки разбираются из буфера без
+// системного вызова на каждое поле, а пропуск данных внутри буфера не сбрасывает его.
+class ArchiveInput {
+public:
+    explicit ArchiveInput(const std::string& path);
+    // Тома многотомного архива, читаемые как один поток.
+    explicit ArchiveInput(const std::vector<std::string>& volume_paths);
+    ~ArchiveInput();
+
+    ArchiveInput(const ArchiveInput&) = delete;
+    ArchiveInput& operator=(const ArchiveInput&) = delete;
+
+    void read(void* destination, size_t size);
+    uint8_t readByte();
+    uint64_t readVarint();
+    void skip(uint64_t size);
+
+    // Смещение следующего непрочитанного байта от начала файла.
+    uint64_t position() const { return offset_ - (end_ - pos_); }
+
+private:
+    static constexpr size_t BUFFER_SIZE = 256 * 1024;
+
+    struct Volume {
+        int fd;
+        uint64_t offset;  // логическое смещение начала тома
+    };
+
+    void fill();
+
+    std::vector<Volume> volumes_;
+    size_t volume_ = 0;  // том, из которого идёт чтение
+    std::vector<uint8_t> buffer_;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+    uint64_t offset_ = 0;
+};
+
+ArchiveHeader readArchiveHeader(ArchiveInput& in);
+
+// Читает заголовок очередной записи. Для версии 2.0 entry.name должен содержать имя
+// предыдущей записи — новое имя собирается поверх него.
+void readEntryHeader(ArchiveInput& in, uint16_t version, EntryHeader& entry);
+
+// Центральный индекс (версия 2.1), устроенный как SSTable:
+//   IndexHeader
+//   IndexRecord[entry_count]      — фиксированного размера, отсортированы по имени
+//   IndexBlock[block_count]       — каталог блоков имён
+//   ключи                         — первое имя каждого блока, без сжатия, для бинарного поиска
+//   блоки имён                    — по INDEX_BLOCK_ENTRIES имён, front coding, сжаты ZSTD;
+//                                   каждые INDEX_RESTART_INTERVAL имён — точка рестарта (полное имя),
+//                                   в конце блока uint32 смещения рестартов и их количество
+//   хеш-таблица (необязательно)   — минимальная совершенная хеш-функция имя -> номер записи (формат 2)
+// Читатель отображает в память только область индекса и распаковывает не более одного блока за раз.
+constexpr uint32_t INDEX_MAGIC = 0x58494B4D;  // "MKIX"
+constexpr uint16_t INDEX_FORMAT_VERSION = 3;
+constexpr size_t INDEX_HEADER_V1_SIZE = 64;
+constexpr size_t INDEX_HEADER_V2_SIZE = 80;
+constexpr uint64_t FOOTER_MAGIC = 0x5844494B414B414DULL;  // "MAKAKIDX"
+constexpr uint32_t INDEX_BLOCK_ENTRIES = 128;
+constexpr uint32_t INDEX_RESTART_INTERVAL = 16;
+constexpr int INDEX_ZSTD_LEVEL = 3;
+
+struct IndexHeader {
+    uint32_t magic;
+    uint16_t format_version;
+    uint16_t record_size;
+    uint64_t entry_count;
+    uint32_t block_entries;
+    uint32_t restart_interval;
+    uint64_t block_count;
+    uint64_t records_offset;
+    uint64_t blocks_offset;
+    uint64_t keys_offset;
+    uint64_t names_offset;
+    uint64_t hash_offset;  // 0 — хеш-таблицы нет
+    uint64_t hash_size;
+    uint64_t bloom_offset;  // с версии 3; 0 — фильтра нет
+    uint64_t bloom_size;
+};
+
+struct IndexRecord {
+    uint64_t data_offset;
+    uint64_t original_size;
+    uint64_t compressed_size;
+    uint32_t archive_position;  // порядковый номер записи в архиве
+    uint8_t filter_type;
+    uint8_t filter_param;
+    uint16_t flags;         // ENTRY_CHUNKED, ENTRY_REFERENCES, RECORD_COMPRESSION_MASK, RECORD_CONTENT_HASH
+    int64_t mtime_ns;       // время изменения исходного файла; 0 — неизвестно
+    uint64_t content_hash;  // contentHash содержимого, если RECORD_CONTENT_HASH
+
+    EntryFilter filter() const {
+        EntryFilter filter;
+        filter.type = static_cast<FilterType>(filter_type);
+        filter.param = filter_param;
+        return filter;
+    }
+
+    // Кодек записи: свой (ENTRY_COMPRESSION) или кодек архива.
+    uint16_t compression(uint16_t archive_compression) const;
+};
+
+constexpr uint16_t RECORD_CONTENT_HASH = 0x8000;
+// Свой кодек записи хранится в индексе как CompressionType + 1; 0 — кодек архива.
+constexpr uint16_t RECORD_COMPRESSION_MASK = 0x0F00;
+constexpr int RECORD_COMPRESSION_SHIFT = 8;
+
+inline uint16_t IndexRecord::compression(uint16_t archive_compression) const {
+    uint16_t own = (flags & RECORD_COMPRESSION_MASK) >> RECORD_COMPRESSION_SHIFT;
+    return own ? own - 1 : archive_compression;
+}
+
+// Флаги записи индекса по заголовку записи.
+uint16_t recordFlags(const EntryHeader& entry);
+// Записи индексов, собранных до появления mtime_ns и content_hash, короче: недостающие поля
+// читаются нулями.
+constexpr size_t INDEX_RECORD_V1_SIZE = 32;
+
+struct IndexBlock {
+    uint64_t offset;  // от names_offset
+    uint32_t compressed_size;
+    uint32_t raw_size;
+    uint32_t key_offset;  // от keys_offset
+    uint32_t key_length;
+};
+
+struct ArchiveFooter {
+    uint64_t index_offset;
+    uint64_t index_size;
+    uint64_t magic;
+};
+
+struct MphHeader {
+    uint64_t seed;
+    uint64_t key_count;
+    uint64_t bucket_count;
+};
+
+// Фильтр Блума по именам записей и (если BLOOM_HAS_CONTENT) по хешам их содержимого:
+//   BloomHeader, uint64 bits[bit_count / 64]
+constexpr uint32_t BLOOM_HAS_CONTENT = 1;
+constexpr uint32_t BLOOM_BITS_PER_KEY = 10;
+constexpr uint32_t BLOOM_HASH_COUNT = 7;
+
+struct BloomHeader {
+    uint64_t bit_count;
+    uint32_t hash_count;
+    uint32_t flags;
+};
+
+static_assert(sizeof(IndexHeader) == 96, "IndexHeader layout");
+static_assert(sizeof(IndexRecord) == 48, "IndexRecord layout");
+static_assert(sizeof(IndexBlock) == 24, "IndexBlock layout");
+static_assert(sizeof(ArchiveFooter) == 24, "ArchiveFooter layout");
+static_assert(sizeof(BloomHeader) == 16, "BloomHeader layout");
+
+// Хеш исходного (до фильтра и сжатия) содержимого записи — CRC64. Вторая форма считает
+// по частям: crc — хеш предшествующих данных.
+uint64_t contentHash(const std::vector<uint8_t>& data);
+uint64_t contentHash(const uint8_t* data, size_t size, uint64_t crc);
+
+struct IndexEntry {
+    std::string name;
+    IndexRecord record;
+    uint64_t content_hash = 0;  // пишется в запись индекса (RECORD_CONTENT_HASH) и в фильтр Блума
+    bool has_content_hash = false;
+};
+
+template <typename T>
+void appendPod(std::string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Сериализует индекс; entries сортируются по имени (при совпадении — в порядке архива).
+std::string buildCentralIndex(std::vector<IndexEntry>& entries, bool with_hash_index = false);
+
+// Индекс для архивов без встроенного индекса (1.x, 2.0): строится одним проходом по заголовкам.
+std::string scanArchiveIndex(const std::string& path);
+
+int64_t mtimeNanoseconds(const struct stat& st);
+
+// Отображение части файла в память только для чтения.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(int fd, uint64_t offset, uint64_t length);
+    ~MappedFile();
+
+    MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    const uint8_t* data() const { return data_; }
+    uint64_t size() const { return size_; }
+
+private:
+    void* map_ = nullptr;
+    uint64_t map_length_ = 0;
+    const uint8_t* data_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+// Доступ к центральному индексу прямо из отображённой памяти. Все методы const и не
+// изменяют общего состояния, поэтому безопасны при вызове из нескольких потоков.
+class ArchiveIndex {
+public:
+    ArchiveIndex(const uint8_t* data, uint64_t size);
+
+    uint64_t size() const { return header_.entry_count; }
+
+    IndexRecord record(uint64_t i) const {
+        IndexRecord record = {};
+        std::memcpy(&record, data_ + header_.records_offset + i * header_.record_size,
+                    std::min<size_t>(header_.record_size, sizeof(record)));
+        return record;
+    }
+
+    // Обходит записи в порядке имён, распаковывая по одному блоку: f(name, record).
+    template <typename F>
+    void forEach(F&& f) const {
+        std::string name;
+        for (uint64_t b = 0; b < header_.block_count; ++b) {
+            std::string raw = decodeBlock(b);
+            const uint8_t* p = reinterpret_cast<const uint8_t*>(raw.data());
+            size_t names_end = namesEnd(raw);
+            size_t pos = 0;
+            for (uint64_t i = b * header_.block_entries; pos < names_end; ++i) {
+                checkBlockRecord(b, i);
+                nextName(p, names_end, pos, name);
+                f(name, record(i));
+            }
+        }
+    }
+
+    // Бинарный поиск: сначала по первым ключам блоков, затем по точкам рестарта внутри блока.
+    // Из повторяющихся имён находит первое вхождение, как и хеш-таблица.
+    bool find(const std::string& name, IndexRecord& result) const;
+
+    bool hasHashIndex() const { return header_.hash_size != 0; }
+
+    // Проверки по фильтру Блума: false — точно нет, true — возможно есть. Без фильтра
+    // (или без хешей содержимого в нём) всегда true.
+    bool hasBloomFilter() const { return header_.bloom_size != 0; }
+    bool mayContainName(const std::string& name) const;
+    bool mayContainContent(uint64_t content_hash) const;
+
+    // Поиск за O(1) через совершенную хеш-функцию; без неё — бинарный поиск find().
+    bool lookup(const std::string& name, IndexRecord& result) const;
+
+private:
+    IndexBlock block(uint64_t b) const;
+    std::string blockKey(uint64_t b) const;
+    std::string decodeBlock(uint64_t b) const;
+    static size_t namesEnd(const std::string& raw);
+    static void nextName(const uint8_t* p, size_t end, size_t& pos, std::string& name);
+    // Имя номер i из блока b: блок с подделанным raw_size мог бы дать больше имён, чем в нём записей.
+    void checkBlockRecord(uint64_t b, uint64_t i) const {
+        if (i >= header_.entry_count || i >= (b + 1) * header_.block_entries) {
+            throw std::runtime_error("Corrupted index: bad block");
+        }
+    }
+    bool bloomTest(uint64_t hash) const;
+
+    const uint8_t* data_;
+    uint64_t size_;
+    IndexHeader header_;
+    MphHeader mph_ = {};
+    BloomHeader bloom_ = {};
+};
+
+enum IndexSource {
+    INDEX_EMBEDDED,
+    INDEX_SIDECAR,
+    INDEX_IN_MEMORY
+};
+
+// Что делать, если у архива без встроенного индекса нет действительного sidecar.
+enum IndexBuild {
+    INDEX_BUILD_NONE,     // ошибка "Archive has no index"
+    INDEX_BUILD_MEMORY,   // построить индекс в памяти процесса, рядом с архивом ничего не писать
+    INDEX_BUILD_SIDECAR   // построить и записать sidecar (команды index/reindex)
+};
+
+std::string sidecarPath(const std::string& archive_path);
+
+// Многотомный архив — поток обычного архива, разрезанный на тома "<имя>.001", "<имя>.002", ...
+// одинакового размера (последний может быть короче). Конкатенация томов даёт обычный архив,
+// смещения в индексе логические — от начала первого тома. Тома могут лежать в разных каталогах.
+std::string volumePath(const std::string& base_path, const std::string& dir, uint32_t volume);
+
+// Файлы тома по пути архива ("x.makaka" или "x.makaka.001"). Тома ищутся рядом с первым и в
+// volume_dirs; для обычного архива возвращается он сам.
+std::vector<std::string> findVolumes(const std::string& path, const std::vector<std::string>& volume_dirs = {});
+
+struct SidecarHeader;
+
+// Архив с центральным индексом: встроенным (2.1+) или из sidecar-файла "<архив>.idx". Без того
+// и другого индекс строится по build: по умолчанию только в памяти — чтение архива не пишет
+// в его каталог; sidecar записывается лишь по INDEX_BUILD_SIDECAR, а если его некуда записать,
+// индекс тоже остаётся в памяти. Данные читаются pread, без общей позиции.
+class IndexedArchive {
+public:
+    explicit IndexedArchive(const std::string& path, IndexBuild build = INDEX_BUILD_MEMORY,
+                            const std::vector<std::string>& volume_dirs = {});
+    ~IndexedArchive();
+
+    IndexedArchive(const IndexedArchive&) = delete;
+    IndexedArchive& operator=(const IndexedArchive&) = delete;
+
+    const ArchiveHeader& header() const { return header_; }
+    const ArchiveIndex& index() const { return *index_; }
+    IndexSource source() const { return source_; }
+    size_t volumeCount() const { return volumes_.size(); }
+    size_t volumeAt(uint64_t offset) const;
+
+    std::vector<uint8_t> readCompressed(const IndexRecord& record) const;
+    std::vector<uint8_t> readRaw(uint64_t offset, uint64_t size) const;
+    // Таблица кусков записи с ENTRY_CHUNKED.
+    ChunkTable readChunkTable(const IndexRecord& record) const;
+
+private:
+    struct Volume {
+        int fd;
+        uint64_t offset;  // логическое смещение начала тома
+        uint64_t size;
+    };
+
+    void openVolumes(const std::vector<std::string>& paths);
+    // Чтение по логическому смещению, при необходимости через границу томов.
+    void readAt(void* data, uint64_t size, uint64_t offset) const;
+
+    void openIndex(const std::string& path, IndexBuild build);
+    bool openSidecar(const std::string& path, const SidecarHeader& expected);
+
+    std::vector<Volume> volumes_;
+    uint64_t total_size_ = 0;
+    ArchiveHeader header_;
+    MappedFile map_;
+    std::string owned_index_;
+    std::unique_ptr<ArchiveIndex> index_;
+    IndexSource source_ = INDEX_EMBEDDED;
+};
+
+// Сколько потоков реально доступно процессу. hardware_concurrency() видит все ядра хоста и в
+// контейнере с квотой CPU даёт переподписку, поэтому учитываются маска sched_getaffinity, квота CPU
+// и лимит памяти cgroup (v1 и v2, по всей цепочке родительских групп).
+constexpr uint64_t WORKER_MEMORY_ESTIMATE = 128ULL << 20;  // на поток распаковки/сжатия
+
+struct CpuLayout {
+    std::vector<int> cpus;       // разрешённые маской
+    std::vector<int> cpu_nodes;  // NUMA-узел каждого из cpus, -1 — неизвестен
+    double cpu_quota = 0;        // в ядрах; 0 — квоты нет
+    uint64_t memory_limit = 0;   // 0 — лимита нет
+    unsigned workers = 1;        // сколько потоков запускать по умолчанию
+};
+
+enum PinMode {
+    PIN_NONE,
+    PIN_CPU,   // поток i — на i-й разрешённый CPU
+    PIN_NUMA   // поток i — на все CPU узла i по кругу
+};
+
+CpuLayout detectCpuLayout();
+
+// Раскладка процесса, определяется при первом вызове.
+const CpuLayout& cpuLayout();
+
+// Явное число потоков (ключ -j); 0 — автоматически.
+void setWorkerLimit(unsigned workers);
+void setPinMode(PinMode mode);
+PinMode pinMode();
+
+// Число потоков для tasks независимых заданий: по раскладке (или setWorkerLimit), не больше tasks
+// и не меньше 1.
+unsigned workerCount(size_t tasks = SIZE_MAX);
+
+// Привязывает вызывающий поток с номером worker согласно setPinMode; без привязки ничего не делает.
+void pinCurrentWorker(unsigned worker);
+
+// Пул с перехватом работы. У каждого потока своя очередь: задачи, поставленные из потока пула
+// (например, куски большой записи, на которые её разбила другая задача), попадают в очередь этого
+// потока, он берёт их с конца, а простаивающие потоки перехватывают с начала. Задачи, поставленные
+// извне, идут в общую очередь в порядке поступления и берутся, когда перехватывать нечего.
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    // worker_count = 0 — workerCount().
+    explicit WorkStealingPool(unsigned worker_count = 0);
+    // Дожидается выполнения всех поставленных задач.
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(threads_.size()); }
+
+    void submit(Task task);
+    // Ждёт, пока не будут выполнены все задачи, включая порождённые ими; первое исключение,
+    // вылетевшее из задачи, пробрасывается отсюда.
+    void wait();
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool take(size_t worker, Task& task);
+    void workerLoop(size_t worker);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::mutex mutex_;
+    std::condition_variable work_available_;
+    std::condition_variable all_done_;
+    std::deque<Task> injected_;
+    size_t queued_ = 0;      // задач во всех очередях
+    size_t unfinished_ = 0;  // поставленных и ещё не выполненных
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::vector<std::thread> threads_;
+};
+
+struct EntryInfo {
+    uint64_t original_size = 0;
+    uint64_t compressed_size = 0;
+    EntryFilter filter;
+    uint32_t archive_position = 0;
+    int64_t mtime_ns = 0;  // 0 — неизвестно
+    uint64_t content_hash = 0;
+    bool has_content_hash = false;
+};
+
+struct BlockKey {
+    uint64_t archive = 0;
+    uint64_t block = 0;
+
+    bool operator==(const BlockKey& other) const { return archive == other.archive && block == other.block; }
+};
+
+struct BlockCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes = 0;
+    uint64_t blocks = 0;
+};
+
+// Кэш распакованных блоков с вытеснением LRU и общим ограничением по памяти. Разбит на шарды
+// со своими блокировками, чтобы параллельные читатели не упирались в один мьютекс; ёмкость делится
+// между шардами поровну, и блок больше доли шарда не кэшируется. Один кэш можно отдать нескольким
+// ArchiveReader: ключ включает идентификатор архива.
+class BlockCache {
+public:
+    using Block = std::shared_ptr<const std::vector<uint8_t>>;
+
+    explicit BlockCache(uint64_t capacity_bytes, size_t shard_count = 16);
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    uint64_t capacity() const { return capacity_; }
+
+    // Пустой указатель при промахе.
+    Block find(const BlockKey& key);
+    void insert(const BlockKey& key, Block block);
+    void clear();
+
+    BlockCacheStats stats() const;
+
+private:
+    struct KeyHash {
+        size_t operator()(const BlockKey& key) const;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<std::pair<BlockKey, Block>> lru;
+        std::unordered_map<BlockKey, std::list<std::pair<BlockKey, Block>>::iterator, KeyHash> blocks;
+        uint64_t bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    Shard& shardFor(const BlockKey& key);
+
+    uint64_t capacity_;
+    uint64_t shard_capacity_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+class ChunkRepository;
+
+// Читатель для встраивания в многопоточные сервисы: один экземпляр можно вызывать из любого
+// числа потоков одновременно. Индекс отображён в память, данные читаются pread по общему
+// дескриптору, а контексты распаковки у каждого потока свои, поэтому блокировок на пути чтения нет.
+class ArchiveReader {
+public:
+    // С cache распакованные записи кэшируются: повторные read/readRange по горячим записям
+    // отдаются из памяти без повторной распаковки. repository нужен для записей с ENTRY_REFERENCES.
+    explicit ArchiveReader(const std::string& path, std::shared_ptr<BlockCache> cache = nullptr,
+                           const std::vector<std::string>& volume_dirs = {},
+                           std::shared_ptr<const ChunkRepository> repository = nullptr);
+
+    const ArchiveHeader& header() const { return archive_.header(); }
+    uint64_t size() const { return archive_.index().size(); }
+    const std::shared_ptr<BlockCache>& cache() const { return cache_; }
+
+    // Обходит записи в порядке имён: f(name, info).
+    template <typename F>
+    void forEach(F&& f) const {
+        archive_.index().forEach([&](const std::string& name, const IndexRecord& record) {
+            f(name, toEntryInfo(record));
+        });
+    }
+
+    bool stat(const std::string& name, EntryInfo& info) const;
+
+    // Содержимое записи целиком; бросает исключение, если записи нет.
+    std::vector<uint8_t> read(const std::string& name) const;
+
+    // Не более length байт начиная с offset; за пределами записи возвращает меньше (или пусто).
+    std::vector<uint8_t> readRange(const std::string& name, uint64_t offset, uint64_t length) const;
+
+    // Счётчики обращений: сколько раз запись читалась (read, readRange) через этот читатель с его
+    // открытия. f(name, count) — для прочитанных записей, в порядке имён.
+    template <typename F>
+    void forEachAccessed(F&& f) const {
+        archive_.index().forEach([&](const std::string& name, const IndexRecord& record) {
+            uint64_t count = record.archive_position < access_slots_
+                                 ? access_counts_[record.archive_position].load(std::memory_order_relaxed) : 0;
+            if (count) f(name, count);
+        });
+    }
+
+    static EntryInfo toEntryInfo(const IndexRecord& record);
+
+private:
+    // Находит запись и засчитывает обращение к ней.
+    IndexRecord findRecord(const std::string& name) const;
+    BlockCache::Block readBlock(const IndexRecord& record) const;
+    BlockCache::Block readChunk(const IndexRecord& record, const ChunkTable& table, size_t k) const;
+    // Байты [offset, end) записи с ENTRY_REFERENCES: из хранилища читаются только нужные куски.
+    std::vector<uint8_t> readReferenced(const IndexRecord& record, uint64_t offset, uint64_t end) const;
+
+    IndexedArchive archive_;
+    std::shared_ptr<BlockCache> cache_;
+    std::shared_ptr<const ChunkRepository> repository_;
+    uint64_t cache_id_ = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> access_counts_;  // по archive_position
+    uint64_t access_slots_ = 0;
+};
+
+// Неблокирующие операции поверх ArchiveReader для сервисов на цикле событий. Чтение с диска
+// и распаковка выполняются в ограниченном пуле потоков; очередь заданий тоже ограничена, и при
+// переполнении операция сразу завершается ошибкой, а не блокирует вызывающего.
+// Результат можно получить как std::future или через обратный вызов. Обратные вызовы выполняются
+// в runCompletions() на потоке, который его вызывает; completionFd() — eventfd, становящийся
+// читаемым, когда есть что выполнить, его удобно добавить в epoll.
+class AsyncReader {
+public:
+    using Data = std::vector<uint8_t>;
+    template <typename T>
+    using Callback = std::function<void(T result, std::exception_ptr error)>;
+
+    // worker_count = 0 — по числу ядер.
+    explicit AsyncReader(unsigned worker_count = 0, size_t queue_limit = 65536);
+    ~AsyncReader();
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    std::future<std::shared_ptr<ArchiveReader>> open(const std::string& path,
+                                                     std::shared_ptr<BlockCache> cache = nullptr);
+    // Если записи нет, future бросает исключение.
+    std::future<EntryInfo> stat(std::shared_ptr<const ArchiveReader> reader, const std::string& name);
+    std::future<Data> readRange(std::shared_ptr<const ArchiveReader> reader, const std::string& name,
+                                uint64_t offset, uint64_t length);
+
+    void open(const std::string& path, std::shared_ptr<BlockCache> cache,
+              Callback<std::shared_ptr<ArchiveReader>> done);
+    void stat(std::shared_ptr<const ArchiveReader> reader, const std::string& name, Callback<EntryInfo> done);
+    void readRange(std::shared_ptr<const ArchiveReader> reader, const std::string& name,
+                   uint64_t offset, uint64_t length, Callback<Data> done);
+
+    int completionFd() const { return completion_fd_; }
+
+    // Выполняет готовые обратные вызовы; возвращает их число.
+    size_t runCompletions();
+
+private:
+    template <typename T, typename F>
+    std::future<T> submit(F work) {
+        auto promise = std::make_shared<std::promise<T>>();
+        std::future<T> result = promise->get_future();
+        bool queued = enqueue([promise, work]() {
+            try {
+                promise->set_value(work());
+            } catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        if (!queued) promise->set_exception(queueFullError());
+        return result;
+    }
+
+    template <typename T, typename F>
+    void submit(F work, Callback<T> done) {
+        bool queued = enqueue([this, work, done]() {
+            auto result = std::make_shared<T>();
+            std::exception_ptr error;
+            try {
+                *result = work();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            postCompletion([done, result, error]() { done(std::move(*result), error); });
+        });
+        if (!queued) {
+            std::exception_ptr error = queueFullError();
+            postCompletion([done, error]() { done(T(), error); });
+        }
+    }
+
+    static std::exception_ptr queueFullError();
+    bool enqueue(std::function<void()> task);
+    void postCompletion(std::function<void()> completion);
+    void workerLoop();
+
+    size_t queue_limit_;
+    bool stopping_ = false;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> workers_;
+
+    int completion_fd_ = -1;
+    std::mutex completion_mutex_;
+    std::vector<std::function<void()>> completions_;
+};
+
+// Общий каталог множества архивов: имя записи -> (архив, смещение данных). Файл отображается
+// в память целиком:
+//   CatalogHeader, CatalogArchive archives[archive_count], CatalogEntry entries[entry_count], строки
+// Записи отсортированы по хешу имени, так что поиск — бинарный поиск по массиву и сравнение имени.
+// Одинаковые имена из разных архивов хранятся в строках один раз.
+constexpr uint32_t CATALOG_MAGIC = 0x544B4B4D;  // "MKKT"
+constexpr uint16_t CATALOG_FORMAT_VERSION = 1;
+
+struct CatalogHeader {
+    uint32_t magic;
+    uint16_t format_version;
+    uint16_t reserved;
+    uint64_t archive_count;
+    uint64_t entry_count;
+    uint64_t archives_offset;
+    uint64_t entries_offset;
+    uint64_t strings_offset;
+};
+
+// Размер и mtime архива на момент сканирования: по ним обновление каталога решает,
+// можно ли взять записи архива из прежнего каталога.
+struct CatalogArchive {
+    uint64_t path_offset;  // от strings_offset
+    uint32_t path_size;
+    uint32_t reserved;
+    uint64_t archive_size;
+    int64_t archive_mtime_ns;
+    uint64_t entry_count;
+};
+
+struct CatalogEntry {
+    uint64_t name_hash;
+    uint64_t name_offset;  // от strings_offset
+    uint32_t name_size;
+    uint32_t archive;
+    uint64_t data_offset;
+};
+
+static_assert(sizeof(CatalogHeader) == 48, "CatalogHeader layout");
+static_assert(sizeof(CatalogArchive) == 40, "CatalogArchive layout");
+static_assert(sizeof(CatalogEntry) == 32, "CatalogEntry layout");
+
+struct CatalogMatch {
+    std::string archive;
+    uint64_t data_offset;
+};
+
+class Catalog {
+public:
+    explicit Catalog(const std::string& path);
+
+    uint64_t archiveCount() const { return header_.archive_count; }
+    uint64_t size() const { return header_.entry_count; }
+    CatalogArchive archive(uint64_t i) const;
+    std::string archivePath(uint64_t i) const;
+    CatalogEntry entry(uint64_t i) const;
+    std::string entryName(const CatalogEntry& entry) const;
+
+    // Все архивы, содержащие запись name.
+    std::vector<CatalogMatch> locate(const std::string& name) const;
+
+private:
+    std::string string(uint64_t offset, uint64_t size) const;
+
+    MappedFile map_;
+    CatalogHeader header_;
+};
+
+struct CatalogUpdate {
+    size_t scanned = 0;
+    size_t unchanged = 0;
+    size_t removed = 0;
+    uint64_t entry_count = 0;
+    std::vector<std::string> errors;  // "архив: сообщение"; такие архивы в каталог не попадают
+};
+
+// Создаёт или обновляет каталог по списку архивов. Из существующего каталога переносятся записи
+// архивов с прежними размером и mtime, остальные сканируются параллельно (worker_count = 0 —
+// по числу ядер); архивы, которых нет в списке, из каталога удаляются. Тома многотомных архивов
+// ищутся и в volume_dirs. Файл заменяется атомарно.
+CatalogUpdate updateCatalog(const std::string& catalog_path, const std::vector<std::string>& archive_paths,
+                            const std::vector<std::string>& volume_dirs = {}, unsigned worker_count = 0);
+
+// Общее хранилище кусков для архивов одного источника (pack --repository). Файлы режутся на куски
+// по содержимому (FastCDC), так что вставка в начало файла сдвигает только одну границу; кусок
+// адресуется SHA-256 своих исходных байт и хранится во всём хранилище один раз, сжатым своим
+// кодеком и фильтром. Архив становится манифестом: данные его записей с ENTRY_REFERENCES — только
+// список ссылок
+//   varint chunk_count, затем на каждый кусок ChunkId(32) и varint original_size
+// Каталог хранилища:
+//   index         — RepositoryIndexHeader, RepositoryIndexEntry[chunk_count] по возрастанию id
+//   packs/N.pack  — PackFileHeader, затем куски: PackChunkHeader и данные
+//   archives      — пути архивов, ссылающихся на хранилище, по строке на архив (для gc)
+// Пак-файлы только дописываются, а индекс заменяется атомарно: читатель видит либо прежнее
+// состояние, либо новое. Паки удаляет только gc, под исключительной блокировкой.
+using ChunkId = std::array<uint8_t, 32>;
+
+struct ChunkIdHash {
+    size_t operator()(const ChunkId& id) const {
+        size_t hash;
+        std::memcpy(&hash, id.data(), sizeof(hash));
+        return hash;
+    }
+};
+
+using ChunkIdSet = std::unordered_set<ChunkId, ChunkIdHash>;
+
+struct ChunkReference {
+    ChunkId id;
+    uint32_t size;
+};
+
+ChunkId chunkId(const uint8_t* data, size_t size);  // SHA-256
+std::string chunkIdHex(const ChunkId& id);
+
+// Границы FastCDC (нормализованное разбиение): до CDC_AVERAGE_CHUNK граница ищется по более
+// строгой маске, после — по более слабой, так что размеры кусков жмутся к среднему. Таблица
+// gear и маски — часть формата: при их смене одинаковые данные перестанут совпадать с хранилищем.
+constexpr size_t CDC_MIN_CHUNK = 256 << 10;
+constexpr size_t CDC_AVERAGE_CHUNK = 1 << 20;
+constexpr size_t CDC_MAX_CHUNK = 4 << 20;
+
+// Длина куска, начинающегося с data. Если граница не нашлась, возвращается min(size, CDC_MAX_CHUNK):
+// когда size < CDC_MAX_CHUNK и файл не кончился, нужно дочитать данные и спросить снова.
+size_t cdcChunkLength(const uint8_t* data, size_t size);
+
+std::string encodeChunkReferences(const std::vector<ChunkReference>& references);
+std::vector<ChunkReference> parseChunkReferences(const uint8_t* data, size_t size, uint64_t original_size);
+
+constexpr uint32_t REPOSITORY_INDEX_MAGIC = 0x49524B4D;  // "MKRI"
+constexpr uint32_t PACK_FILE_MAGIC = 0x504B4B4D;         // "MKKP"
+constexpr uint16_t REPOSITORY_FORMAT_VERSION = 1;
+
+struct RepositoryIndexHeader {
+    uint32_t magic;
+    uint16_t format_version;
+    uint16_t reserved;
+    uint64_t chunk_count;
+};
+
+struct RepositoryIndexEntry {
+    uint8_t id[32];
+    uint32_t pack;
+    uint32_t stored_size;
+    uint64_t offset;  // PackChunkHeader куска в паке
+};
+
+struct PackFileHeader {
+    uint32_t magic;
+    uint16_t format_version;
+    uint16_t reserved;
+    uint32_t pack;
+    uint32_t reserved2;
+};
+
+// Заголовок повторяет ключ индекса: по пакам можно проверить индекс или собрать его заново.
+struct PackChunkHeader {
+    uint8_t id[32];
+    uint32_t original_size;
+    uint32_t stored_size;
+    uint16_t compression;
+    uint8_t filter_type;
+    uint8_t filter_param;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(RepositoryIndexHeader) == 16, "RepositoryIndexHeader layout");
+static_assert(sizeof(RepositoryIndexEntry) == 48, "RepositoryIndexEntry layout");
+static_assert(sizeof(PackFileHeader) == 16, "PackFileHeader layout");
+static_assert(sizeof(PackChunkHeader) == 48, "PackChunkHeader layout");
+
+enum RepositoryMode {
+    REPOSITORY_READ,    // чтение кусков: не мешает упаковке, gc ждёт
+    REPOSITORY_APPEND,  // добавление кусков: упаковки в одно хранилище идут по очереди
+    REPOSITORY_COLLECT  // gc: исключительный доступ
+};
+
+struct RepositoryCollection {
+    uint64_t chunks_kept = 0;
+    uint64_t chunks_removed = 0;
+    uint64_t packs_rewritten = 0;
+    uint64_t packs_removed = 0;
+    uint64_t bytes_reclaimed = 0;
+};
+
+class ChunkRepository {
+public:
+    static constexpr uint64_t PACK_BYTES = 256ULL << 20;  // после этого размера начинается новый пак
+    static constexpr int GC_REWRITE_PERCENT = 25;         // пак с такой долей мёртвых байт переписывается
+
+    // Хранилище создаётся при первом открытии на запись.
+    ChunkRepository(const std::string& dir, RepositoryMode mode);
+    ~ChunkRepository();
+
+    ChunkRepository(const ChunkRepository&) = delete;
+    ChunkRepository& operator=(const ChunkRepository&) = delete;
+
+    const std::string& path() const { return dir_; }
+    uint64_t size() const;
+    bool contains(const ChunkId& id) const;
+
+    // Сжимает и дописывает кусок, если его ещё нет; true — кусок новый. Безопасно из нескольких
+    // потоков; одинаковые куски, пришедшие одновременно, сохраняются один раз. Видны другим
+    // процессам куски становятся после commit().
+    bool store(const ChunkId& id, const uint8_t* data, size_t size, uint16_t compression, int level, EntryFilter filter);
+    // Сколько байт дописано в паки этим экземпляром.
+    uint64_t storedBytes() const;
+
+    // Исходные байты куска, сверенные с id; бросает исключение, если его нет или он испорчен.
+    std::vector<uint8_t> read(const ChunkId& id) const;
+
+    // Сбрасывает новые паки на диск и атомарно заменяет индекс.
+    void commit();
+
+    std::vector<std::string> archives() const { return archives_; }
+    // Регистрирует архив до того, как он сошлётся на куски: иначе gc, увидев ссылки
+    // незарегистрированного архива, мог бы их удалить.
+    void addArchive(const std::string& archive_path);
+
+    // gc: оставляет куски из live, архивы — из archives. Паки без живых кусков удаляются, паки
+    // с долей мёртвых байт от GC_REWRITE_PERCENT переписываются. Только в REPOSITORY_COLLECT.
+    RepositoryCollection collectGarbage(const ChunkIdSet& live, const std::vector<std::string>& archives);
+
+private:
+    struct Location {
+        uint32_t pack;
+        uint32_t stored_size;
+        uint64_t offset;
+    };
+
+    std::string packPath(uint32_t pack) const;
+    int packFd(uint32_t pack) const;  // под mutex_
+    void loadIndex();
+    // Место под кусок в текущем паке (новый пак, если текущий заполнен) и дескриптор пака; под mutex_.
+    Location reserve(uint32_t stored_size, int& fd);
+    static void writeRecord(int fd, const Location& location, const PackChunkHeader& header, const uint8_t* data);
+    void writeArchives();
+
+    std::string dir_;
+    RepositoryMode mode_;
+    int lock_fd_ = -1;
+    int append_lock_fd_ = -1;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<ChunkId, Location, ChunkIdHash> index_;
+    ChunkIdSet pending_;  // сжимаются прямо сейчас
+    mutable std::unordered_map<uint32_t, int> pack_fds_;
+    std::vector<uint32_t> written_packs_;  // созданы этим экземпляром, ещё не сброшены
+    uint32_t next_pack_ = 1;
+    uint32_t current_pack_ = 0;  // 0 — нового пака ещё нет
+    uint64_t current_size_ = 0;
+    uint64_t stored_bytes_ = 0;
+    std::vector<std::string> archives_;
+};
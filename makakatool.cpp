@@ -1,246 +1,3340 @@
+#include "makaka.h"
+
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <filesystem>
-#include <lzma.h>
-#include <zstd.h>
 #include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <tuple>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+namespace fs = std::filesystem;
+
+// Ограничение скорости ввода-вывода: два ведра токенов (байты и операции), общие для всех потоков
+// чтения и записи. Учёт ведётся после операции: поток, ушедший в долг, спит, пока долг не
+// погасится, поэтому и крупные операции в среднем не превышают лимит. Лимит 0 — без ограничения.
+// SIGUSR1 вдвое снижает заданные лимиты (если их нет — вводит лимит в половину средней скорости
+// с начала работы), SIGUSR2 вдвое повышает.
+class IoThrottle {
+public:
+    static constexpr double BURST_SECONDS = 0.1;
+
+    void setLimits(uint64_t bytes_per_second, uint64_t ops_per_second) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bytes_.rate = static_cast<double>(bytes_per_second);
+        ops_.rate = static_cast<double>(ops_per_second);
+    }
+
+    bool active() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bytes_.rate > 0 || ops_.rate > 0;
+    }
+
+    void account(uint64_t bytes) {
+        double wait = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto now = std::chrono::steady_clock::now();
+            if (total_ops_ == 0) start_ = last_ = now;
+            applySignals(now);
+
+            double elapsed = std::chrono::duration<double>(now - last_).count();
+            last_ = now;
+            total_bytes_ += bytes;
+            total_ops_ += 1;
+            wait = std::max(bytes_.take(bytes, elapsed), ops_.take(1, elapsed));
+        }
+        if (wait > 0) std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+
+    static void installSignalHandlers() {
+        signal(SIGUSR1, [](int) { ++slower_requests_; });
+        signal(SIGUSR2, [](int) { ++faster_requests_; });
+    }
+
+private:
+    struct Bucket {
+        double rate = 0;
+        double tokens = 0;
+
+        // Возвращает, сколько секунд ждать до погашения долга.
+        double take(double amount, double elapsed) {
+            if (rate <= 0) return 0;
+            tokens = std::min(rate * BURST_SECONDS, tokens + rate * elapsed) - amount;
+            return tokens < 0 ? -tokens / rate : 0;
+        }
+
+        void scale(double factor) {
+            rate *= factor;
+            tokens = std::min(tokens, rate * BURST_SECONDS);
+        }
+    };
+
+    void applySignals(std::chrono::steady_clock::time_point now) {
+        int slower = slower_requests_.exchange(0);
+        int faster = faster_requests_.exchange(0);
+        if (slower == 0 && faster == 0) return;
+
+        double elapsed = std::max(1e-3, std::chrono::duration<double>(now - start_).count());
+        if (slower > 0 && bytes_.rate <= 0 && ops_.rate <= 0) {
+            bytes_.rate = std::max(1.0, total_bytes_ / elapsed);
+        }
+        double factor = std::pow(2.0, faster - slower);
+        if (bytes_.rate > 0) bytes_.scale(factor);
+        if (ops_.rate > 0) ops_.scale(factor);
+        std::cerr << "I/O limit: " << static_cast<uint64_t>(bytes_.rate) / 1024 << " KiB/s, "
+                  << static_cast<uint64_t>(ops_.rate) << " ops/s" << std::endl;
+    }
+
+    static std::atomic<int> slower_requests_;
+    static std::atomic<int> faster_requests_;
+
+    mutable std::mutex mutex_;
+    Bucket bytes_;
+    Bucket ops_;
+    uint64_t total_bytes_ = 0;
+    uint64_t total_ops_ = 0;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::time_point last_;
+};
+
+std::atomic<int> IoThrottle::slower_requests_{0};
+std::atomic<int> IoThrottle::faster_requests_{0};
+
+IoThrottle io_throttle;
+
+// Класс приоритета ввода-вывода процесса (как у ionice): "idle" или "be[:0-7]". Задаётся до запуска
+// потоков, они его наследуют.
+void setIoPriority(const std::string& spec) {
+    constexpr int IOPRIO_CLASS_SHIFT = 13;
+    constexpr int IOPRIO_CLASS_BE = 2;
+    constexpr int IOPRIO_CLASS_IDLE = 3;
+    constexpr int IOPRIO_WHO_PROCESS = 1;
+
+    int priority;
+    if (spec == "idle") {
+        priority = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    } else if (spec == "be" || (spec.size() == 4 && spec.compare(0, 3, "be:") == 0
+                                 && std::isdigit(static_cast<unsigned char>(spec[3])))) {
+        int level = spec == "be" ? 4 : spec[3] - '0';
+        if (level > 7) throw std::runtime_error("I/O priority level must be 0..7");
+        priority = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | level;
+    } else {
+        throw std::runtime_error("Unknown I/O priority class: " + spec);
+    }
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, priority) != 0) {
+        throw std::runtime_error(std::string("ioprio_set failed: ") + std::strerror(errno));
+    }
+}
+
+enum FilterMode {
+    FILTER_MODE_AUTO,
+    FILTER_MODE_FIXED
+};
+
+enum EntryOrder {
+    ORDER_ARGS,
+    ORDER_SIMILARITY
+};
+
+// Эскиз содержимого для группировки похожих файлов: расширение, размер и MinHash
+// по 8-байтовым шинглам начала файла. Для LSH значения MinHash делятся на SKETCH_BANDS полос:
+// файлы, у которых совпала хотя бы одна полоса целиком, считаются похожими. При 4 полосах
+// по 4 значения пара со сходством Жаккара 0.8 попадает в одну группу с вероятностью ~0.9,
+// а 0.3 — ~0.03.
+constexpr size_t SKETCH_SAMPLE_SIZE = 64 * 1024;
+constexpr size_t SKETCH_HASHES = 16;
+constexpr size_t SKETCH_BANDS = 4;
+constexpr size_t SKETCH_ROWS = SKETCH_HASHES / SKETCH_BANDS;
+
+struct ContentSketch {
+    std::string extension;
+    uint64_t size = 0;
+    uint64_t minhash[SKETCH_HASHES];
+};
+
+ContentSketch sketchFile(const std::string& path) {
+    ContentSketch sketch;
+    std::fill(std::begin(sketch.minhash), std::end(sketch.minhash), UINT64_MAX);
+    sketch.extension = fs::path(path).extension().string();
+
+    std::error_code ec;
+    sketch.size = fs::file_size(path, ec);
+    if (ec) sketch.size = 0;
+
+    std::ifstream in(path, std::ios::binary);
+    std::vector<uint8_t> sample(SKETCH_SAMPLE_SIZE);
+    in.read(reinterpret_cast<char*>(sample.data()), sample.size());
+    sample.resize(in.gcount());
+
+    for (size_t i = 0; i + 8 <= sample.size(); ++i) {
+        uint64_t shingle;
+        std::memcpy(&shingle, sample.data() + i, 8);
+        uint64_t h = mix64(shingle);
+        for (size_t k = 0; k < SKETCH_HASHES; ++k) {
+            uint64_t v = mix64(h ^ (0x9E3779B97F4A7C15ULL * (k + 1)));
+            if (v < sketch.minhash[k]) sketch.minhash[k] = v;
+        }
+    }
+    return sketch;
+}
+
+size_t findGroup(std::vector<size_t>& parent, size_t i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+// Переупорядочивает входные файлы так, чтобы похожие оказались рядом. Файлы с общей полосой
+// MinHash объединяются в группы (транзитивно); группы идут по расширению первого файла, затем
+// в порядке аргументов, внутри группы — по расширению и размеру. Имена и пути в архиве
+// не меняются — меняется только порядок записей.
+std::vector<std::string> orderBySimilarity(const std::vector<std::string>& files) {
+    std::vector<ContentSketch> sketches(files.size());
+    std::atomic<size_t> next{0};
+    unsigned worker_count = workerCount(files.size());
+
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < worker_count; ++w) {
+        workers.emplace_back([&, w] {
+            pinCurrentWorker(w);
+            for (size_t i; (i = next++) < files.size();) {
+                sketches[i] = sketchFile(files[i]);
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+
+    std::vector<size_t> parent(files.size());
+    for (size_t i = 0; i < parent.size(); ++i) parent[i] = i;
+    for (size_t band = 0; band < SKETCH_BANDS; ++band) {
+        std::unordered_map<uint64_t, size_t> buckets;
+        for (size_t i = 0; i < files.size(); ++i) {
+            uint64_t key = band;
+            for (size_t k = band * SKETCH_ROWS; k < (band + 1) * SKETCH_ROWS; ++k) key = mix64(key ^ sketches[i].minhash[k]);
+            auto inserted = buckets.emplace(key, i);
+            if (!inserted.second) parent[findGroup(parent, i)] = findGroup(parent, inserted.first->second);
+        }
+    }
+
+    // Группа представлена первым по аргументам файлом.
+    std::vector<size_t> first(files.size(), SIZE_MAX), leader(files.size());
+    for (size_t i = 0; i < files.size(); ++i) {
+        size_t group = findGroup(parent, i);
+        if (first[group] == SIZE_MAX) first[group] = i;
+        leader[i] = first[group];
+    }
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        size_t x = leader[a];
+        size_t y = leader[b];
+        if (x != y) {
+            if (sketches[x].extension != sketches[y].extension) return sketches[x].extension < sketches[y].extension;
+            return x < y;
+        }
+        if (sketches[a].extension != sketches[b].extension) return sketches[a].extension < sketches[b].extension;
+        return sketches[a].size < sketches[b].size;
+    });
+
+    std::vector<std::string> ordered;
+    ordered.reserve(files.size());
+    for (size_t i : order) ordered.push_back(files[i]);
+    return ordered;
+}
+
+enum ReadOrder {
+    READ_ORDER_ARGS,
+    READ_ORDER_PHYSICAL
+};
+
+// Когда выходные файлы (архив или распакованные) сбрасываются на диск.
+enum SyncPolicy {
+    SYNC_NONE,   // не сбрасываются, как обычная запись
+    SYNC_END,    // один раз в конце
+    SYNC_BATCH,  // запись на диск начинается сразу (sync_file_range), fsync — группами и в конце
+    SYNC_EACH    // после каждой записи
+};
+
+struct PackSettings {
+    CompressionType compression = COMPRESS_ZSTD;
+    int level = findCodecPreset("zstd")->level;  // задаётся вместе с кодеком через -c
+    FilterMode filter_mode = FILTER_MODE_AUTO;
+    EntryFilter filter;
+    ReadOrder read_order = READ_ORDER_ARGS;
+    size_t prefetch_bytes = 64 << 20;  // сколько входных данных может быть в работе: прочитано, но не записано
+    uint32_t chunk_size = 16 << 20;    // файлы больше — кусками (формат 2.2); 0 — не разбивать
+    unsigned checkpoint_seconds = 0;   // интервал контрольных точек; 0 — без них
+    bool resume = false;               // продолжить по контрольной точке; без интервала — раз в минуту
+    SyncPolicy sync = SYNC_NONE;
+    bool hash_index = false;
+    uint64_t volume_size = 0;  // 0 — один файл
+    std::vector<std::string> volume_dirs;
+};
+
+// Ключ физического расположения файла: устройство, затем смещение первого экстента (FIEMAP),
+// а если файловая система его не сообщает — номер inode как приближение порядка на диске.
+struct PhysicalLocation {
+    uint64_t device = 0;
+    int kind = 2;  // 0 — физическое смещение, 1 — inode, 2 — неизвестно
+    uint64_t position = 0;
+
+    bool operator<(const PhysicalLocation& other) const {
+        if (device != other.device) return device < other.device;
+        if (kind != other.kind) return kind < other.kind;
+        return position < other.position;
+    }
+};
+
+PhysicalLocation physicalLocation(const std::string& path) {
+    PhysicalLocation location;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return location;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        location.device = st.st_dev;
+        location.kind = 1;
+        location.position = st.st_ino;
+    }
+
+    alignas(struct fiemap) char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+    auto* map = reinterpret_cast<struct fiemap*>(buffer);
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0
+        && !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_NOT_ALIGNED))) {
+        location.kind = 0;
+        location.position = map->fm_extents[0].fe_physical;
+    }
+
+    close(fd);
+    return location;
+}
+
+// Порядок чтения входных файлов (индексы в files) по их расположению на диске.
+std::vector<size_t> physicalReadOrder(const std::vector<std::string>& files) {
+    std::vector<PhysicalLocation> locations(files.size());
+    for (size_t i = 0; i < files.size(); ++i) locations[i] = physicalLocation(files[i]);
+
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return locations[a] < locations[b];
+    });
+    return order;
+}
+
+struct PackedEntry {
+    bool present = false;
+    uint64_t original_size = 0;
+    uint64_t content_hash = 0;
+    int64_t mtime_ns = 0;
+    EntryFilter filter;
+    std::vector<uint8_t> data;
+};
+
+EntryFilter chooseFilter(const std::vector<uint8_t>& data, const PackSettings& settings) {
+    if (!(findCodec(settings.compression)->capabilities & CODEC_COMPRESSES)) return EntryFilter();
+    return settings.filter_mode == FILTER_MODE_AUTO ? detectFilter(data) : settings.filter;
+}
+
+// Сжимает прочитанный файл. file_data используется как рабочий буфер.
+PackedEntry packData(std::vector<uint8_t>& file_data, const PackSettings& settings) {
+    PackedEntry entry;
+    entry.present = true;
+    entry.original_size = file_data.size();
+    entry.content_hash = contentHash(file_data);
+    entry.filter = chooseFilter(file_data, settings);
+    entry.data = encodeEntryData(settings.compression, settings.level, entry.filter, file_data);
+    return entry;
+}
+
+// Вход пропал (удалён или каталог на пути заменён) — такой файл пропускается с предупреждением.
+// Остальные ошибки открытия и чтения прерывают упаковку: иначе архив молча остался бы без файла.
+bool inputVanished(int error) {
+    return error == ENOENT || error == ENOTDIR;
+}
+
+std::runtime_error inputError(const char* what, const std::string& path) {
+    return std::runtime_error(std::string(what) + " " + path + ": " + std::strerror(errno));
+}
+
+// false — файла нет (или это каталог); ошибки ввода-вывода бросают исключение.
+bool readWholeFile(const std::string& path, std::vector<uint8_t>& data, int64_t* mtime_ns = nullptr) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (inputVanished(errno)) return false;
+        throw inputError("Failed to open", path);
+    }
+
+    struct stat st;
+    data.clear();
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        data.reserve(st.st_size);
+        if (mtime_ns) *mtime_ns = mtimeNanoseconds(st);
+    }
+
+    uint8_t chunk[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) {
+            data.insert(data.end(), chunk, chunk + n);
+            io_throttle.account(n);
+        }
+    }
+    int error = errno;
+    close(fd);
+    if (n == 0) return true;
+    if (error == EISDIR) return false;
+    errno = error;
+    throw inputError("Failed to read", path);
+}
+
+// Чтение size байт с offset; false — файл оказался короче.
+bool readFileRange(int fd, uint8_t* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pread(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        io_throttle.account(n);
+        data += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool writeFileRange(int fd, const uint8_t* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        io_throttle.account(n);
+        data += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Выделяет место под файл известного размера одним куском (меньше фрагментация, особенно при
+// параллельной записи). Если ФС не умеет fallocate — ничего страшного, файл растёт записью.
+void preallocateFile(int fd, uint64_t size) {
+    if (size > 0) fallocate(fd, 0, 0, size);
+}
+
+// Сжатие на WorkStealingPool. Планировщик (отдельный поток) проходит входы в порядке чтения и режет
+// работу на задачи: файл больше chunk_size — на куски, сжимаемые независимо; мелкие файлы — пачками,
+// чтобы не платить за задачу на каждый; остальные — по одному. Главный поток забирает результаты
+// строго в порядке files (takeEntry/takeChunk), куски большой записи — по мере готовности.
+// Новая работа ставится, пока объём входных данных в работе (от чтения до записи) меньше
+// prefetch_bytes. Если очередная нужная главному потоку часть ещё не поставлена, планировщик берёт
+// её вне порядка чтения и сверх бюджета: при чтении не в порядке files (--read-order=physical)
+// нужная запись не ждёт, пока прочитаются остальные, а в работе остаётся не больше
+// prefetch_bytes плюс одна часть.
+class PackPipeline {
+public:
+    static constexpr uint64_t SMALL_FILE_BYTES = 1 << 20;
+    static constexpr uint64_t BATCH_BYTES = 4 << 20;
+    static constexpr size_t BATCH_FILES = 1024;
+    static constexpr size_t FILTER_SAMPLE_BYTES = 1 << 16;  // detectFilter смотрит не дальше
+
+    struct Plan {
+        bool chunked = false;
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        EntryFilter filter;
+        size_t chunk_count = 0;
+    };
+
+    struct Chunk {
+        uint64_t crc = 0;
+        std::vector<uint8_t> data;
+    };
+
+    // resume_chunks — сколько кусков входа resume_input уже записано (продолжение по контрольной точке).
+    PackPipeline(const std::vector<std::string>& files, const std::vector<size_t>& order, const PackSettings& settings,
+                 size_t resume_input = 0, size_t resume_chunks = 0)
+        : files_(files), order_(order), settings_(settings), slots_(files.size()),
+          head_(resume_input), resume_input_(resume_input), resume_chunks_(resume_chunks) {
+        planner_ = std::thread(&PackPipeline::run, this);
+    }
+
+    ~PackPipeline() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        space_.notify_all();
+        planner_.join();
+    }
+
+    Plan plan(size_t index) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return waitFor(lock, index, [&] { return slots_[index].planned; }).plan;
+    }
+
+    PackedEntry takeEntry(size_t index) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        Slot& slot = waitFor(lock, index, [&] { return slots_[index].done == 1; });
+        PackedEntry entry = std::move(slot.entry);
+        release(index + 1, slot.plan.size);
+        return entry;
+    }
+
+    Chunk takeChunk(size_t index, size_t k) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        Slot& slot = waitFor(lock, index, [&] { return slots_[index].chunks[k].done; });
+        Chunk chunk = std::move(slot.chunks[k].chunk);
+        slot.written = k + 1;
+        release(slot.written == slot.plan.chunk_count ? index + 1 : index, slot.chunks[k].size);
+        return chunk;
+    }
+
+private:
+    struct ChunkSlot {
+        bool done = false;
+        uint64_t size = 0;
+        Chunk chunk;
+    };
+
+    // Закрывает вход, когда готовы все его куски.
+    struct InputFile {
+        int fd;
+        explicit InputFile(int fd) : fd(fd) {}
+        ~InputFile() { close(fd); }
+    };
+
+    struct Slot {
+        bool planned = false;
+        bool queued = false;   // вся работа по входу отдана: поставлена или лежит в пачке
+        Plan plan;
+        size_t submitted = 0;  // поставлено частей: кусков или 1
+        size_t written = 0;    // забрано главным потоком
+        size_t done = 0;
+        PackedEntry entry;
+        std::vector<ChunkSlot> chunks;
+        std::shared_ptr<InputFile> input;  // открытый вход большой записи, пока не поставлены все куски
+    };
+
+    template <typename Ready>
+    Slot& waitFor(std::unique_lock<std::mutex>& lock, size_t index, Ready ready) {
+        head_ = index;
+        space_.notify_all();
+        progress_.wait(lock, [&] { return !error_.empty() || ready(); });
+        if (!error_.empty()) throw std::runtime_error(error_);
+        return slots_[index];
+    }
+
+    // Часть записи забрана: место в бюджете свободно, head — следующая нужная запись.
+    void release(size_t head, uint64_t bytes) {
+        head_ = head;
+        in_flight_ -= bytes;
+        space_.notify_all();
+    }
+
+    // Главный поток ждёт часть, которая ещё не поставлена в пул.
+    bool headStarved() const {
+        if (head_ >= slots_.size()) return false;
+        const Slot& slot = slots_[head_];
+        if (!slot.planned) return true;
+        if (slot.plan.chunked) return slot.submitted == slot.written && slot.submitted < slot.plan.chunk_count;
+        return slot.submitted == 0;
+    }
+
+    void fail(const std::string& error) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_.empty()) error_ = error;
+        progress_.notify_all();
+    }
+
+    // Ставит задачу с bytes входных данных; mark под блокировкой отмечает поставленные части.
+    // Место в бюджете проверяет nextInput. false — упаковка прервана.
+    template <typename Mark>
+    bool submit(uint64_t bytes, Mark mark, WorkStealingPool::Task task) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopped_ || !error_.empty()) return false;
+        in_flight_ += bytes;
+        mark();
+        lock.unlock();
+        pool_.submit(std::move(task));
+        return true;
+    }
+
+    // Вход, по которому планировщику работать дальше: запись, которую ждёт главный поток, если её
+    // часть ещё не поставлена, иначе очередной по порядку чтения, когда в бюджете есть место.
+    // SIZE_MAX — входы кончились или упаковка прервана.
+    size_t nextInput(size_t& cursor) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            if (stopped_ || !error_.empty()) return SIZE_MAX;
+            if (headStarved()) return head_;
+            while (cursor < order_.size() && slots_[order_[cursor]].queued) ++cursor;
+            if (cursor == order_.size()) return SIZE_MAX;
+            if (in_flight_ < settings_.prefetch_bytes) return order_[cursor];
+            space_.wait(lock);
+        }
+    }
+
+    bool aborted() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stopped_ || !error_.empty();
+    }
+
+    void adviseWillNeed(int fd, uint64_t offset, uint64_t size) {
+        // Чтение, запущенное WILLNEED, идёт мимо ограничителя скорости.
+        if (!io_throttle.active()) posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+    }
+
+    void packFiles(const std::vector<size_t>& indices) {
+        std::vector<uint8_t> data;
+        for (size_t index : indices) {
+            PackedEntry entry;
+            int64_t mtime_ns = 0;
+            if (!aborted() && readWholeFile(files_[index], data, &mtime_ns)) {
+                entry = packData(data, settings_);
+                entry.mtime_ns = mtime_ns;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_[index].entry = std::move(entry);
+            slots_[index].done = 1;
+            progress_.notify_all();
+        }
+    }
+
+    void packChunk(size_t index, size_t k, const std::shared_ptr<InputFile>& input) {
+        Chunk chunk;
+        const Plan& plan = slots_[index].plan;
+        if (!aborted()) {
+            std::vector<uint8_t> data(std::min<uint64_t>(settings_.chunk_size, plan.size - k * settings_.chunk_size));
+            if (!readFileRange(input->fd, data.data(), data.size(), k * settings_.chunk_size)) {
+                throw std::runtime_error("Failed to read " + files_[index] + " (file changed while packing?)");
+            }
+            chunk.crc = contentHash(data);
+            chunk.data = encodeEntryData(settings_.compression, settings_.level, plan.filter, data);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        slots_[index].chunks[k].chunk = std::move(chunk);
+        slots_[index].chunks[k].done = true;
+        progress_.notify_all();
+    }
+
+    // Обёртка задачи: ошибка прерывает упаковку и пробрасывается из take*.
+    WorkStealingPool::Task guarded(std::function<void()> work) {
+        return [this, work] {
+            try {
+                work();
+            } catch (const std::exception& e) {
+                fail(e.what());
+            }
+        };
+    }
+
+    bool submitBatch(std::vector<size_t>& batch, uint64_t& batch_bytes) {
+        if (batch.empty()) return true;
+        std::vector<size_t> indices;
+        indices.swap(batch);
+        uint64_t bytes = batch_bytes;
+        batch_bytes = 0;
+        return submit(bytes, [&] {
+            for (size_t index : indices) slots_[index].submitted = 1;
+        }, guarded([this, indices] { packFiles(indices); }));
+    }
+
+    // Отмечает файл спланированным; главный поток может начать ждать его части.
+    void setPlan(size_t index, const Plan& plan, bool missing, std::shared_ptr<InputFile> input = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot& slot = slots_[index];
+        slot.plan = plan;
+        slot.input = std::move(input);
+        slot.chunks.resize(plan.chunk_count);
+        for (size_t k = 0; k < plan.chunk_count; ++k) {
+            slot.chunks[k].size = std::min<uint64_t>(settings_.chunk_size, plan.size - k * settings_.chunk_size);
+        }
+        if (missing) {
+            slot.submitted = 1;
+            slot.done = 1;
+            slot.queued = true;
+        }
+        if (index == resume_input_ && plan.chunked) {
+            slot.submitted = slot.written = std::min(resume_chunks_, plan.chunk_count);
+        }
+        if (plan.chunked && slot.submitted == plan.chunk_count) {
+            slot.queued = true;
+            slot.input.reset();
+        }
+        slot.planned = true;
+        progress_.notify_all();
+        space_.notify_all();
+    }
+
+    // Открывает вход и решает, как его сжимать. Мелкие файлы копятся в пачке, средние ставятся
+    // целиком, у большой записи только планируются куски: их ставит submitNextChunk.
+    bool planInput(size_t index, std::vector<size_t>& batch, uint64_t& batch_bytes) {
+        Plan plan;
+        int fd = open(files_[index].c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 && !inputVanished(errno)) {
+            fail(inputError("Failed to open", files_[index]).what());
+            return false;
+        }
+        struct stat st;
+        bool regular = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (fd < 0) {
+            setPlan(index, plan, true);
+            return true;
+        }
+        plan.size = regular ? st.st_size : 0;
+        plan.mtime_ns = regular ? mtimeNanoseconds(st) : 0;
+
+        if (regular && settings_.chunk_size > 0 && plan.size > settings_.chunk_size) {
+            auto input = std::make_shared<InputFile>(fd);
+            if (!submitBatch(batch, batch_bytes)) return false;
+            std::vector<uint8_t> sample(std::min<uint64_t>(FILTER_SAMPLE_BYTES, plan.size));
+            if (!readFileRange(fd, sample.data(), sample.size(), 0)) {
+                fail("Failed to read " + files_[index]);
+                return false;
+            }
+            plan.chunked = true;
+            plan.filter = chooseFilter(sample, settings_);
+            plan.chunk_count = (plan.size + settings_.chunk_size - 1) / settings_.chunk_size;
+            setPlan(index, plan, false, input);
+            return true;
+        }
+
+        adviseWillNeed(fd, 0, 0);
+        close(fd);
+        setPlan(index, plan, false);
+        if (regular && plan.size < SMALL_FILE_BYTES) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                slots_[index].queued = true;
+            }
+            batch.push_back(index);
+            batch_bytes += plan.size;
+            if (batch.size() < BATCH_FILES && batch_bytes < BATCH_BYTES) return true;
+            return submitBatch(batch, batch_bytes);
+        }
+
+        if (!submitBatch(batch, batch_bytes)) return false;
+        std::vector<size_t> single{index};
+        return submit(plan.size, [&] {
+            slots_[index].submitted = 1;
+            slots_[index].queued = true;
+        }, guarded([this, single] { packFiles(single); }));
+    }
+
+    bool submitNextChunk(size_t index) {
+        std::shared_ptr<InputFile> input;
+        size_t k;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            input = slots_[index].input;
+            k = slots_[index].submitted;
+        }
+        const Plan& plan = slots_[index].plan;
+        uint64_t offset = k * settings_.chunk_size;
+        uint64_t size = std::min<uint64_t>(settings_.chunk_size, plan.size - offset);
+        bool submitted = submit(size, [&] {
+            Slot& slot = slots_[index];
+            if (++slot.submitted == plan.chunk_count) {
+                slot.queued = true;
+                slot.input.reset();
+            }
+        }, guarded([this, index, k, input] { packChunk(index, k, input); }));
+        if (submitted) adviseWillNeed(input->fd, offset, size);
+        return submitted;
+    }
+
+    void run() {
+        std::vector<size_t> batch;
+        uint64_t batch_bytes = 0;
+        size_t cursor = 0;
+        for (size_t index; (index = nextInput(cursor)) != SIZE_MAX;) {
+            bool planned, chunked, in_batch;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                const Slot& slot = slots_[index];
+                planned = slot.planned;
+                chunked = slot.plan.chunked;
+                in_batch = slot.queued && slot.submitted == 0;
+            }
+            // Запись из недобранной пачки выбирается, только когда её ждёт главный поток: пачка
+            // ставится сразу.
+            bool ok = !planned ? planInput(index, batch, batch_bytes)
+                    : chunked ? submitNextChunk(index)
+                    : !in_batch || submitBatch(batch, batch_bytes);
+            if (!ok) return;
+        }
+        submitBatch(batch, batch_bytes);
+    }
+
+    const std::vector<std::string>& files_;
+    const std::vector<size_t>& order_;
+    const PackSettings& settings_;
+
+    std::mutex mutex_;
+    std::condition_variable progress_;  // готова часть или ошибка — для главного потока
+    std::condition_variable space_;     // освободилось место — для планировщика
+    std::vector<Slot> slots_;
+    size_t head_;  // запись, которую ждёт главный поток
+    const size_t resume_input_;
+    const size_t resume_chunks_;
+    uint64_t in_flight_ = 0;
+    bool stopped_ = false;
+    std::string error_;
+
+    // Пул объявлен после slots_: при разрушении он дорабатывает поставленные задачи, пока они ещё живы.
+    WorkStealingPool pool_;
+    std::thread planner_;
+};
+
+// fsync каталога: после него переживает сбой и сама запись о созданном файле.
+void syncDirectory(const std::string& dir) {
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+// Сброс распакованных файлов на диск по SyncPolicy. Для SYNC_BATCH у каждого файла сразу
+// запускается запись (sync_file_range не ждёт), а копия дескриптора копится в пачке; fdatasync
+// пачки идёт, когда в ней BATCH_FILES файлов или BATCH_BYTES байт, — к этому времени данные
+// в основном уже на диске, и потоки распаковки не стоят на fsync каждого файла. Каталоги
+// с новыми файлами сбрасываются в finish().
+class OutputSync {
+public:
+    static constexpr size_t BATCH_FILES = 256;
+    static constexpr uint64_t BATCH_BYTES = 256 << 20;
+
+    void setPolicy(SyncPolicy policy) { policy_ = policy; }
+
+    // Вызывается, когда файл дописан; fd остаётся у вызывающего.
+    void written(int fd, const std::string& path, uint64_t size) {
+        if (policy_ == SYNC_NONE || policy_ == SYNC_END) return;
+        if (policy_ == SYNC_EACH) {
+            if (fdatasync(fd) != 0) throw std::runtime_error("Failed to sync " + path);
+        } else {
+            sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+
+        std::vector<std::pair<int, std::string>> full;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            dirs_.insert(fs::path(path).parent_path().string());
+            if (policy_ != SYNC_BATCH) return;
+            int copy = dup(fd);
+            if (copy < 0) throw std::runtime_error("Failed to sync " + path);
+            batch_.emplace_back(copy, path);
+            batch_bytes_ += size;
+            if (batch_.size() < BATCH_FILES && batch_bytes_ < BATCH_BYTES) return;
+            full.swap(batch_);
+            batch_bytes_ = 0;
+        }
+        syncBatch(full);
+    }
+
+    // Жёсткая ссылка: данные сбрасываются с исходным файлом, остаётся запись в каталоге.
+    void linked(const std::string& path) {
+        if (policy_ == SYNC_NONE || policy_ == SYNC_END) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        dirs_.insert(fs::path(path).parent_path().string());
+    }
+
+    void finish(const std::string& output_dir) {
+        if (policy_ == SYNC_NONE) return;
+        if (policy_ == SYNC_END) {
+            // Один syncfs вместо fsync каждого файла и каталога.
+            int fd = open(output_dir.empty() ? "." : output_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            bool synced = fd >= 0 && syncfs(fd) == 0;
+            if (fd >= 0) close(fd);
+            if (!synced) throw std::runtime_error("Failed to sync " + output_dir);
+            return;
+        }
+        std::vector<std::pair<int, std::string>> rest;
+        std::set<std::string> dirs;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            rest.swap(batch_);
+            batch_bytes_ = 0;
+            dirs.swap(dirs_);
+        }
+        syncBatch(rest);
+        for (const auto& dir : dirs) syncDirectory(dir);
+    }
+
+private:
+    static void syncBatch(std::vector<std::pair<int, std::string>>& batch) {
+        std::string failed;
+        for (const auto& [fd, path] : batch) {
+            if (fdatasync(fd) != 0 && failed.empty()) failed = path;
+            close(fd);
+        }
+        batch.clear();
+        if (!failed.empty()) throw std::runtime_error("Failed to sync " + failed);
+    }
+
+    SyncPolicy policy_ = SYNC_NONE;
+    std::mutex mutex_;
+    std::vector<std::pair<int, std::string>> batch_;
+    uint64_t batch_bytes_ = 0;
+    std::set<std::string> dirs_;
+};
+
+OutputSync output_sync;
+
+// Вывод архива: один файл или тома по volume_size байт, разложенные по кругу в volume_dirs
+// (недостающие каталоги создаются).
+// Запись идёт фоновыми потоками, по одному на каталог (обычно отдельное устройство): пока упаковщик
+// заполняет том на одном устройстве, предыдущие дописываются на других. Очередь каждого потока
+// ограничена WRITER_QUEUE_BYTES, при переполнении упаковщик ждёт.
+//
+// Тома пишутся во временные файлы "<том>.tmp" и переименовываются в finish(), когда архив
+// дописан: при ошибке на месте архива остаётся прежний (или ничего), а не недописанный том с нулями
+// за концом. Временные файлы удаляются деструктором, если на них не ссылается контрольная точка
+// (keepPartial()).
+//
+// Место под том выделяется заранее: целиком, если размер тома задан, иначе шагами по
+// PREALLOCATE_BYTES; лишнее за концом архива отрезается в finish(). При SYNC_BATCH потоки записи
+// сразу запускают сброс записанного и ждут сброса предыдущего куска — грязных страниц на поток
+// остаётся не больше пары кусков, и fsync в конце почти ничего не ждёт.
+class ArchiveOutput {
+public:
+    static constexpr size_t CHUNK_BYTES = 4 << 20;
+    static constexpr size_t WRITER_QUEUE_BYTES = 64 << 20;
+    static constexpr uint64_t PREALLOCATE_BYTES = 64 << 20;
+
+    ArchiveOutput(const std::string& path, uint64_t volume_size, const std::vector<std::string>& volume_dirs,
+                  SyncPolicy sync)
+        : path_(path), volume_size_(volume_size), sync_(sync) {
+        if (volume_size_ > 0 && !volume_dirs.empty()) {
+            dirs_ = volume_dirs;
+            for (const auto& dir : dirs_) fs::create_directories(dir);
+        } else {
+            fs::path parent = fs::path(path).parent_path();
+            dirs_.push_back(parent.string());
+        }
+        for (size_t i = 0; i < dirs_.size(); ++i) {
+            writers_.emplace_back(new Writer());
+            writers_.back()->write_behind = sync == SYNC_BATCH;
+            writers_.back()->thread = std::thread([this, i] { writerLoop(*writers_[i]); });
+        }
+    }
+
+    ~ArchiveOutput() {
+        stopWriters();
+        for (int fd : fds_) {
+            if (fd >= 0) close(fd);
+        }
+        if (!finished_ && !keep_partial_) {
+            for (size_t volume = 0; volume < fds_.size(); ++volume) unlink(temporaryFile(volume).c_str());
+        }
+    }
+
+    // Недописанные тома остаются на диске и после ошибки: на них ссылается контрольная точка.
+    void keepPartial() { keep_partial_ = true; }
+
+    uint64_t position() const { return position_; }
+
+    void write(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (size > 0) {
+            uint64_t volume_left = volume_size_ ? volume_size_ - position_ % volume_size_ : UINT64_MAX;
+            size_t n = std::min<uint64_t>({size, volume_left, CHUNK_BYTES - chunk_.size()});
+            if (chunk_.empty()) chunk_offset_ = position_;
+            chunk_.insert(chunk_.end(), p, p + n);
+            p += n;
+            size -= n;
+            position_ += n;
+            if (chunk_.size() == CHUNK_BYTES || (volume_size_ && position_ % volume_size_ == 0)) flushChunk();
+        }
+    }
+
+    // Перезаписывает уже записанные байты (счётчик файлов, размеры кусков); применяется в finish().
+    void patch(uint64_t offset, const void* data, size_t size) {
+        patches_.emplace_back(offset, std::vector<uint8_t>(static_cast<const uint8_t*>(data),
+                                                            static_cast<const uint8_t*>(data) + size));
+    }
+
+    // Продолжение прерванной упаковки: первые position байт уже записаны во временные тома, хвост
+    // за ними (недописанный при сбое) отрезается, тома дальше него удаляются.
+    void resume(uint64_t position) {
+        keep_partial_ = true;
+        size_t last = volume_size_ ? position / volume_size_ : 0;
+        for (size_t volume = 0; volume <= last; ++volume) {
+            std::string file = temporaryFile(volume);
+            int fd = open(file.c_str(), O_WRONLY | O_CLOEXEC | (volume == last ? O_CREAT : 0), 0644);
+            if (fd < 0) throw std::runtime_error("Failed to open " + file);
+            fds_.push_back(fd);
+            allocated_.push_back(volume_size_);
+        }
+        allocated_[last] = volume_size_ ? position % volume_size_ : position;
+        if (ftruncate(fds_[last], allocated_[last]) != 0) {
+            throw std::runtime_error("Failed to truncate " + temporaryFile(last));
+        }
+        if (volume_size_) {
+            for (size_t volume = last + 1; unlink(temporaryFile(volume).c_str()) == 0; ++volume) {}
+        }
+        position_ = position;
+        synced_volumes_ = fds_.size();
+    }
+
+    // Делает всё записанное долговечным: дожидается фоновой записи, применяет заплатки, сбрасывает
+    // тома на диск (а при появлении новых томов — и каталоги с ними).
+    void sync() {
+        flushChunk();
+        for (auto& writer : writers_) {
+            std::unique_lock<std::mutex> lock(writer->mutex);
+            writer->changed.wait(lock, [&] { return writer->queued_bytes == 0 || !writer->error.empty(); });
+            if (!writer->error.empty()) throw std::runtime_error(writer->error);
+        }
+        applyPatches();
+        for (int fd : fds_) {
+            if (fdatasync(fd) != 0) throw std::runtime_error("Failed to sync archive");
+        }
+        if (synced_volumes_ < fds_.size()) {
+            for (const auto& dir : dirs_) syncDirectory(dir);
+            synced_volumes_ = fds_.size();
+        }
+    }
+
+    void finish() {
+        flushChunk();
+        stopWriters();
+        for (const auto& writer : writers_) {
+            if (!writer->error.empty()) throw std::runtime_error(writer->error);
+        }
+        applyPatches();
+        for (size_t volume = 0; volume < fds_.size(); ++volume) {
+            uint64_t size = volumeSize(volume);
+            if (allocated_[volume] > size && ftruncate(fds_[volume], size) != 0) {
+                throw std::runtime_error("Failed to truncate " + temporaryFile(volume));
+            }
+        }
+        if (sync_ != SYNC_NONE) {
+            for (int fd : fds_) {
+                if (fdatasync(fd) != 0) throw std::runtime_error("Failed to sync archive");
+            }
+        }
+        for (int& fd : fds_) {
+            if (close(fd) != 0) throw std::runtime_error("Failed to write archive");
+            fd = -1;
+        }
+        for (size_t volume = 0; volume < fds_.size(); ++volume) {
+            if (std::rename(temporaryFile(volume).c_str(), volumeFile(volume).c_str()) != 0) {
+                throw std::runtime_error("Failed to replace " + volumeFile(volume));
+            }
+        }
+        finished_ = true;
+        // Лишние тома прежнего архива с тем же именем приняли бы за продолжение нового.
+        if (volume_size_) {
+            for (size_t volume = fds_.size(); unlink(volumeFile(volume).c_str()) == 0; ++volume) {}
+        }
+        if (sync_ != SYNC_NONE) {
+            for (const auto& dir : dirs_) syncDirectory(dir);
+        }
+    }
+
+    std::string volumeFile(size_t volume) const {
+        if (volume_size_ == 0) return path_;
+        return volumePath(path_, dirs_[volume % dirs_.size()], static_cast<uint32_t>(volume + 1));
+    }
+
+    // Где том лежит, пока архив не дописан.
+    std::string temporaryFile(size_t volume) const { return volumeFile(volume) + ".tmp"; }
+
+private:
+    // Сколько байт архива приходится на том.
+    uint64_t volumeSize(size_t volume) const {
+        if (volume_size_ == 0) return position_;
+        return std::min<uint64_t>(volume_size_, position_ - volume * volume_size_);
+    }
+
+    void preallocate(size_t volume, uint64_t end) {
+        if (!preallocate_ || allocated_[volume] >= end) return;
+        uint64_t target = volume_size_ ? volume_size_ : end + PREALLOCATE_BYTES;
+        if (fallocate(fds_[volume], 0, allocated_[volume], target - allocated_[volume]) == 0) {
+            allocated_[volume] = target;
+        } else {
+            preallocate_ = false;  // ФС не умеет, файл растёт записью
+        }
+    }
+
+    void applyPatches() {
+        for (const auto& patch : patches_) {
+            // Заплатка может пересекать границу томов.
+            uint64_t position = patch.first;
+            for (size_t done = 0, n; done < patch.second.size(); done += n, position += n) {
+                size_t volume = volume_size_ ? position / volume_size_ : 0;
+                uint64_t offset = volume_size_ ? position % volume_size_ : position;
+                n = volume_size_ ? std::min<uint64_t>(patch.second.size() - done, volume_size_ - offset)
+                                 : patch.second.size() - done;
+                if (pwrite(fds_[volume], patch.second.data() + done, n, offset) != static_cast<ssize_t>(n)) {
+                    throw std::runtime_error("Failed to write archive");
+                }
+            }
+        }
+        patches_.clear();
+    }
+
+    struct Chunk {
+        int fd;
+        uint64_t offset;
+        std::vector<uint8_t> data;
+    };
+
+    struct Writer {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<Chunk> queue;
+        size_t queued_bytes = 0;
+        bool stop = false;
+        std::string error;
+        bool write_behind = false;
+    };
+
+    void flushChunk() {
+        if (chunk_.empty()) return;
+        size_t volume = volume_size_ ? chunk_offset_ / volume_size_ : 0;
+        while (fds_.size() <= volume) {
+            std::string file = temporaryFile(fds_.size());
+            int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) throw std::runtime_error("Failed to create output file " + file);
+            fds_.push_back(fd);
+            allocated_.push_back(0);
+        }
+        uint64_t offset = volume_size_ ? chunk_offset_ % volume_size_ : chunk_offset_;
+        preallocate(volume, offset + chunk_.size());
+
+        Writer& writer = *writers_[volume % writers_.size()];
+        std::unique_lock<std::mutex> lock(writer.mutex);
+        writer.changed.wait(lock, [&] { return writer.queued_bytes < WRITER_QUEUE_BYTES || !writer.error.empty(); });
+        if (!writer.error.empty()) throw std::runtime_error(writer.error);
+        writer.queued_bytes += chunk_.size();
+        writer.queue.push_back({fds_[volume], offset, std::move(chunk_)});
+        writer.changed.notify_all();
+        chunk_ = std::vector<uint8_t>();
+        chunk_.reserve(CHUNK_BYTES);
+    }
+
+    static void writerLoop(Writer& writer) {
+        std::unique_lock<std::mutex> lock(writer.mutex);
+        int previous_fd = -1;
+        uint64_t previous_offset = 0, previous_size = 0;
+        for (;;) {
+            writer.changed.wait(lock, [&] { return writer.stop || !writer.queue.empty(); });
+            if (writer.queue.empty()) return;
+
+            Chunk chunk = std::move(writer.queue.front());
+            writer.queue.pop_front();
+            lock.unlock();
+            size_t done = 0;
+            while (done < chunk.data.size()) {
+                ssize_t n = pwrite(chunk.fd, chunk.data.data() + done, chunk.data.size() - done, chunk.offset + done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                done += n;
+                io_throttle.account(n);
+            }
+            if (writer.write_behind && done == chunk.data.size()) {
+                sync_file_range(chunk.fd, chunk.offset, done, SYNC_FILE_RANGE_WRITE);
+                if (previous_fd >= 0) {
+                    sync_file_range(previous_fd, previous_offset, previous_size,
+                                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                }
+                previous_fd = chunk.fd;
+                previous_offset = chunk.offset;
+                previous_size = done;
+            }
+            lock.lock();
+            if (done < chunk.data.size() && writer.error.empty()) {
+                writer.error = std::string("Failed to write archive: ") + std::strerror(errno);
+            }
+            writer.queued_bytes -= chunk.data.size();
+            writer.changed.notify_all();
+        }
+    }
+
+    void stopWriters() {
+        for (auto& writer : writers_) {
+            {
+                std::lock_guard<std::mutex> lock(writer->mutex);
+                writer->stop = true;
+            }
+            writer->changed.notify_all();
+            if (writer->thread.joinable()) writer->thread.join();
+        }
+    }
+
+    std::string path_;
+    uint64_t volume_size_;
+    std::vector<std::string> dirs_;
+    std::vector<std::unique_ptr<Writer>> writers_;
+    SyncPolicy sync_;
+    std::vector<int> fds_;
+    std::vector<uint64_t> allocated_;  // до куда выделено место в томе
+    bool preallocate_ = true;
+    bool finished_ = false;
+    bool keep_partial_ = false;
+    std::vector<uint8_t> chunk_;
+    uint64_t chunk_offset_ = 0;
+    uint64_t position_ = 0;
+    size_t synced_volumes_ = 0;
+    std::vector<std::pair<uint64_t, std::vector<uint8_t>>> patches_;
+};
+
+// Контрольная точка упаковки "<архив>.ckpt": два слота CheckpointHeader, которые перезаписываются
+// по очереди (действует целый слот с большим sequence — порванная запись слота не теряет предыдущую
+// точку), за ними CheckpointEntry завершённых записей подряд (этих полей в заголовках записей
+// архива нет). Всё остальное восстанавливается из уже записанной части архива.
+constexpr uint32_t CHECKPOINT_MAGIC = 0x50434B4D;  // "MKCP"
+
+struct CheckpointHeader {
+    uint32_t magic;
+    uint16_t version;  // MAKAKA_VERSION упаковщика
+    uint16_t reserved;
+    uint64_t sequence;
+    uint64_t fingerprint;     // входы и параметры упаковки
+    uint64_t durable_offset;  // столько байт архива сброшено на диск
+    uint64_t next_input;      // первый вход (индекс в files), записанный не целиком
+    uint64_t partial_offset;  // заголовок недописанной записи с кусками (входа next_input)
+    uint64_t partial_crc;     // CRC64 её записанных кусков
+    uint32_t file_count;      // записей, записанных целиком
+    uint32_t partial_chunks;  // записанных кусков недописанной записи; 0 — её нет
+    uint64_t checksum;        // contentHash полей выше
+};
+struct CheckpointEntry {
+    uint64_t content_hash;
+    int64_t mtime_ns;
+};
+
+static_assert(sizeof(CheckpointHeader) == 72, "CheckpointHeader layout");
+static_assert(sizeof(CheckpointEntry) == 16, "CheckpointEntry layout");
+
+uint64_t checkpointChecksum(const CheckpointHeader& header) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&header);
+    return contentHash(std::vector<uint8_t>(bytes, bytes + offsetof(CheckpointHeader, checksum)));
+}
+
+// Отпечаток аргументов, от которых зависит содержимое архива: продолжать можно только с теми же.
+uint64_t packFingerprint(const std::vector<std::string>& files, const PackSettings& settings) {
+    std::string key;
+    appendPod(key, MAKAKA_VERSION);
+    appendPod(key, static_cast<uint32_t>(settings.compression));
+    appendPod(key, static_cast<int32_t>(settings.level));
+    appendPod(key, static_cast<uint32_t>(settings.filter_mode));
+    appendPod(key, settings.filter.type);
+    appendPod(key, settings.filter.param);
+    appendPod(key, settings.chunk_size);
+    appendPod(key, settings.volume_size);
+    for (const auto& dir : settings.volume_dirs) key.append(dir).push_back('\0');
+    appendPod(key, static_cast<uint64_t>(files.size()));
+    for (const auto& file : files) key.append(file).push_back('\0');
+    return contentHash(std::vector<uint8_t>(key.begin(), key.end()));
+}
+
+class PackCheckpoint {
+public:
+    static std::string pathFor(const std::string& output_path) { return output_path + ".ckpt"; }
+
+    // Загружает последнюю целую точку и данные её записей.
+    static CheckpointHeader load(const std::string& path, uint64_t fingerprint, std::vector<CheckpointEntry>& entries) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error("No checkpoint to resume from: " + path);
+
+        CheckpointHeader slots[2] = {};
+        CheckpointHeader best = {};
+        ssize_t n = pread(fd, slots, sizeof(slots), 0);
+        for (size_t i = 0; n == static_cast<ssize_t>(sizeof(slots)) && i < 2; ++i) {
+            if (slots[i].magic == CHECKPOINT_MAGIC && slots[i].checksum == checkpointChecksum(slots[i])
+                && slots[i].sequence > best.sequence) {
+                best = slots[i];
+            }
+        }
+        if (best.sequence == 0 || best.version != MAKAKA_VERSION) {
+            close(fd);
+            throw std::runtime_error("Corrupted checkpoint: " + path);
+        }
+        if (best.fingerprint != fingerprint) {
+            close(fd);
+            throw std::runtime_error("Checkpoint " + path + " was made with different inputs or options");
+        }
+
+        entries.resize(best.file_count);
+        size_t size = entries.size() * sizeof(CheckpointEntry);
+        n = size ? pread(fd, entries.data(), size, sizeof(slots)) : 0;
+        close(fd);
+        if (n != static_cast<ssize_t>(size)) throw std::runtime_error("Corrupted checkpoint: " + path);
+        return best;
+    }
+
+    // resumed — продолжение после load: файл не обнуляется, saved уже в нём записанных хешей.
+    PackCheckpoint(const std::string& path, uint64_t fingerprint, const CheckpointHeader* resumed = nullptr)
+        : path_(path), fingerprint_(fingerprint) {
+        if (resumed) {
+            sequence_ = resumed->sequence;
+            saved_ = resumed->file_count;
+        }
+    }
+
+    ~PackCheckpoint() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    // Вызывается, когда архив до header.durable_offset уже на диске.
+    void save(CheckpointHeader header, const std::vector<IndexEntry>& entries) {
+        if (fd_ < 0) {
+            fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd_ < 0) throw std::runtime_error("Failed to create checkpoint " + path_);
+            syncDirectory(fs::path(path_).parent_path().string());
+        }
+
+        std::vector<CheckpointEntry> added;
+        for (size_t i = saved_; i < header.file_count; ++i) added.push_back({entries[i].content_hash, entries[i].record.mtime_ns});
+        size_t size = added.size() * sizeof(CheckpointEntry);
+        if ((size && pwrite(fd_, added.data(), size, 2 * sizeof(header) + saved_ * sizeof(CheckpointEntry)) != static_cast<ssize_t>(size))
+            || fdatasync(fd_) != 0) {
+            throw std::runtime_error("Failed to write checkpoint " + path_);
+        }
+
+        header.magic = CHECKPOINT_MAGIC;
+        header.version = MAKAKA_VERSION;
+        header.sequence = ++sequence_;
+        header.fingerprint = fingerprint_;
+        header.checksum = checkpointChecksum(header);
+        if (pwrite(fd_, &header, sizeof(header), (sequence_ % 2) * sizeof(header)) != static_cast<ssize_t>(sizeof(header))
+            || fdatasync(fd_) != 0) {
+            throw std::runtime_error("Failed to write checkpoint " + path_);
+        }
+        saved_ = header.file_count;
+    }
+
+    void remove() {
+        if (fd_ >= 0) close(fd_);
+        fd_ = -1;
+        unlink(path_.c_str());
+    }
+
+private:
+    std::string path_;
+    uint64_t fingerprint_;
+    int fd_ = -1;
+    uint64_t sequence_ = 0;
+    size_t saved_ = 0;
+};
+
+// Состояние упаковщика, восстановленное по контрольной точке.
+struct ResumedPack {
+    uint32_t file_count = 0;
+    uint64_t offset = 12;  // конец последней целой записи
+    std::string previous_name;
+    std::vector<IndexEntry> entries;
+    // Недописанная запись с кусками: её заголовок, таблица и первые partial_chunks кусков записаны.
+    size_t partial_chunks = 0;
+    uint64_t partial_crc = 0;
+    EntryHeader partial_header;
+    std::vector<uint32_t> chunk_sizes;
+};
+
+// Проверяет записанную часть архива по контрольной точке: записи пересканируются (их имена должны
+// идти в порядке files до next_input), недописанная запись сверяется с таблицей кусков, и вся
+// проверенная часть должна заканчиваться ровно на durable_offset.
+ResumedPack resumePack(const std::vector<std::string>& volumes, const std::vector<std::string>& files,
+                       const PackSettings& settings, const CheckpointHeader& checkpoint,
+                       const std::vector<CheckpointEntry>& saved) {
+    ResumedPack state;
+    ArchiveInput in(volumes);
+    ArchiveHeader archive = readArchiveHeader(in);
+    if (archive.version != MAKAKA_VERSION || archive.compression != settings.compression) {
+        throw std::runtime_error("archive header does not match");
+    }
+
+    EntryHeader entry;
+    size_t input = 0;
+    for (uint32_t i = 0; i < checkpoint.file_count; ++i) {
+        readEntryHeader(in, archive.version, entry);
+        while (input < checkpoint.next_input && files[input] != entry.name) ++input;
+        if (input == checkpoint.next_input) throw std::runtime_error("unexpected entry " + entry.name);
+        ++input;
+
+        IndexEntry index_entry;
+        index_entry.name = entry.name;
+        index_entry.record = {};
+        index_entry.record.data_offset = in.position();
+        index_entry.record.original_size = entry.original_size;
+        index_entry.record.compressed_size = entry.compressed_size;
+        index_entry.record.archive_position = i;
+        index_entry.record.filter_type = entry.filter.type;
+        index_entry.record.filter_param = entry.filter.param;
+        index_entry.record.flags = recordFlags(entry);
+        index_entry.record.mtime_ns = saved[i].mtime_ns;
+        index_entry.content_hash = saved[i].content_hash;
+        index_entry.has_content_hash = true;
+        state.entries.push_back(std::move(index_entry));
+        in.skip(entry.compressed_size);
+    }
+    state.file_count = checkpoint.file_count;
+    state.offset = in.position();
+    state.previous_name = entry.name;
+
+    if (checkpoint.partial_chunks == 0) {
+        if (state.offset != checkpoint.durable_offset) throw std::runtime_error("entries end before the checkpoint");
+        return state;
+    }
+
+    if (state.offset != checkpoint.partial_offset || checkpoint.next_input >= files.size()) {
+        throw std::runtime_error("bad partial entry");
+    }
+    readEntryHeader(in, archive.version, entry);
+    if (entry.name != files[checkpoint.next_input] || !(entry.flags & ENTRY_CHUNKED)) {
+        throw std::runtime_error("bad partial entry");
+    }
+    ChunkTableHeader table;
+    in.read(&table, sizeof(table));
+    if (table.chunk_size != settings.chunk_size || table.chunk_count < checkpoint.partial_chunks) {
+        throw std::runtime_error("bad partial entry");
+    }
+    state.chunk_sizes.resize(table.chunk_count);
+    in.read(state.chunk_sizes.data(), state.chunk_sizes.size() * sizeof(uint32_t));
+    uint64_t end = in.position();
+    for (size_t k = 0; k < state.chunk_sizes.size(); ++k) {
+        if (k >= checkpoint.partial_chunks) state.chunk_sizes[k] = 0;
+        end += state.chunk_sizes[k];
+    }
+    if (end != checkpoint.durable_offset) throw std::runtime_error("chunks end before the checkpoint");
+
+    state.partial_chunks = checkpoint.partial_chunks;
+    state.partial_crc = checkpoint.partial_crc;
+    state.partial_header = entry;
+    return state;
+}
+
+void createArchive(const std::vector<std::string>& files, const std::string& output_path, const PackSettings& settings) {
+    ArchiveOutput out(output_path, settings.volume_size, settings.volume_dirs, settings.sync);
+    std::string checkpoint_path = PackCheckpoint::pathFor(output_path);
+    uint64_t fingerprint = packFingerprint(files, settings);
+
+    uint16_t compression = settings.compression;
+    uint32_t file_count = 0;
+    uint64_t count_position = 8;
+    std::string previous_name;
+    uint64_t offset = 12;
+    std::vector<IndexEntry> index_entries;
+    size_t first_input = 0;
+    ResumedPack resumed;
+    std::unique_ptr<PackCheckpoint> checkpoint;
+
+    if (settings.resume) {
+        std::vector<CheckpointEntry> entries;
+        CheckpointHeader saved = PackCheckpoint::load(checkpoint_path, fingerprint, entries);
+        std::vector<std::string> volumes;
+        uint64_t volume_count = settings.volume_size ? (saved.durable_offset + settings.volume_size - 1) / settings.volume_size : 1;
+        for (size_t v = 0; v < volume_count; ++v) volumes.push_back(out.temporaryFile(v));
+        try {
+            resumed = resumePack(volumes, files, settings, saved, entries);
+        } catch (const std::exception& e) {
+            throw std::runtime_error("Cannot resume " + output_path + ": " + e.what());
+        }
+        out.resume(saved.durable_offset);
+        file_count = resumed.file_count;
+        offset = resumed.offset;
+        previous_name = resumed.previous_name;
+        index_entries = std::move(resumed.entries);
+        first_input = saved.next_input;
+        checkpoint.reset(new PackCheckpoint(checkpoint_path, fingerprint, &saved));
+        std::cout << "Resuming at input " << first_input << " of " << files.size() << " ("
+                  << saved.durable_offset << " bytes kept)" << std::endl;
+    } else {
+        out.write(&MAKAKA_SIGNATURE, 4);
+        out.write(&MAKAKA_VERSION, 2);
+        out.write(&compression, 2);
+        out.write(&file_count, 4);
+        unlink(checkpoint_path.c_str());  // от прошлой прерванной упаковки
+        if (settings.checkpoint_seconds > 0) checkpoint.reset(new PackCheckpoint(checkpoint_path, fingerprint));
+    }
+
+    // Точка ставится не чаще раза в checkpoint_seconds, между записями или между кусками большой
+    // записи: при сбое теряется не больше интервала работы. Перед точкой архив сбрасывается на диск
+    // при любом --sync, поэтому точки включаются только явно.
+    unsigned checkpoint_seconds = settings.checkpoint_seconds ? settings.checkpoint_seconds : settings.resume ? 60 : 0;
+    auto interval = std::chrono::seconds(checkpoint_seconds);
+    auto next_checkpoint = std::chrono::steady_clock::now() + interval;
+    auto checkpointDue = [&] {
+        return checkpoint && checkpoint_seconds > 0 && std::chrono::steady_clock::now() >= next_checkpoint;
+    };
+    auto saveCheckpoint = [&](size_t next_input, size_t partial_chunks, uint64_t partial_crc) {
+        out.sync();
+        CheckpointHeader header = {};
+        header.durable_offset = out.position();
+        header.next_input = next_input;
+        header.partial_offset = offset;
+        header.partial_crc = partial_crc;
+        header.file_count = file_count;
+        header.partial_chunks = static_cast<uint32_t>(partial_chunks);
+        checkpoint->save(header, index_entries);
+        out.keepPartial();
+        next_checkpoint = std::chrono::steady_clock::now() + interval;
+    };
+
+    std::vector<size_t> read_order;
+    if (settings.read_order == READ_ORDER_PHYSICAL) {
+        for (size_t index : physicalReadOrder(files)) {
+            if (index >= first_input) read_order.push_back(index);
+        }
+    } else {
+        for (size_t i = first_input; i < files.size(); ++i) read_order.push_back(i);
+    }
+
+    PackPipeline pipeline(files, read_order, settings, first_input, resumed.partial_chunks);
+    for (size_t i = first_input; i < files.size(); ++i) {
+        if (checkpointDue()) saveCheckpoint(i, 0, 0);
+        const std::string& file_path = files[i];
+        PackPipeline::Plan plan = pipeline.plan(i);
+        bool partial = i == first_input && resumed.partial_chunks > 0;
+        if (partial && !plan.chunked) throw std::runtime_error("Cannot resume: " + file_path + " has changed");
+
+        EntryHeader header;
+        header.name = file_path;
+        header.original_size = plan.size;
+        header.filter = plan.filter;
+        IndexEntry index_entry;
+        index_entry.name = file_path;
+        index_entry.record = {};
+        index_entry.has_content_hash = true;
+
+        if (!plan.chunked) {
+            PackedEntry entry = pipeline.takeEntry(i);
+            if (!entry.present) {
+                std::cerr << "Warning: Skipping missing file " << file_path << std::endl;
+                continue;
+            }
+            header.original_size = entry.original_size;
+            header.compressed_size = entry.data.size();
+            header.filter = entry.filter;
+
+            std::string encoded = encodeEntryHeader(previous_name, header);
+            out.write(encoded.data(), encoded.size());
+            out.write(entry.data.data(), entry.data.size());
+            index_entry.record.data_offset = offset + encoded.size();
+            index_entry.record.mtime_ns = entry.mtime_ns;
+            index_entry.content_hash = entry.content_hash;
+        } else {
+            // Размер записи и таблица кусков известны только в конце: пишутся заглушки, куски
+            // идут в вывод по мере готовности, заглушки заменяются через patch().
+            header.flags = ENTRY_CHUNKED;
+            size_t size_field = 0;
+            std::string encoded = encodeEntryHeader(previous_name, header, &size_field);
+            std::vector<uint32_t> chunk_sizes(plan.chunk_count);
+            size_t first_chunk = 0;
+            if (partial) {
+                // Заголовок, таблица и часть кусков уже в архиве; вход должен остаться прежним.
+                const EntryHeader& written = resumed.partial_header;
+                if (written.original_size != plan.size || written.filter.type != plan.filter.type
+                    || written.filter.param != plan.filter.param || resumed.chunk_sizes.size() != plan.chunk_count) {
+                    throw std::runtime_error("Cannot resume: " + file_path + " has changed");
+                }
+                chunk_sizes = resumed.chunk_sizes;
+                first_chunk = resumed.partial_chunks;
+                index_entry.content_hash = resumed.partial_crc;
+            } else {
+                std::string table = encodeChunkTable(settings.chunk_size, chunk_sizes);
+                out.write(encoded.data(), encoded.size());
+                out.write(table.data(), table.size());
+            }
+            uint64_t table_offset = offset + encoded.size();
+            uint64_t table_size = sizeof(ChunkTableHeader) + chunk_sizes.size() * sizeof(uint32_t);
+
+            header.compressed_size = table_size;
+            for (size_t k = 0; k < first_chunk; ++k) header.compressed_size += chunk_sizes[k];
+            for (size_t k = first_chunk; k < plan.chunk_count; ++k) {
+                PackPipeline::Chunk chunk = pipeline.takeChunk(i, k);
+                if (chunk.data.size() > UINT32_MAX) throw std::runtime_error("Chunk too large: " + file_path);
+                chunk_sizes[k] = static_cast<uint32_t>(chunk.data.size());
+                out.write(chunk.data.data(), chunk.data.size());
+                header.compressed_size += chunk.data.size();
+                uint64_t chunk_size = std::min<uint64_t>(settings.chunk_size, plan.size - k * settings.chunk_size);
+                index_entry.content_hash = k ? crc64Combine(index_entry.content_hash, chunk.crc, chunk_size) : chunk.crc;
+
+                if (k + 1 < plan.chunk_count && checkpointDue()) {
+                    // Таблица в архиве дополняется до записанных кусков: по ней продолжение найдёт их границы.
+                    std::string table = encodeChunkTable(settings.chunk_size, chunk_sizes);
+                    out.patch(table_offset, table.data(), table.size());
+                    saveCheckpoint(i, k + 1, index_entry.content_hash);
+                }
+            }
+
+            std::string size = paddedVarint(header.compressed_size);
+            std::string table = encodeChunkTable(settings.chunk_size, chunk_sizes);
+            out.patch(offset + size_field, size.data(), size.size());
+            out.patch(table_offset, table.data(), table.size());
+            index_entry.record.data_offset = table_offset;
+            index_entry.record.flags = ENTRY_CHUNKED;
+            index_entry.record.mtime_ns = plan.mtime_ns;
+        }
+
+        index_entry.record.original_size = header.original_size;
+        index_entry.record.compressed_size = header.compressed_size;
+        index_entry.record.archive_position = file_count;
+        index_entry.record.filter_type = header.filter.type;
+        index_entry.record.filter_param = header.filter.param;
+        offset = index_entry.record.data_offset + header.compressed_size;
+        index_entries.push_back(std::move(index_entry));
+        previous_name = file_path;
+        ++file_count;
+        if (settings.sync == SYNC_EACH) out.sync();
+    }
+
+    std::string index = buildCentralIndex(index_entries, settings.hash_index);
+    ArchiveFooter footer = {offset, index.size(), FOOTER_MAGIC};
+    out.write(index.data(), index.size());
+    out.write(&footer, sizeof(footer));
+
+    out.patch(count_position, &file_count, 4);
+    out.finish();
+    if (checkpoint) checkpoint->remove();
+}
+
+// Упаковка в хранилище кусков (--repository): архив становится манифестом со списками ссылок на
+// куски, см. ChunkRepository. Файлы режутся FastCDC, куски хешируются и сжимаются на
+// WorkStealingPool, в паки попадают только куски, которых в хранилище ещё нет. Файл, у которого
+// размер и время изменения совпадают с записью последнего архива хранилища, не читается вовсе:
+// список ссылок берётся оттуда. Так время упаковки растёт с объёмом изменений, а не с объёмом данных.
+// Файлы до REPOSITORY_WINDOW_BYTES обрабатываются задачей целиком, большие — окнами, куски окна
+// параллельно.
+constexpr size_t REPOSITORY_WINDOW_BYTES = 64 << 20;
+
+struct RepositoryEntry {
+    bool present = false;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t content_hash = 0;
+    std::string references;  // encodeChunkReferences
+};
+
+struct RepositoryPacker {
+    ChunkRepository& repository;
+    const PackSettings& settings;
+    std::atomic<uint64_t> chunks{0};
+    std::atomic<uint64_t> new_chunks{0};
+
+    EntryFilter filterFor(const uint8_t* data, size_t size) const {
+        std::vector<uint8_t> sample(data, data + std::min<size_t>(size, PackPipeline::FILTER_SAMPLE_BYTES));
+        return chooseFilter(sample, settings);
+    }
+
+    void storeChunk(const uint8_t* data, size_t size, EntryFilter filter, ChunkReference& reference) {
+        reference.id = chunkId(data, size);
+        reference.size = static_cast<uint32_t>(size);
+        ++chunks;
+        if (repository.store(reference.id, data, size, settings.compression, settings.level, filter)) ++new_chunks;
+    }
+
+    // Куски [0, размер) буфера; если файл не кончился, хвост без найденной границы остаётся
+    // до следующего окна. Возвращает длину разрезанной части.
+    static size_t cut(const uint8_t* data, size_t size, bool at_end, std::vector<std::pair<size_t, size_t>>& cuts) {
+        size_t pos = 0;
+        while (pos < size) {
+            size_t length = cdcChunkLength(data + pos, size - pos);
+            if (!at_end && length == size - pos && length < CDC_MAX_CHUNK) break;
+            cuts.emplace_back(pos, length);
+            pos += length;
+        }
+        return pos;
+    }
 
-namespace fs = std::filesystem;
+    void packSmallFile(const std::string& path, RepositoryEntry& entry) {
+        std::vector<uint8_t> data;
+        if (!readWholeFile(path, data, &entry.mtime_ns)) return;
+        entry.size = data.size();
+        entry.content_hash = contentHash(data);
+        EntryFilter filter = filterFor(data.data(), data.size());
+        std::vector<std::pair<size_t, size_t>> cuts;
+        cut(data.data(), data.size(), true, cuts);
+        std::vector<ChunkReference> references(cuts.size());
+        for (size_t k = 0; k < cuts.size(); ++k) storeChunk(data.data() + cuts[k].first, cuts[k].second, filter, references[k]);
+        entry.references = encodeChunkReferences(references);
+        entry.present = true;
+    }
+
+    void packLargeFile(const std::string& path, RepositoryEntry& entry, WorkStealingPool& pool) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (inputVanished(errno)) return;
+            throw inputError("Failed to open", path);
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::vector<uint8_t> buffer(REPOSITORY_WINDOW_BYTES);
+        std::vector<ChunkReference> references;
+        EntryFilter filter;
+        uint64_t offset = 0;  // смещение buffer[0] в файле
+        size_t filled = 0;
+        try {
+            for (;;) {
+                size_t want = std::min<uint64_t>(buffer.size() - filled, entry.size - offset - filled);
+                if (!readFileRange(fd, buffer.data() + filled, want, offset + filled)) {
+                    throw std::runtime_error(path + " changed while packing");
+                }
+                entry.content_hash = contentHash(buffer.data() + filled, want, entry.content_hash);
+                if (offset + filled == 0) filter = filterFor(buffer.data(), want);
+                filled += want;
+                bool at_end = offset + filled == entry.size;
 
-constexpr uint32_t MAKAKA_SIGNATURE = 0x4D4B4B41;
-constexpr uint16_t MAKAKA_VERSION = 0x0100;
+                std::vector<std::pair<size_t, size_t>> cuts;
+                size_t done = cut(buffer.data(), filled, at_end, cuts);
+                size_t first = references.size();
+                references.resize(first + cuts.size());
+                for (size_t k = 0; k < cuts.size(); ++k) {
+                    pool.submit([this, &buffer, &references, &cuts, filter, first, k] {
+                        storeChunk(buffer.data() + cuts[k].first, cuts[k].second, filter, references[first + k]);
+                    });
+                }
+                pool.wait();
 
-enum CompressionType {
-    COMPRESS_NONE = 0,
-    COMPRESS_LZMA = 1,
-    COMPRESS_ZSTD = 2
+                std::memmove(buffer.data(), buffer.data() + done, filled - done);
+                offset += done;
+                filled -= done;
+                if (at_end) break;
+            }
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        entry.references = encodeChunkReferences(references);
+        entry.present = true;
+    }
 };
 
-std::vector<uint8_t> compressWithLZMA(const std::vector<uint8_t>& input) {
-    lzma_stream stream = LZMA_STREAM_INIT;
-    if (lzma_easy_encoder(&stream, 9 | LZMA_PRESET_EXTREME, LZMA_CHECK_CRC64) != LZMA_OK) {
-        throw std::runtime_error("LZMA compression initialization failed");
+void createRepositoryArchive(const std::vector<std::string>& files, const std::string& output_path,
+                             const PackSettings& settings, const std::string& repository_dir) {
+    if (settings.volume_size || settings.resume) throw std::runtime_error("--repository does not support volumes or --resume");
+    ChunkRepository repository(repository_dir, REPOSITORY_APPEND);
+    std::string archive_path = fs::absolute(output_path).lexically_normal().string();
+
+    // Последний из ещё существующих архивов хранилища (может быть и прежней версией output_path:
+    // новый архив заменит его только в конце).
+    std::unique_ptr<IndexedArchive> base;
+    std::vector<std::string> archives = repository.archives();
+    for (auto it = archives.rbegin(); it != archives.rend() && !base; ++it) {
+        try {
+            base.reset(new IndexedArchive(*it, INDEX_BUILD_NONE));
+        } catch (const std::exception&) {
+        }
     }
+    repository.addArchive(archive_path);
+
+    RepositoryPacker packer{repository, settings};
+    std::vector<RepositoryEntry> entries(files.size());
+    size_t unchanged = 0;
+    WorkStealingPool pool;
+    for (size_t i = 0; i < files.size(); ++i) {
+        RepositoryEntry& entry = entries[i];
+        struct stat st;
+        if (stat(files[i].c_str(), &st) != 0) {
+            if (inputVanished(errno)) continue;
+            throw inputError("Failed to stat", files[i]);
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+        entry.size = st.st_size;
+        entry.mtime_ns = mtimeNanoseconds(st);
 
-    stream.next_in = input.data();
-    stream.avail_in = input.size();
+        IndexRecord record;
+        if (base && base->index().lookup(files[i], record) && (record.flags & ENTRY_REFERENCES)
+            && (record.flags & RECORD_CONTENT_HASH) && record.original_size == entry.size
+            && record.mtime_ns != 0 && record.mtime_ns == entry.mtime_ns) {
+            std::vector<uint8_t> list = base->readCompressed(record);
+            std::vector<ChunkReference> references = parseChunkReferences(list.data(), list.size(), record.original_size);
+            if (std::all_of(references.begin(), references.end(),
+                            [&](const ChunkReference& reference) { return repository.contains(reference.id); })) {
+                entry.references.assign(list.begin(), list.end());
+                entry.content_hash = record.content_hash;
+                entry.present = true;
+                packer.chunks += references.size();
+                ++unchanged;
+                continue;
+            }
+        }
 
-    std::vector<uint8_t> output(input.size() * 1.5);
-    stream.next_out = output.data();
-    stream.avail_out = output.size();
+        if (entry.size <= REPOSITORY_WINDOW_BYTES) {
+            pool.submit([&packer, &files, &entry, i] { packer.packSmallFile(files[i], entry); });
+        } else {
+            packer.packLargeFile(files[i], entry, pool);
+        }
+    }
+    pool.wait();
+    // Куски на диске и в индексе хранилища раньше, чем появится ссылающийся на них архив.
+    repository.commit();
 
-    lzma_code(&stream, LZMA_FINISH);
-    output.resize(stream.total_out);
-    lzma_end(&stream);
+    ArchiveOutput out(output_path, 0, {}, settings.sync);
+    uint16_t compression = settings.compression;
+    uint32_t file_count = 0;
+    out.write(&MAKAKA_SIGNATURE, 4);
+    out.write(&MAKAKA_VERSION, 2);
+    out.write(&compression, 2);
+    out.write(&file_count, 4);
 
-    return output;
-}
+    std::string previous_name;
+    std::vector<IndexEntry> index_entries;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const RepositoryEntry& entry = entries[i];
+        if (!entry.present) {
+            std::cerr << "Warning: Skipping missing file " << files[i] << std::endl;
+            continue;
+        }
+        EntryHeader header;
+        header.name = files[i];
+        header.original_size = entry.size;
+        header.compressed_size = entry.references.size();
+        header.flags = ENTRY_REFERENCES;
+        std::string encoded = encodeEntryHeader(previous_name, header);
+        out.write(encoded.data(), encoded.size());
+
+        IndexEntry index_entry;
+        index_entry.name = files[i];
+        index_entry.record = {};
+        index_entry.record.data_offset = out.position();
+        index_entry.record.original_size = entry.size;
+        index_entry.record.compressed_size = header.compressed_size;
+        index_entry.record.archive_position = file_count;
+        index_entry.record.flags = ENTRY_REFERENCES;
+        index_entry.record.mtime_ns = entry.mtime_ns;
+        index_entry.content_hash = entry.content_hash;
+        index_entry.has_content_hash = true;
+        index_entries.push_back(std::move(index_entry));
+        out.write(entry.references.data(), entry.references.size());
+        previous_name = files[i];
+        ++file_count;
+    }
 
-std::vector<uint8_t> compressWithZSTD(const std::vector<uint8_t>& input) {
-    size_t max_size = ZSTD_compressBound(input.size());
-    std::vector<uint8_t> output(max_size);
+    uint64_t index_offset = out.position();
+    std::string index = buildCentralIndex(index_entries, settings.hash_index);
+    ArchiveFooter footer = {index_offset, index.size(), FOOTER_MAGIC};
+    out.write(index.data(), index.size());
+    out.write(&footer, sizeof(footer));
+    out.patch(8, &file_count, 4);
+    out.finish();
 
-    size_t compressed_size = ZSTD_compress(
-        output.data(), output.size(),
-        input.data(), input.size(),
-        ZSTD_maxCLevel()
-    );
+    std::cout << "Chunks: " << packer.chunks << " (" << packer.new_chunks << " new, " << repository.storedBytes()
+              << " bytes stored), unchanged files: " << unchanged << std::endl;
+}
 
-    if (ZSTD_isError(compressed_size)) {
-        throw std::runtime_error("ZSTD compression failed: " + std::string(ZSTD_getErrorName(compressed_size)));
+// Восстанавливает время изменения; 0 — неизвестно, остаётся текущее.
+void setModificationTime(int fd, const std::string& path, int64_t mtime_ns) {
+    if (mtime_ns == 0) return;
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = mtime_ns / 1000000000;
+    times[1].tv_nsec = mtime_ns % 1000000000;
+    if (times[1].tv_nsec < 0) {
+        times[1].tv_sec -= 1;
+        times[1].tv_nsec += 1000000000;
     }
+    int result = fd >= 0 ? futimens(fd, times) : utimensat(AT_FDCWD, path.c_str(), times, 0);
+    if (result != 0) throw std::runtime_error("Failed to set modification time of " + path);
+}
 
-    output.resize(compressed_size);
-    return output;
+// Время ставится только после успешной записи: по нему --update считает файл актуальным.
+void writeExtractedFile(const std::string& output_dir, const std::string& name, const std::vector<uint8_t>& file_data,
+                        int64_t mtime_ns = 0) {
+    std::string path = (fs::path(output_dir) / name).string();
+    fs::create_directories(fs::path(path).parent_path());
+
+    // Старый файл может быть жёсткой ссылкой (прошлая распаковка с --duplicates=hardlink): запись
+    // поверх него изменила бы и другие имена, поэтому он сначала удаляется.
+    if (unlink(path.c_str()) != 0 && errno != ENOENT) throw std::runtime_error("Failed to replace " + path);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw std::runtime_error("Failed to create " + path);
+    try {
+        preallocateFile(fd, file_data.size());
+        if (!writeFileRange(fd, file_data.data(), file_data.size(), 0)) throw std::runtime_error("Failed to write " + path);
+        setModificationTime(fd, path, mtime_ns);
+        output_sync.written(fd, path, file_data.size());
+    } catch (...) {
+        close(fd);
+        unlink(path.c_str());
+        throw;
+    }
+    if (close(fd) != 0) {
+        unlink(path.c_str());
+        throw std::runtime_error("Failed to write " + path);
+    }
 }
 
-std::vector<uint8_t> decompressZSTD(const std::vector<uint8_t>& input, size_t original_size) {
-    std::vector<uint8_t> output(original_size);
-    size_t result = ZSTD_decompress(
-        output.data(), output.size(),
-        input.data(), input.size()
-    );
+enum UpdateMode {
+    UPDATE_NONE,
+    UPDATE_MTIME,     // совпадают размер и время изменения
+    UPDATE_CHECKSUM   // совпадают размер и хеш содержимого
+};
 
-    if (ZSTD_isError(result)) {
-        throw std::runtime_error("ZSTD decompression failed: " + std::string(ZSTD_getErrorName(result)));
+// unpack --update: файл на месте уже совпадает с записью, распаковывать его не нужно. Если время
+// в индексе неизвестно (архив собран до его появления), сверяется хеш содержимого; совпавшему
+// по хешу файлу проставляется время из архива, чтобы в следующий раз хватило сверки времени.
+bool upToDate(const std::string& path, const EntryInfo& entry, UpdateMode mode) {
+    if (mode == UPDATE_NONE) return false;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_size) != entry.original_size) {
+        return false;
     }
+    if (mode == UPDATE_MTIME && entry.mtime_ns != 0) return mtimeNanoseconds(st) == entry.mtime_ns;
+    if (!entry.has_content_hash) return false;
 
-    return output;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    std::vector<uint8_t> buffer(1 << 20);
+    uint64_t hash = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer.data(), buffer.size())) > 0 || (n < 0 && errno == EINTR)) {
+        if (n <= 0) continue;
+        hash = contentHash(buffer.data(), n, hash);
+        io_throttle.account(n);
+    }
+    bool same = n == 0 && hash == entry.content_hash;
+    if (same && mtimeNanoseconds(st) != entry.mtime_ns) setModificationTime(fd, path, entry.mtime_ns);
+    close(fd);
+    return same;
 }
 
-void createArchive(const std::vector<std::string>& files, const std::string& output_path, CompressionType compression) {
-    std::ofstream out(output_path, std::ios::binary);
-    if (!out) throw std::runtime_error("Failed to create output file");
+enum DuplicateMode {
+    DUPLICATES_NONE,      // каждая копия распаковывается заново
+    DUPLICATES_REFLINK,   // FICLONE, где ФС не умеет — copy_file_range
+    DUPLICATES_HARDLINK
+};
+
+enum DuplicateCopy {
+    DUPLICATE_FAILED,
+    DUPLICATE_LINKED,
+    DUPLICATE_CLONED,
+    DUPLICATE_COPIED
+};
+
+// Повторная копия уже распакованного source: жёсткая ссылка (если попросили и получилось), иначе
+// reflink, иначе копия в ядре через copy_file_range. DUPLICATE_FAILED — не вышло ничего, запись
+// нужно распаковать как обычно.
+DuplicateCopy materializeDuplicate(const std::string& source, const std::string& path, uint64_t size, int64_t mtime_ns,
+                                   DuplicateMode mode) {
+    fs::create_directories(fs::path(path).parent_path());
+    // Как и в writeExtractedFile: старый path может быть жёсткой ссылкой, в том числе на source.
+    if (unlink(path.c_str()) != 0 && errno != ENOENT) return DUPLICATE_FAILED;
+    if (mode == DUPLICATES_HARDLINK) {
+        if (link(source.c_str(), path.c_str()) == 0) {
+            output_sync.linked(path);
+            return DUPLICATE_LINKED;
+        }
+    }
+
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return DUPLICATE_FAILED;
+    int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return DUPLICATE_FAILED;
+    }
+    DuplicateCopy result = DUPLICATE_CLONED;
+    bool done = ioctl(out, FICLONE, in) == 0;
+    if (!done) {
+        result = DUPLICATE_COPIED;
+        preallocateFile(out, size);
+        uint64_t copied = 0;
+        while (copied < size) {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, size - copied, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            copied += n;
+        }
+        io_throttle.account(copied);
+        done = copied == size;
+    }
+    try {
+        if (done) {
+            setModificationTime(out, path, mtime_ns);
+            output_sync.written(out, path, size);
+        }
+    } catch (...) {
+        close(out);
+        close(in);
+        throw;
+    }
+    close(out);
+    close(in);
+    return done ? result : DUPLICATE_FAILED;
+}
 
-    out.write(reinterpret_cast<const char*>(&MAKAKA_SIGNATURE), 4);
-    out.write(reinterpret_cast<const char*>(&MAKAKA_VERSION), 2);
-    out.write(reinterpret_cast<const char*>(&compression), 2);
+// Совпадают ли сохранённые данные двух записей байт в байт. Хеш из индекса — CRC64, по нему
+// копии только находятся; одинаковые сжатые данные при том же кодеке и фильтре дают одинаковое
+// содержимое, а сравнить их дешевле, чем распаковать.
+bool sameStoredData(const IndexedArchive& archive, const IndexRecord& a, const IndexRecord& b) {
+    constexpr uint64_t COMPARE_BYTES = 1 << 20;
+    uint16_t compression = archive.header().compression;
+    if (a.compressed_size != b.compressed_size || a.compression(compression) != b.compression(compression)
+        || (a.flags & (ENTRY_CHUNKED | ENTRY_REFERENCES)) != (b.flags & (ENTRY_CHUNKED | ENTRY_REFERENCES))) {
+        return false;
+    }
+    for (uint64_t done = 0; done < a.compressed_size; done += COMPARE_BYTES) {
+        uint64_t size = std::min(COMPARE_BYTES, a.compressed_size - done);
+        if (archive.readRaw(a.data_offset + done, size) != archive.readRaw(b.data_offset + done, size)) return false;
+    }
+    return true;
+}
 
-    uint32_t file_count = files.size();
-    out.write(reinterpret_cast<const char*>(&file_count), 4);
+void printCompression(uint16_t compression) {
+    const Codec* codec = findCodec(compression);
+    if (!codec) {
+        std::cout << "Unknown (" << compression << ")\n";
+        return;
+    }
+    for (const char* c = codec->name; *c; ++c) std::cout << static_cast<char>(std::toupper(static_cast<unsigned char>(*c)));
+    std::cout << "\n";
+}
 
-    for (const auto& file_path : files) {
-        std::ifstream in(file_path, std::ios::binary);
-        if (!in) {
-            std::cerr << "Warning: Skipping missing file " << file_path << std::endl;
+// Выборочная распаковка по именам через центральный индекс: без обхода цепочки записей.
+void extractIndexedEntries(const std::string& archive_path, const std::string& output_dir,
+                           const std::vector<std::string>& names, bool verbose,
+                           const std::vector<std::string>& volume_dirs, UpdateMode update,
+                           std::shared_ptr<const ChunkRepository> repository) {
+    ArchiveReader reader(archive_path, nullptr, volume_dirs, std::move(repository));
+    for (const auto& name : names) {
+        EntryInfo info;
+        if (!reader.stat(name, info)) {
+            std::cerr << "Warning: Entry not found " << name << std::endl;
             continue;
         }
+        if (upToDate((fs::path(output_dir) / name).string(), info, update)) continue;
 
-        std::vector<uint8_t> file_data(
-            (std::istreambuf_iterator<char>(in)),
-            std::istreambuf_iterator<char>()
-        );
-        in.close();
+        if (verbose) {
+            std::cout << "Extracting " << name << " (" 
+                      << info.original_size << " -> " << info.compressed_size << " bytes)\n";
+        }
+        io_throttle.account(info.compressed_size);
+        writeExtractedFile(output_dir, name, reader.read(name), info.mtime_ns);
+    }
+}
+
+// Выходной файл записи с ENTRY_CHUNKED: куски пишутся параллельно во временный файл рядом
+// (место под него выделено сразу), после последнего куска ставится время изменения и файл
+// переименовывается в path. Если какой-то кусок не удался, временный файл удаляется вместе
+// с последней задачей: на месте записи не остаётся файла нужного размера с нулями.
+struct ChunkedOutput {
+    std::string path;
+    std::string temp_path;
+    int fd = -1;
+    int64_t mtime_ns = 0;
+    uint64_t size = 0;
+    std::atomic<size_t> remaining{0};
+    bool complete = false;
+
+    // Вызывается задачей, записавшей последнюю часть.
+    void finish() {
+        setModificationTime(fd, temp_path, mtime_ns);
+        output_sync.written(fd, path, size);
+        if (std::rename(temp_path.c_str(), path.c_str()) != 0) throw std::runtime_error("Failed to create " + path);
+        complete = true;
+    }
+
+    ~ChunkedOutput() {
+        if (fd >= 0) close(fd);
+        if (!complete && !temp_path.empty()) unlink(temp_path.c_str());
+    }
+};
+
+// Полная распаковка через центральный индекс на WorkStealingPool. Мелкие записи распаковываются
+// пачками, запись с ENTRY_CHUNKED — задачей, которая ставит по задаче на кусок (их разбирают
+// простаивающие потоки). Задачи чередуются по томам, чтобы одновременные чтения приходились
+// на разные тома (и устройства).
+//
+// Записи с одинаковым содержимым (совпадают хеш из индекса, оба размера и фильтр) распаковываются
+// один раз, остальные копии после этого делаются из готового файла (materializeDuplicate).
+// Запись с ENTRY_REFERENCES собирается из кусков repository группами по REFERENCE_GROUP_BYTES,
+// группы пишутся параллельно, как куски записи с ENTRY_CHUNKED.
+void extractParallel(const IndexedArchive& archive, const std::string& output_dir, bool verbose, UpdateMode update,
+                     DuplicateMode duplicates, const ChunkRepository* repository) {
+    constexpr uint64_t SMALL_ENTRY_BYTES = 1 << 20;
+    constexpr uint64_t BATCH_BYTES = 4 << 20;
+    constexpr size_t BATCH_ENTRIES = 1024;
+    constexpr uint64_t REFERENCE_GROUP_BYTES = 16 << 20;
+
+    // При повторяющихся именах, как и при последовательной распаковке, остаётся последняя запись.
+    std::vector<std::pair<std::string, IndexRecord>> entries;
+    archive.index().forEach([&](const std::string& name, const IndexRecord& record) {
+        if (!entries.empty() && entries.back().first == name) entries.back().second = record;
+        else entries.emplace_back(name, record);
+    });
+
+    // copies — пары (копия, первая запись с тем же содержимым).
+    std::vector<std::pair<size_t, size_t>> copies;
+    std::map<std::tuple<uint64_t, uint64_t, uint64_t, uint8_t>, size_t> first_copy;
+    // Внутри тома записи идут в порядке расположения: чтение остаётся последовательным.
+    std::vector<std::vector<size_t>> by_volume(archive.volumeCount());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const IndexRecord& record = entries[i].second;
+        if (duplicates != DUPLICATES_NONE && (record.flags & RECORD_CONTENT_HASH) && record.original_size > 0) {
+            auto key = std::make_tuple(record.content_hash, record.original_size, record.compressed_size, record.filter_type);
+            auto [it, inserted] = first_copy.emplace(key, i);
+            if (!inserted) {
+                copies.emplace_back(i, it->second);
+                continue;
+            }
+        }
+        by_volume[archive.volumeAt(record.data_offset)].push_back(i);
+    }
+    std::vector<std::vector<std::vector<size_t>>> tasks(by_volume.size());
+    for (size_t v = 0; v < by_volume.size(); ++v) {
+        std::sort(by_volume[v].begin(), by_volume[v].end(), [&](size_t a, size_t b) {
+            return entries[a].second.data_offset < entries[b].second.data_offset;
+        });
+        uint64_t batch_bytes = 0;
+        bool batch_open = false;
+        for (size_t i : by_volume[v]) {
+            const IndexRecord& record = entries[i].second;
+            bool small = !(record.flags & ENTRY_CHUNKED) && record.original_size < SMALL_ENTRY_BYTES;
+            if (!small || !batch_open || batch_bytes >= BATCH_BYTES || tasks[v].back().size() >= BATCH_ENTRIES) {
+                tasks[v].emplace_back();
+                batch_bytes = 0;
+            }
+            tasks[v].back().push_back(i);
+            batch_bytes += record.original_size;
+            batch_open = small;
+        }
+    }
+
+    std::atomic<bool> failed{false};
+    std::atomic<size_t> unchanged{0};
+    std::mutex output_mutex;
+    const uint16_t archive_compression = archive.header().compression;
+    WorkStealingPool pool;
+
+    // Ошибка останавливает распаковку: оставшиеся задачи ничего не делают, pool.wait() её пробрасывает.
+    auto guarded = [&](const std::string& name, auto work) {
+        if (failed) return;
+        try {
+            work();
+        } catch (const std::exception& e) {
+            failed = true;
+            throw std::runtime_error(name + ": " + e.what());
+        }
+    };
+    auto announce = [&](const std::string& name, const IndexRecord& record) {
+        if (!verbose) return;
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << "Extracting " << name << " (" << record.original_size << " -> " << record.compressed_size << " bytes)\n";
+    };
+
+    auto createOutput = [&](const std::string& name, const IndexRecord& record, size_t parts) {
+        auto output = std::make_shared<ChunkedOutput>();
+        fs::path path = fs::path(output_dir) / name;
+        output->path = path.string();
+        output->temp_path = (path.parent_path() / ("." + path.filename().string() + ".makaka-part")).string();
+        output->mtime_ns = record.mtime_ns;
+        output->size = record.original_size;
+        output->remaining = parts;
+        fs::create_directories(path.parent_path());
+        output->fd = open(output->temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (output->fd < 0 || (fallocate(output->fd, 0, 0, record.original_size) != 0
+                               && ftruncate(output->fd, record.original_size) != 0)) {
+            throw std::runtime_error("Failed to create " + output->path);
+        }
+        return output;
+    };
+
+    auto extractChunked = [&](const std::string& name, const IndexRecord& record) {
+        announce(name, record);
+        ChunkTable table = archive.readChunkTable(record);
+        auto output = createOutput(name, record, table.count());
+
+        // В обратном порядке: этот поток берёт свою очередь с конца и начнёт с первого куска,
+        // перехватчики забирают последние.
+        for (size_t k = table.count(); k-- > 0;) {
+            uint64_t chunk_offset = record.data_offset + table.offsets[k];
+            uint64_t chunk_size = table.compressedSize(k);
+            uint64_t original_size = table.originalSize(k, record.original_size);
+            uint64_t position = static_cast<uint64_t>(k) * table.chunk_size;
+            uint16_t compression = record.compression(archive_compression);
+            pool.submit([&guarded, &archive, compression, name, record, output, chunk_offset, chunk_size, original_size, position] {
+                guarded(name, [&] {
+                    std::vector<uint8_t> compressed = archive.readRaw(chunk_offset, chunk_size);
+                    io_throttle.account(compressed.size());
+                    std::vector<uint8_t> data = decodeEntryData(compression, record.filter(), original_size, compressed);
+                    if (!writeFileRange(output->fd, data.data(), data.size(), position)) {
+                        throw std::runtime_error("Failed to write " + output->path);
+                    }
+                    if (--output->remaining == 0) output->finish();
+                });
+            });
+        }
+    };
+
+    auto extractReferenced = [&](const std::string& name, const IndexRecord& record) {
+        if (!repository) throw std::runtime_error("entry is stored in a chunk repository, specify --repository");
+        announce(name, record);
+        std::vector<uint8_t> list = archive.readCompressed(record);
+        auto references = std::make_shared<const std::vector<ChunkReference>>(
+            parseChunkReferences(list.data(), list.size(), record.original_size));
+        if (references->empty()) {
+            writeExtractedFile(output_dir, name, {}, record.mtime_ns);
+            return;
+        }
+
+        // Группы подряд идущих кусков: (первый кусок, смещение в файле).
+        std::vector<std::pair<size_t, uint64_t>> groups;
+        uint64_t position = 0, group_bytes = REFERENCE_GROUP_BYTES;
+        for (size_t r = 0; r < references->size(); ++r) {
+            if (group_bytes >= REFERENCE_GROUP_BYTES) {
+                groups.emplace_back(r, position);
+                group_bytes = 0;
+            }
+            group_bytes += (*references)[r].size;
+            position += (*references)[r].size;
+        }
+        auto output = createOutput(name, record, groups.size());
+        for (size_t g = groups.size(); g-- > 0;) {
+            size_t first = groups[g].first;
+            size_t last = g + 1 < groups.size() ? groups[g + 1].first : references->size();
+            uint64_t offset = groups[g].second;
+            pool.submit([&guarded, repository, name, record, references, output, first, last, offset] {
+                guarded(name, [&] {
+                    uint64_t position = offset;
+                    for (size_t r = first; r < last; ++r) {
+                        const ChunkReference& reference = (*references)[r];
+                        std::vector<uint8_t> data = repository->read(reference.id);
+                        if (data.size() != reference.size) {
+                            throw std::runtime_error("Chunk " + chunkIdHex(reference.id) + " has wrong size");
+                        }
+                        io_throttle.account(data.size());  // сжатый размер куска здесь неизвестен
+                        if (!writeFileRange(output->fd, data.data(), data.size(), position)) {
+                            throw std::runtime_error("Failed to write " + output->path);
+                        }
+                        position += data.size();
+                    }
+                    if (--output->remaining == 0) output->finish();
+                });
+            });
+        }
+    };
 
-        std::vector<uint8_t> compressed_data;
-        switch (compression) {
-            case COMPRESS_LZMA:
-                compressed_data = compressWithLZMA(file_data);
-                break;
-            case COMPRESS_ZSTD:
-                compressed_data = compressWithZSTD(file_data);
-                break;
-            default:
-                compressed_data = file_data;
+    auto extractEntry = [&](const std::string& name, const IndexRecord& record) {
+        if (record.flags & ENTRY_CHUNKED) {
+            extractChunked(name, record);
+            return;
         }
+        if (record.flags & ENTRY_REFERENCES) {
+            extractReferenced(name, record);
+            return;
+        }
+        announce(name, record);
+        std::vector<uint8_t> compressed = archive.readCompressed(record);
+        io_throttle.account(compressed.size());
+        writeExtractedFile(output_dir, name,
+                           decodeEntryData(record.compression(archive_compression), record.filter(), record.original_size,
+                                           compressed),
+                           record.mtime_ns);
+    };
 
-        uint32_t name_length = file_path.size();
-        uint64_t original_size = file_data.size();
-        uint64_t compressed_size = compressed_data.size();
+    for (size_t round = 0, submitted = 1; submitted > 0; ++round) {
+        submitted = 0;
+        for (const auto& volume : tasks) {
+            if (round >= volume.size()) continue;
+            ++submitted;
+            const std::vector<size_t>& batch = volume[round];
+            pool.submit([&, batch] {
+                for (size_t i : batch) {
+                    const std::string& name = entries[i].first;
+                    const IndexRecord& record = entries[i].second;
+                    guarded(name, [&] {
+                        if (upToDate((fs::path(output_dir) / name).string(), ArchiveReader::toEntryInfo(record), update)) {
+                            ++unchanged;
+                            return;
+                        }
+                        extractEntry(name, record);
+                    });
+                }
+            });
+        }
+    }
+    pool.wait();
 
-        out.write(reinterpret_cast<const char*>(&name_length), 4);
-        out.write(file_path.c_str(), name_length);
-        out.write(reinterpret_cast<const char*>(&original_size), 8);
-        out.write(reinterpret_cast<const char*>(&compressed_size), 8);
-        out.write(reinterpret_cast<const char*>(compressed_data.data()), compressed_size);
+    // Первые копии готовы (или уже были на месте), остальные делаются из них.
+    for (const auto& [i, source] : copies) {
+        pool.submit([&, i = i, source = source] {
+            const std::string& name = entries[i].first;
+            const IndexRecord& record = entries[i].second;
+            guarded(name, [&] {
+                std::string path = (fs::path(output_dir) / name).string();
+                std::string source_path = (fs::path(output_dir) / entries[source].first).string();
+                // Жёсткая ссылка делит время изменения с первой копией, сверять её по времени нельзя.
+                struct stat st, source_st;
+                bool linked = duplicates == DUPLICATES_HARDLINK && update != UPDATE_NONE &&
+                              stat(path.c_str(), &st) == 0 && stat(source_path.c_str(), &source_st) == 0 &&
+                              st.st_dev == source_st.st_dev && st.st_ino == source_st.st_ino;
+                if (linked || upToDate(path, ArchiveReader::toEntryInfo(record), update)) {
+                    ++unchanged;
+                    return;
+                }
+                DuplicateCopy copy = DUPLICATE_FAILED;
+                if (sameStoredData(archive, record, entries[source].second)) {
+                    copy = materializeDuplicate(source_path, path, record.original_size, record.mtime_ns, duplicates);
+                }
+                if (copy == DUPLICATE_FAILED) {
+                    extractEntry(name, record);
+                } else if (verbose) {
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    std::cout << (copy == DUPLICATE_LINKED ? "Linking " : copy == DUPLICATE_CLONED ? "Cloning " : "Copying ")
+                              << name << " from " << entries[source].first << "\n";
+                }
+            });
+        });
+    }
+    pool.wait();
+    if (verbose && !copies.empty()) std::cout << "Duplicate entries: " << copies.size() << "\n";
+    if (update != UPDATE_NONE) {
+        std::cout << "Up to date: " << unchanged << ", extracted: " << entries.size() - unchanged << "\n";
     }
 }
 
-void extractArchive(const std::string& archive_path, const std::string& output_dir, bool verbose = false) {
-    std::ifstream in(archive_path, std::ios::binary);
-    if (!in) throw std::runtime_error("Failed to open archive");
+// names — если не пусто, распаковываются только перечисленные записи (через индекс).
+void extractArchive(const std::string& archive_path, const std::string& output_dir, bool verbose = false,
+                    const std::vector<std::string>& names = {}, const std::vector<std::string>& volume_dirs = {},
+                    UpdateMode update = UPDATE_NONE, DuplicateMode duplicates = DUPLICATES_REFLINK,
+                    std::shared_ptr<const ChunkRepository> repository = nullptr) {
+    if (!names.empty()) {
+        extractIndexedEntries(archive_path, output_dir, names, verbose, volume_dirs, update, repository);
+        return;
+    }
 
-    uint32_t signature;
-    in.read(reinterpret_cast<char*>(&signature), 4);
-    if (signature != MAKAKA_SIGNATURE) {
-        throw std::runtime_error("Invalid file format");
+    // Архивы с центральным индексом (2.1+) и многотомные распаковываются параллельно.
+    bool indexed = findVolumes(archive_path, volume_dirs).size() > 1;
+    if (!indexed) {
+        ArchiveInput in(archive_path);
+        indexed = readArchiveHeader(in).version >= MAKAKA_VERSION_2_1;
+    }
+    if (indexed) {
+        IndexedArchive archive(archive_path, INDEX_BUILD_MEMORY, volume_dirs);
+        if (verbose) {
+            std::cout << "Archive version: " << (archive.header().version >> 8) << "." << (archive.header().version & 0xFF) << "\n";
+            std::cout << "Compression: ";
+            printCompression(archive.header().compression);
+            std::cout << "Files in archive: " << archive.header().file_count << "\n";
+            if (archive.volumeCount() > 1) std::cout << "Volumes: " << archive.volumeCount() << "\n";
+        }
+        extractParallel(archive, output_dir, verbose, update, duplicates, repository.get());
+        return;
     }
 
-    uint16_t version, compression;
-    in.read(reinterpret_cast<char*>(&version), 2);
-    in.read(reinterpret_cast<char*>(&compression), 2);
+    ArchiveInput in(archive_path);
+    ArchiveHeader archive = readArchiveHeader(in);
+    if (update != UPDATE_NONE) {
+        std::cerr << "Warning: --update needs an archive with an index (2.1+), extracting everything" << std::endl;
+    }
 
     if (verbose) {
-        std::cout << "Archive version: " << (version >> 8) << "." << (version & 0xFF) << "\n";
+        std::cout << "Archive version: " << (archive.version >> 8) << "." << (archive.version & 0xFF) << "\n";
         std::cout << "Compression: ";
-        switch (compression) {
-            case COMPRESS_LZMA: std::cout << "LZMA\n"; break;
-            case COMPRESS_ZSTD: std::cout << "ZSTD\n"; break;
-            default: std::cout << "None\n";
+        printCompression(archive.compression);
+        std::cout << "Files in archive: " << archive.file_count << "\n";
+    }
+
+    EntryHeader entry;
+    for (uint32_t i = 0; i < archive.file_count; ++i) {
+        readEntryHeader(in, archive.version, entry);
+
+        if (verbose) {
+            std::cout << "Extracting " << entry.name << " (" 
+                      << entry.original_size << " -> " << entry.compressed_size << " bytes)\n";
+        }
+
+        std::vector<uint8_t> compressed_data(entry.compressed_size);
+        in.read(compressed_data.data(), entry.compressed_size);
+        io_throttle.account(entry.compressed_size);
+
+        uint16_t compression = (entry.flags & ENTRY_COMPRESSION) ? entry.compression : archive.compression;
+        std::vector<uint8_t> file_data = decodeEntryData(compression, entry.filter, entry.original_size,
+                                                         compressed_data, entry.flags);
+        writeExtractedFile(output_dir, entry.name, file_data);
+    }
+}
+
+// codec — если запись сжата не кодеком архива.
+void printEntry(const std::string& name, uint64_t original_size, uint64_t compressed_size, EntryFilter filter,
+                const Codec* codec = nullptr) {
+    std::cout << name << " (" << original_size << " bytes, compressed to " 
+              << compressed_size << " bytes";
+    if (codec) std::cout << ", " << codec->name;
+    if (filter.type == FILTER_DELTA) std::cout << ", filter delta:" << (filter.param + 1);
+    else if (filter.type != FILTER_NONE) std::cout << ", filter " << filterName(filter.type);
+    std::cout << ")\n";
+}
+
+void printArchiveSummary(const std::string& archive_path, const ArchiveHeader& archive) {
+    std::cout << "Archive: " << archive_path << "\n";
+    std::cout << "Version: " << (archive.version >> 8) << "." << (archive.version & 0xFF) << "\n";
+    std::cout << "Compression: ";
+    printCompression(archive.compression);
+    std::cout << "Files: " << archive.file_count << "\n\n";
+}
+
+void listArchiveContents(const std::string& archive_path, const std::vector<std::string>& volume_dirs) {
+    IndexedArchive archive(archive_path, INDEX_BUILD_MEMORY, volume_dirs);
+    printArchiveSummary(archive_path, archive.header());
+    uint16_t archive_compression = archive.header().compression;
+    archive.index().forEach([&](const std::string& name, const IndexRecord& record) {
+        uint16_t compression = record.compression(archive_compression);
+        printEntry(name, record.original_size, record.compressed_size, record.filter(),
+                   compression != archive_compression ? findCodec(compression) : nullptr);
+    });
+}
+
+// Строит sidecar для архива без встроенного индекса. force — перестроить даже действительный.
+// Возвращает описание результата для вывода.
+std::string buildSidecarIndex(const std::string& archive_path, bool force) {
+    if (force) std::remove(sidecarPath(archive_path).c_str());
+
+    IndexedArchive archive(archive_path, INDEX_BUILD_SIDECAR);
+    switch (archive.source()) {
+        case INDEX_EMBEDDED: return "embedded index, skipped";
+        case INDEX_IN_MEMORY: throw std::runtime_error("Failed to write " + sidecarPath(archive_path));
+        default: return std::to_string(archive.index().size()) + " entries";
+    }
+}
+
+// Команды index/reindex: sidecar-индексы для набора архивов, по архиву на поток.
+bool indexArchives(const std::vector<std::string>& archives, bool force) {
+    std::atomic<size_t> next{0};
+    std::atomic<bool> ok{true};
+    std::mutex output_mutex;
+    unsigned worker_count = workerCount(archives.size());
+
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < worker_count; ++w) {
+        workers.emplace_back([&, w] {
+            pinCurrentWorker(w);
+            for (size_t i; (i = next++) < archives.size();) {
+                try {
+                    std::string result = buildSidecarIndex(archives[i], force);
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    std::cout << "Indexed " << archives[i] << ": " << result << "\n";
+                } catch (const std::exception& e) {
+                    ok = false;
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    std::cerr << "Error: " << archives[i] << ": " << e.what() << std::endl;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    return ok;
+}
+
+// Аргументы-каталоги раскрываются в лежащие в них (рекурсивно) файлы *.makaka.
+std::vector<std::string> expandArchivePaths(const std::vector<std::string>& args) {
+    std::vector<std::string> archives;
+    for (const auto& arg : args) {
+        if (!std::filesystem::is_directory(arg)) {
+            archives.push_back(arg);
+            continue;
+        }
+        std::vector<std::string> found;
+        for (const auto& item : std::filesystem::recursive_directory_iterator(arg)) {
+            std::string file = item.path().string();
+            bool first_volume = file.size() > 11 && file.compare(file.size() - 11, 11, ".makaka.001") == 0;
+            if (item.is_regular_file() && (item.path().extension() == ".makaka" || first_volume)) found.push_back(file);
+        }
+        std::sort(found.begin(), found.end());
+        archives.insert(archives.end(), found.begin(), found.end());
+    }
+    return archives;
+}
+
+void buildCatalog(const std::string& catalog_path, const std::vector<std::string>& archives,
+                  const std::vector<std::string>& volume_dirs) {
+    CatalogUpdate update = updateCatalog(catalog_path, archives, volume_dirs);
+    for (const auto& error : update.errors) std::cerr << "Warning: Skipping " << error << std::endl;
+    std::cout << "Catalog " << catalog_path << ": " << (update.scanned + update.unchanged) << " archives ("
+              << update.scanned << " scanned, " << update.unchanged << " unchanged, " << update.removed
+              << " removed), " << update.entry_count << " entries" << std::endl;
+}
+
+bool locateEntries(const std::string& catalog_path, const std::vector<std::string>& names) {
+    Catalog catalog(catalog_path);
+    bool found_all = true;
+    for (const auto& name : names) {
+        std::vector<CatalogMatch> matches = catalog.locate(name);
+        if (matches.empty()) {
+            std::cout << name << ": not found\n";
+            found_all = false;
+        }
+        for (const auto& match : matches) {
+            std::cout << name << ": " << match.archive << " @ " << match.data_offset << "\n";
         }
     }
+    return found_all;
+}
 
-    uint32_t file_count;
-    in.read(reinterpret_cast<char*>(&file_count), 4);
-    if (verbose) std::cout << "Files in archive: " << file_count << "\n";
+// Команда find: ищет запись по имени и/или файл по содержимому в наборе архивов без каталога.
+// Фильтр Блума в индексе отсекает почти все архивы, не открывая блоков имён и данных;
+// совпадение по содержимому подтверждается сравнением с распакованными записями того же размера.
+bool findInArchives(const std::vector<std::string>& archives, const std::string& name, const std::string& content_path,
+                    const std::vector<std::string>& volume_dirs) {
+    std::vector<uint8_t> content;
+    uint64_t content_hash = 0;
+    if (!content_path.empty()) {
+        if (!readWholeFile(content_path, content)) throw std::runtime_error("Failed to read " + content_path);
+        content_hash = contentHash(content);
+    }
 
-    for (uint32_t i = 0; i < file_count; ++i) {
-        uint32_t name_length;
-        in.read(reinterpret_cast<char*>(&name_length), 4);
+    std::atomic<size_t> next{0};
+    std::atomic<bool> found{false};
+    std::mutex output_mutex;
+    unsigned worker_count = workerCount(archives.size());
 
-        std::string file_name(name_length, '\0');
-        in.read(&file_name[0], name_length);
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < worker_count; ++w) {
+        workers.emplace_back([&, w] {
+            pinCurrentWorker(w);
+            for (size_t i; (i = next++) < archives.size();) {
+                std::vector<std::string> hits;
+                try {
+                    IndexedArchive archive(archives[i], INDEX_BUILD_MEMORY, volume_dirs);
+                    const ArchiveIndex& index = archive.index();
+                    IndexRecord record;
+                    if (!name.empty() && index.mayContainName(name) && index.lookup(name, record)) {
+                        hits.push_back(name);
+                    }
+                    if (!content_path.empty() && index.mayContainContent(content_hash)) {
+                        index.forEach([&](const std::string& entry_name, const IndexRecord& entry) {
+                            if (entry.original_size != content.size()) return;
+                            // Данные записи со ссылками — в хранилище кусков; сверяем по хешу содержимого.
+                            if (entry.flags & ENTRY_REFERENCES) {
+                                if ((entry.flags & RECORD_CONTENT_HASH) && entry.content_hash == content_hash) {
+                                    hits.push_back(entry_name + " (content)");
+                                }
+                                return;
+                            }
+                            if (decodeEntryData(entry.compression(archive.header().compression), entry.filter(), entry.original_size,
+                                                archive.readCompressed(entry), entry.flags) == content) {
+                                hits.push_back(entry_name + " (content)");
+                            }
+                        });
+                    }
+                } catch (const std::exception& e) {
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    std::cerr << "Error: " << archives[i] << ": " << e.what() << std::endl;
+                }
 
-        uint64_t original_size, compressed_size;
-        in.read(reinterpret_cast<char*>(&original_size), 8);
-        in.read(reinterpret_cast<char*>(&compressed_size), 8);
+                if (hits.empty()) continue;
+                found = true;
+                std::lock_guard<std::mutex> lock(output_mutex);
+                for (const auto& hit : hits) std::cout << archives[i] << ": " << hit << "\n";
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    return found;
+}
 
-        if (verbose) {
-            std::cout << "Extracting " << file_name << " (" 
-                      << original_size << " -> " << compressed_size << " bytes)\n";
+// gc хранилища кусков: живые куски — те, на которые ссылаются существующие архивы из его списка;
+// удалённые архивы из списка убираются. Архив, который не удалось прочитать, останавливает gc —
+// иначе его куски были бы удалены.
+void collectRepository(const std::string& repository_dir, bool verbose) {
+    ChunkRepository repository(repository_dir, REPOSITORY_COLLECT);
+    ChunkIdSet live;
+    std::vector<std::string> kept;
+    size_t forgotten = 0;
+    for (const auto& path : repository.archives()) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 && errno == ENOENT) {
+            if (verbose) std::cout << "Forgetting " << path << "\n";
+            ++forgotten;
+            continue;
         }
+        try {
+            IndexedArchive archive(path, INDEX_BUILD_NONE);
+            archive.index().forEach([&](const std::string&, const IndexRecord& record) {
+                if (!(record.flags & ENTRY_REFERENCES)) return;
+                std::vector<uint8_t> list = archive.readCompressed(record);
+                for (const auto& reference : parseChunkReferences(list.data(), list.size(), record.original_size)) {
+                    live.insert(reference.id);
+                }
+            });
+        } catch (const std::exception& e) {
+            throw std::runtime_error(path + ": " + e.what());
+        }
+        kept.push_back(path);
+    }
+
+    RepositoryCollection result = repository.collectGarbage(live, kept);
+    std::cout << "Archives: " << kept.size() << " (" << forgotten << " removed)\n"
+              << "Chunks: " << result.chunks_kept << " kept, " << result.chunks_removed << " removed\n"
+              << "Packs: " << result.packs_rewritten << " rewritten, " << result.packs_removed << " removed, "
+              << result.bytes_reclaimed << " bytes reclaimed" << std::endl;
+}
+
+// Журнал обращений serve --access-log: строки "count\tархив\tзапись", архив — абсолютный путь.
+// Журнал дописывается, так что счётчики нескольких запусков складываются при чтении.
+void appendAccessLog(const std::string& log_path,
+                     const std::map<std::string, std::unique_ptr<ArchiveReader>>& archives) {
+    std::ofstream log(log_path, std::ios::app);
+    if (!log) throw std::runtime_error("Cannot open access log " + log_path);
+    for (const auto& archive : archives) {
+        std::string path = fs::absolute(archive.first).lexically_normal().string();
+        archive.second->forEachAccessed([&](const std::string& name, uint64_t count) {
+            log << count << '\t' << path << '\t' << name << '\n';
+        });
+    }
+    if (!log.flush()) throw std::runtime_error("Failed to write access log " + log_path);
+}
+
+// Суммарные обращения к записям архива archive_path по журналу.
+std::map<std::string, uint64_t> readAccessLog(const std::string& log_path, const std::string& archive_path) {
+    std::ifstream log(log_path);
+    if (!log) throw std::runtime_error("Cannot open access log " + log_path);
+    std::string path = fs::absolute(archive_path).lexically_normal().string();
+    std::map<std::string, uint64_t> counts;
+    std::string line;
+    while (std::getline(log, line)) {
+        size_t first = line.find('\t');
+        size_t second = first == std::string::npos ? first : line.find('\t', first + 1);
+        if (second == std::string::npos) throw std::runtime_error("Bad access log line: " + line);
+        if (line.compare(first + 1, second - first - 1, path) != 0) continue;
+        counts[line.substr(second + 1)] += std::stoull(line.substr(0, first));
+    }
+    return counts;
+}
+
+struct RetierSettings {
+    const CodecPreset* hot = nullptr;
+    const CodecPreset* cold = nullptr;
+    std::set<std::string> hot_names;
+    std::string access_log;
+    uint64_t min_reads = 1;
+    std::string repository;  // хранилище кусков, на которые ссылаются записи архива
+};
+
+struct RetierEntry {
+    std::string name;
+    IndexRecord record;
+    uint16_t compression = COMPRESS_NONE;  // кодек в новом архиве
+    int level = 0;
+    EntryFilter filter;
+    bool recompress = false;
+    size_t first_part = 0;  // индекс первой части записи в parts
+};
+
+// Часть пережимаемой записи: вся запись или один её кусок.
+struct RetierPart {
+    size_t entry;
+    uint64_t offset;  // от начала данных записи в исходном архиве
+    uint64_t size;
+    uint64_t original_size;
+    bool done = false;
+    std::vector<uint8_t> data;  // пережатая, пока не записана
+};
 
-        std::vector<uint8_t> compressed_data(compressed_size);
-        in.read(reinterpret_cast<char*>(compressed_data.data()), compressed_size);
+// Сколько сжатых байт может быть в работе: поставленные части считаются по исходному размеру,
+// готовые — по пережатому, пока не записаны.
+constexpr uint64_t RETIER_WINDOW_BYTES = 128 << 20;
 
-        std::vector<uint8_t> file_data;
-        if (compression == COMPRESS_ZSTD) {
-            file_data = decompressZSTD(compressed_data, original_size);
+// Переписывает архив, раскладывая записи по кодекам: горячие (названные явно или прочитанные
+// через serve не реже min_reads раз) — быстрым кодеком, остальные — плотным. Пережимаются только
+// записи, у которых кодек меняется, остальные копируются как есть. Кодек архива не меняется,
+// записи с другим кодеком помечаются ENTRY_COMPRESSION. Архив со ссылками на хранилище кусков
+// регистрируется в нём до записи, иначе gc удалил бы куски, нужные только новому архиву; сам архив
+// появляется под этим именем только дописанным (ArchiveOutput), так что неудачный retier не
+// оставляет в хранилище нечитаемый архив, на котором остановится gc.
+void retierArchive(const std::string& archive_path, const std::string& output_path, const RetierSettings& retier,
+                   const PackSettings& settings) {
+    IndexedArchive archive(archive_path, INDEX_BUILD_MEMORY, settings.volume_dirs);
+    if (fs::exists(output_path) && fs::equivalent(archive_path, output_path)) {
+        throw std::runtime_error("retier cannot rewrite an archive in place");
+    }
+    uint16_t archive_compression = archive.header().compression;
+    std::map<std::string, uint64_t> reads;
+    if (!retier.access_log.empty()) reads = readAccessLog(retier.access_log, archive_path);
+
+    std::vector<RetierEntry> entries;
+    entries.reserve(archive.index().size());
+    archive.index().forEach([&](const std::string& name, const IndexRecord& record) {
+        RetierEntry entry;
+        entry.name = name;
+        entry.record = record;
+        entry.compression = record.compression(archive_compression);
+        entry.filter = record.filter();
+        auto it = reads.find(name);
+        bool hot = retier.hot_names.count(name) || (it != reads.end() && it->second >= retier.min_reads);
+        const CodecPreset* target = hot ? retier.hot : retier.cold;
+        // Ссылки на хранилище кусков и записи незнакомым сборке кодеком переносятся как есть.
+        if (!(record.flags & ENTRY_REFERENCES) && findCodec(entry.compression)
+            && entry.compression != target->compression) {
+            entry.recompress = true;
+            entry.compression = target->compression;
+            entry.level = target->level;
+            if (!(findCodec(target->compression)->capabilities & CODEC_COMPRESSES)) entry.filter = EntryFilter();
+        }
+        entries.push_back(std::move(entry));
+    });
+    std::sort(entries.begin(), entries.end(), [](const RetierEntry& a, const RetierEntry& b) {
+        return a.record.archive_position < b.record.archive_position;
+    });
+
+    std::unique_ptr<ChunkRepository> repository;
+    for (const auto& entry : entries) {
+        if (!(entry.record.flags & ENTRY_REFERENCES)) continue;
+        if (!repository) {
+            if (retier.repository.empty()) {
+                throw std::runtime_error(archive_path + " references a chunk repository, specify it with --repository");
+            }
+            repository.reset(new ChunkRepository(retier.repository, REPOSITORY_APPEND));
+        }
+        std::vector<uint8_t> list = archive.readCompressed(entry.record);
+        for (const auto& reference : parseChunkReferences(list.data(), list.size(), entry.record.original_size)) {
+            if (!repository->contains(reference.id)) {
+                throw std::runtime_error("Chunk " + chunkIdHex(reference.id) + " of " + entry.name + " is missing from "
+                                         + retier.repository);
+            }
+        }
+    }
+    if (repository) repository->addArchive(fs::absolute(output_path).lexically_normal().string());
+
+    ArchiveOutput out(output_path, settings.volume_size, settings.volume_dirs, settings.sync);
+    uint32_t file_count = 0;
+    out.write(&MAKAKA_SIGNATURE, 4);
+    out.write(&MAKAKA_VERSION, 2);
+    out.write(&archive_compression, 2);
+    out.write(&file_count, 4);
+
+    // Части пережимаются на пуле по порядку записи, пока в окне есть место, и пишутся, как только
+    // готовы: в памяти только окно, сколь бы велики ни были записи.
+    std::vector<RetierPart> parts;
+    auto addPart = [&](size_t entry, uint64_t offset, uint64_t size, uint64_t original_size) {
+        RetierPart& part = parts.emplace_back();
+        part.entry = entry;
+        part.offset = offset;
+        part.size = size;
+        part.original_size = original_size;
+    };
+    for (size_t i = 0; i < entries.size(); ++i) {
+        RetierEntry& entry = entries[i];
+        if (!entry.recompress) continue;
+        entry.first_part = parts.size();
+        if (entry.record.flags & ENTRY_CHUNKED) {
+            ChunkTable table = archive.readChunkTable(entry.record);
+            for (size_t k = 0; k < table.count(); ++k) {
+                addPart(i, table.offsets[k], table.compressedSize(k), table.originalSize(k, entry.record.original_size));
+            }
         } else {
-            file_data = compressed_data;
+            addPart(i, 0, entry.record.compressed_size, entry.record.original_size);
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable part_done;
+    uint64_t window = 0;
+    size_t next_part = 0;
+    std::string error;
+    auto recompress = [&](size_t p) {
+        RetierPart& part = parts[p];
+        const RetierEntry& entry = entries[part.entry];
+        std::vector<uint8_t> data;
+        std::string failure;
+        try {
+            std::vector<uint8_t> decoded = decodeEntryData(entry.record.compression(archive_compression),
+                                                           entry.record.filter(), part.original_size,
+                                                           archive.readRaw(entry.record.data_offset + part.offset, part.size));
+            data = encodeEntryData(entry.compression, entry.level, entry.filter, decoded);
+        } catch (const std::exception& e) {
+            failure = entry.name + ": " + e.what();
         }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!failure.empty() && error.empty()) error = failure;
+        window = window - part.size + data.size();
+        part.data = std::move(data);
+        part.done = true;
+        part_done.notify_all();
+    };
+    // Задачи ссылаются на всё выше, поэтому пул объявлен последним: при исключении он дожидается их первым.
+    WorkStealingPool pool;
+    // Пережатая часть p; заодно ставит следующие части, пока окно не заполнено.
+    auto takePart = [&](size_t p) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            if (!error.empty()) throw std::runtime_error(error);
+            while (next_part < parts.size() && (next_part <= p || window < RETIER_WINDOW_BYTES)) {
+                window += parts[next_part].size;
+                pool.submit([&recompress, p = next_part] { recompress(p); });
+                ++next_part;
+            }
+            if (parts[p].done) break;
+            part_done.wait(lock);
+        }
+        if (!error.empty()) throw std::runtime_error(error);
+        std::vector<uint8_t> data = std::move(parts[p].data);
+        window -= data.size();
+        return data;
+    };
+
+    std::string previous_name;
+    std::vector<IndexEntry> index_entries;
+    size_t recompressed = 0;
+    uint64_t bytes_before = 0, bytes_after = 0;
+    for (RetierEntry& entry : entries) {
+        const IndexRecord& record = entry.record;
+        EntryHeader header;
+        header.name = entry.name;
+        header.original_size = record.original_size;
+        header.compressed_size = record.compressed_size;
+        header.filter = entry.filter;
+        header.flags = record.flags & (ENTRY_CHUNKED | ENTRY_REFERENCES);
+        if (entry.compression != archive_compression) {
+            header.flags |= ENTRY_COMPRESSION;
+            header.compression = entry.compression;
+        }
+        uint64_t header_offset = out.position();
+        uint64_t data_offset = 0;
 
-        fs::path full_path = fs::path(output_dir) / file_name;
-        fs::create_directories(full_path.parent_path());
+        if (!entry.recompress) {
+            std::string encoded = encodeEntryHeader(previous_name, header);
+            out.write(encoded.data(), encoded.size());
+            data_offset = out.position();
+            for (uint64_t copied = 0; copied < record.compressed_size;) {
+                uint64_t size = std::min<uint64_t>(ArchiveOutput::CHUNK_BYTES, record.compressed_size - copied);
+                std::vector<uint8_t> data = archive.readRaw(record.data_offset + copied, size);
+                out.write(data.data(), data.size());
+                copied += size;
+            }
+        } else if (!(record.flags & ENTRY_CHUNKED)) {
+            std::vector<uint8_t> data = takePart(entry.first_part);
+            header.compressed_size = data.size();
+            std::string encoded = encodeEntryHeader(previous_name, header);
+            out.write(encoded.data(), encoded.size());
+            data_offset = out.position();
+            out.write(data.data(), data.size());
+        } else {
+            // Как при упаковке: размер и таблица кусков — заглушки, заменяемые через patch().
+            size_t size_field = 0;
+            std::string encoded = encodeEntryHeader(previous_name, header, &size_field);
+            ChunkTable source_table = archive.readChunkTable(record);
+            std::vector<uint32_t> sizes(source_table.count());
+            std::string table = encodeChunkTable(source_table.chunk_size, sizes);
+            out.write(encoded.data(), encoded.size());
+            data_offset = out.position();
+            out.write(table.data(), table.size());
+            header.compressed_size = table.size();
+            for (size_t k = 0; k < sizes.size(); ++k) {
+                std::vector<uint8_t> data = takePart(entry.first_part + k);
+                if (data.size() > UINT32_MAX) throw std::runtime_error("Chunk too large: " + entry.name);
+                sizes[k] = static_cast<uint32_t>(data.size());
+                out.write(data.data(), data.size());
+                header.compressed_size += data.size();
+            }
+            std::string size = paddedVarint(header.compressed_size);
+            table = encodeChunkTable(source_table.chunk_size, sizes);
+            out.patch(header_offset + size_field, size.data(), size.size());
+            out.patch(data_offset, table.data(), table.size());
+        }
+        if (entry.recompress) {
+            ++recompressed;
+            bytes_before += record.compressed_size;
+            bytes_after += header.compressed_size;
+        }
 
-        std::ofstream out(full_path, std::ios::binary);
-        out.write(reinterpret_cast<const char*>(file_data.data()), file_data.size());
+        IndexEntry index_entry;
+        index_entry.name = entry.name;
+        index_entry.record = {};
+        index_entry.record.data_offset = data_offset;
+        index_entry.record.original_size = record.original_size;
+        index_entry.record.compressed_size = header.compressed_size;
+        index_entry.record.archive_position = file_count;
+        index_entry.record.filter_type = entry.filter.type;
+        index_entry.record.filter_param = entry.filter.param;
+        index_entry.record.flags = recordFlags(header);
+        index_entry.record.mtime_ns = record.mtime_ns;
+        index_entry.content_hash = record.content_hash;
+        index_entry.has_content_hash = record.flags & RECORD_CONTENT_HASH;
+        index_entries.push_back(std::move(index_entry));
+        previous_name = entry.name;
+        ++file_count;
     }
+
+    uint64_t index_offset = out.position();
+    std::string index = buildCentralIndex(index_entries, archive.index().hasHashIndex());
+    ArchiveFooter footer = {index_offset, index.size(), FOOTER_MAGIC};
+    out.write(index.data(), index.size());
+    out.write(&footer, sizeof(footer));
+    out.patch(8, &file_count, 4);
+    out.finish();
+
+    std::cout << "Recompressed: " << recompressed << " entries (" << bytes_before << " -> " << bytes_after
+              << " bytes), copied: " << (file_count - recompressed) << " entries" << std::endl;
+}
+
+// Протокол serve: запрос — ServeRequest, за ним путь архива и имя записи; ответ — ServeResponse
+// и payload_size байт. При ненулевом status payload содержит текст ошибки. Архив указывается
+// тем же путём, что был передан serve; другие файлы сервер не открывает.
+constexpr uint32_t SERVE_MAGIC = 0x4D4B5251;
+constexpr uint32_t SERVE_MAX_PATH = 64 * 1024;
+constexpr size_t SERVE_MAX_PENDING_OUTPUT = 16 << 20;
+
+enum ServeOp : uint8_t {
+    SERVE_LIST = 1,
+    SERVE_STAT = 2,
+    SERVE_READ = 3
+};
+
+enum ServeStatus : uint32_t {
+    SERVE_OK = 0,
+    SERVE_ERROR = 1,
+    SERVE_NOT_FOUND = 2
+};
+
+struct ServeRequest {
+    uint32_t magic;
+    uint8_t op;
+    uint8_t reserved[3];
+    uint32_t archive_size;
+    uint32_t name_size;
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct ServeResponse {
+    uint32_t status;
+    uint32_t reserved;
+    uint64_t payload_size;
+};
+
+// Описание записи в ответах list (за ним name_size байт имени) и stat (без имени).
+struct ServeEntry {
+    uint64_t original_size;
+    uint64_t compressed_size;
+    uint8_t filter_type;
+    uint8_t filter_param;
+    uint16_t reserved;
+    uint32_t name_size;
+};
+
+static_assert(sizeof(ServeRequest) == 32, "ServeRequest layout");
+static_assert(sizeof(ServeResponse) == 16, "ServeResponse layout");
+static_assert(sizeof(ServeEntry) == 24, "ServeEntry layout");
+
+ServeEntry toServeEntry(const EntryInfo& info, size_t name_size) {
+    ServeEntry entry = {};
+    entry.original_size = info.original_size;
+    entry.compressed_size = info.compressed_size;
+    entry.filter_type = info.filter.type;
+    entry.filter_param = info.filter.param;
+    entry.name_size = static_cast<uint32_t>(name_size);
+    return entry;
+}
+
+void appendServeResponse(std::string& out, uint32_t status, const std::string& payload) {
+    ServeResponse response = {};
+    response.status = status;
+    response.payload_size = payload.size();
+    appendPod(out, response);
+    out += payload;
 }
 
-void listArchiveContents(const std::string& archive_path) {
-    std::ifstream in(archive_path, std::ios::binary);
-    if (!in) throw std::runtime_error("Failed to open archive");
+// Дописывает ответ на запрос прямо в out: сначала заголовок, затем полезные данные,
+// после чего в заголовке проставляется их размер. При ошибке недописанный ответ отбрасывается.
+void handleServeRequest(std::string& out, const std::map<std::string, std::unique_ptr<ArchiveReader>>& archives,
+                        const ServeRequest& request, const std::string& archive_path, const std::string& name) {
+    auto archive = archives.find(archive_path);
+    if (archive == archives.end()) {
+        appendServeResponse(out, SERVE_NOT_FOUND, "Archive not served: " + archive_path);
+        return;
+    }
+    const ArchiveReader& reader = *archive->second;
 
-    uint32_t signature;
-    in.read(reinterpret_cast<char*>(&signature), 4);
-    if (signature != MAKAKA_SIGNATURE) {
-        throw std::runtime_error("Invalid file format");
+    size_t start = out.size();
+    try {
+        ServeResponse response = {};
+        response.status = SERVE_OK;
+        appendPod(out, response);
+        if (request.op == SERVE_LIST) {
+            reader.forEach([&](const std::string& entry_name, const EntryInfo& info) {
+                appendPod(out, toServeEntry(info, entry_name.size()));
+                out += entry_name;
+            });
+        } else if (request.op == SERVE_STAT || request.op == SERVE_READ) {
+            EntryInfo info;
+            if (!reader.stat(name, info)) {
+                out.resize(start);
+                appendServeResponse(out, SERVE_NOT_FOUND, "Entry not found: " + name);
+                return;
+            }
+            if (request.op == SERVE_STAT) {
+                appendPod(out, toServeEntry(info, 0));
+            } else {
+                std::vector<uint8_t> data = reader.readRange(name, request.offset, request.length);
+                out.append(reinterpret_cast<const char*>(data.data()), data.size());
+            }
+        } else {
+            out.resize(start);
+            appendServeResponse(out, SERVE_ERROR, "Unknown request");
+            return;
+        }
+        response.payload_size = out.size() - start - sizeof(response);
+        std::memcpy(&out[start], &response, sizeof(response));
+    } catch (const std::exception& e) {
+        out.resize(start);
+        appendServeResponse(out, SERVE_ERROR, e.what());
     }
+}
 
-    uint16_t version, compression;
-    in.read(reinterpret_cast<char*>(&version), 2);
-    in.read(reinterpret_cast<char*>(&compression), 2);
+struct ServeConnection {
+    std::string input;
+    std::string output;
+    size_t output_sent = 0;
+    bool broken = false;
+};
 
-    std::cout << "Archive: " << archive_path << "\n";
-    std::cout << "Version: " << (version >> 8) << "." << (version & 0xFF) << "\n";
-    std::cout << "Compression: ";
-    switch (compression) {
-        case COMPRESS_LZMA: std::cout << "LZMA\n"; break;
-        case COMPRESS_ZSTD: std::cout << "ZSTD\n"; break;
-        default: std::cout << "None\n";
+// Разбирает все полные запросы из input, пока неотправленный вывод не превысит предел.
+void processServeInput(const std::map<std::string, std::unique_ptr<ArchiveReader>>& archives,
+                       ServeConnection& connection) {
+    size_t consumed = 0;
+    while (connection.output.size() - connection.output_sent < SERVE_MAX_PENDING_OUTPUT) {
+        if (connection.input.size() - consumed < sizeof(ServeRequest)) break;
+
+        ServeRequest request;
+        std::memcpy(&request, connection.input.data() + consumed, sizeof(request));
+        if (request.magic != SERVE_MAGIC || request.archive_size > SERVE_MAX_PATH || request.name_size > SERVE_MAX_PATH) {
+            connection.broken = true;
+            break;
+        }
+        size_t total = sizeof(request) + request.archive_size + request.name_size;
+        if (connection.input.size() - consumed < total) break;
+
+        const char* strings = connection.input.data() + consumed + sizeof(request);
+        handleServeRequest(connection.output, archives, request, std::string(strings, request.archive_size),
+                           std::string(strings + request.archive_size, request.name_size));
+        consumed += total;
+    }
+    connection.input.erase(0, consumed);
+}
+
+volatile sig_atomic_t serve_stop = 0;
+
+void stopServing(int) {
+    serve_stop = 1;
+}
+
+sockaddr_un unixSocketAddress(const std::string& socket_path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path is too long: " + socket_path);
+    }
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    return address;
+}
+
+// Команда serve: держит архивы открытыми (индексы отображены, контексты кодеков и кэш блоков
+// прогреты) и отвечает на запросы в однопоточном цикле epoll.
+void serveArchives(const std::string& socket_path, const std::vector<std::string>& archive_paths, uint64_t cache_bytes,
+                   const std::vector<std::string>& volume_dirs, std::shared_ptr<const ChunkRepository> repository,
+                   const std::string& access_log) {
+    auto cache = cache_bytes ? std::make_shared<BlockCache>(cache_bytes) : nullptr;
+    std::map<std::string, std::unique_ptr<ArchiveReader>> archives;
+    for (const auto& path : archive_paths) {
+        archives[path].reset(new ArchiveReader(path, cache, volume_dirs, repository));
+    }
+
+    sockaddr_un address = unixSocketAddress(socket_path);
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path.c_str());
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) throw std::runtime_error("Failed to create socket");
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listen_fd, 128) != 0) {
+        close(listen_fd);
+        throw std::runtime_error("Failed to listen on " + socket_path + ": " + std::strerror(errno));
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServing);
+    signal(SIGTERM, stopServing);
+    std::cout << "Serving " << archives.size() << " archive(s) on " << socket_path << std::endl;
+
+    std::map<int, ServeConnection> connections;
+    auto closeConnection = [&](int fd) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        connections.erase(fd);
+    };
+
+    std::vector<epoll_event> events(64);
+    char buffer[64 * 1024];
+    while (!serve_stop) {
+        int ready = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < ready; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                for (int client; (client = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0;) {
+                    epoll_event client_event = {};
+                    client_event.events = EPOLLIN;
+                    client_event.data.fd = client;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &client_event);
+                    connections[client];
+                }
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            ServeConnection& connection = it->second;
+            bool closed = (events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN);
+
+            if (events[i].events & EPOLLIN) {
+                for (;;) {
+                    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+                    if (n > 0) {
+                        connection.input.append(buffer, n);
+                        if (n < static_cast<ssize_t>(sizeof(buffer))) break;
+                    } else {
+                        if (n == 0 || (errno != EAGAIN && errno != EINTR)) closed = true;
+                        break;
+                    }
+                }
+            }
+            processServeInput(archives, connection);
+
+            while (connection.output_sent < connection.output.size()) {
+                ssize_t n = send(fd, connection.output.data() + connection.output_sent,
+                                 connection.output.size() - connection.output_sent, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    if (n < 0 && errno != EAGAIN && errno != EINTR) closed = true;
+                    break;
+                }
+                connection.output_sent += n;
+            }
+            if (connection.output_sent == connection.output.size()) {
+                connection.output.clear();
+                connection.output_sent = 0;
+                // Ответы отправлены — можно разобрать запросы, отложенные из-за переполнения вывода.
+                if (!connection.input.empty()) processServeInput(archives, connection);
+            }
+
+            if (closed || connection.broken) {
+                closeConnection(fd);
+                continue;
+            }
+            // Пока вывод переполнен, перестаём читать сокет, иначе клиент, не забирающий ответы,
+            // раздувал бы входной буфер.
+            epoll_event client_event = {};
+            client_event.events = 0;
+            if (connection.output.size() - connection.output_sent < SERVE_MAX_PENDING_OUTPUT) client_event.events |= EPOLLIN;
+            if (!connection.output.empty()) client_event.events |= EPOLLOUT;
+            client_event.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &client_event);
+        }
+    }
+
+    while (!connections.empty()) closeConnection(connections.begin()->first);
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    if (cache) {
+        BlockCacheStats stats = cache->stats();
+        std::cout << "Cache: " << stats.hits << " hits, " << stats.misses << " misses, "
+                  << stats.evictions << " evictions" << std::endl;
+    }
+    if (!access_log.empty()) appendAccessLog(access_log, archives);
+}
+
+void writeAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error("Write failed");
+        p += n;
+        size -= n;
+    }
+}
+
+void readAll(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error("Connection closed by server");
+        p += n;
+        size -= n;
+    }
+}
+
+// Команда client: один запрос к serve. args — list <архив> | stat <архив> <запись> |
+// read <архив> <запись> [смещение [длина]]; прочитанные данные пишутся в stdout или в output_path.
+bool queryServer(const std::string& socket_path, const std::vector<std::string>& args, const std::string& output_path) {
+    if (args.size() < 2) throw std::runtime_error("Usage: client <socket> list|stat|read <archive> [entry] [offset] [length]");
+
+    ServeRequest request = {};
+    request.magic = SERVE_MAGIC;
+    request.length = UINT64_MAX;
+    if (args[0] == "list") request.op = SERVE_LIST;
+    else if (args[0] == "stat") request.op = SERVE_STAT;
+    else if (args[0] == "read") request.op = SERVE_READ;
+    else throw std::runtime_error("Unknown request: " + args[0]);
+
+    std::string name;
+    if (request.op != SERVE_LIST) {
+        if (args.size() < 3) throw std::runtime_error("No entry specified");
+        name = args[2];
+        if (args.size() > 3) request.offset = std::stoull(args[3]);
+        if (args.size() > 4) request.length = std::stoull(args[4]);
     }
+    request.archive_size = static_cast<uint32_t>(args[1].size());
+    request.name_size = static_cast<uint32_t>(name.size());
 
-    uint32_t file_count;
-    in.read(reinterpret_cast<char*>(&file_count), 4);
-    std::cout << "Files: " << file_count << "\n\n";
+    sockaddr_un address = unixSocketAddress(socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("Failed to connect to " + socket_path + ": " + std::strerror(errno));
+    }
 
-    for (uint32_t i = 0; i < file_count; ++i) {
-        uint32_t name_length;
-        in.read(reinterpret_cast<char*>(&name_length), 4);
+    ServeResponse response;
+    std::string payload;
+    try {
+        std::string message;
+        appendPod(message, request);
+        message += args[1];
+        message += name;
+        writeAll(fd, message.data(), message.size());
 
-        std::string file_name(name_length, '\0');
-        in.read(&file_name[0], name_length);
+        readAll(fd, &response, sizeof(response));
+        payload.resize(response.payload_size);
+        readAll(fd, &payload[0], payload.size());
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
 
-        uint64_t original_size, compressed_size;
-        in.read(reinterpret_cast<char*>(&original_size), 8);
-        in.read(reinterpret_cast<char*>(&compressed_size), 8);
+    if (response.status != SERVE_OK) {
+        std::cerr << "Error: " << payload << std::endl;
+        return false;
+    }
 
-        std::cout << file_name << " (" << original_size << " bytes, compressed to " 
-                  << compressed_size << " bytes)\n";
+    if (request.op == SERVE_READ) {
+        if (output_path.empty()) {
+            std::cout.write(payload.data(), payload.size());
+        } else {
+            std::ofstream out(output_path, std::ios::binary);
+            out.write(payload.data(), payload.size());
+        }
+        return true;
+    }
 
-        in.seekg(compressed_size, std::ios::cur);
+    for (size_t pos = 0; pos + sizeof(ServeEntry) <= payload.size();) {
+        ServeEntry entry;
+        std::memcpy(&entry, payload.data() + pos, sizeof(entry));
+        pos += sizeof(entry);
+        std::string entry_name = request.op == SERVE_STAT ? name : payload.substr(pos, entry.name_size);
+        pos += entry.name_size;
+        printEntry(entry_name, entry.original_size, entry.compressed_size, {static_cast<FilterType>(entry.filter_type), entry.filter_param});
     }
+    return true;
 }
 
 struct ProgramOptions {
     std::string command;
     std::vector<std::string> files;
     std::string output_path;
-    CompressionType compression = COMPRESS_ZSTD;
+    PackSettings pack;
+    EntryOrder order = ORDER_ARGS;
+    uint64_t cache_bytes = 256ULL << 20;
+    uint64_t bwlimit = 0;
+    uint64_t iops_limit = 0;
+    std::string ionice;
+    bool stats = false;
+    UpdateMode update = UPDATE_NONE;
+    DuplicateMode duplicates = DUPLICATES_REFLINK;
+    std::string find_name;
+    std::string find_content;
+    std::string repository;
+    std::string access_log;
+    uint64_t min_reads = 1;
+    std::string hot_codec = "lz4";
+    std::string cold_codec = "lzma";
     bool verbose = false;
 };
 
+// "512", "64K", "100M", "2G" -> байты.
+uint64_t parseByteSize(const std::string& text) {
+    size_t digits = 0;
+    uint64_t value = std::stoull(text, &digits);
+    std::string suffix = text.substr(digits);
+    if (suffix == "K" || suffix == "k") return value << 10;
+    if (suffix == "M" || suffix == "m") return value << 20;
+    if (suffix == "G" || suffix == "g") return value << 30;
+    if (!suffix.empty()) throw std::runtime_error("Bad size: " + text);
+    return value;
+}
+
 ProgramOptions parseArguments(int argc, char* argv[]) {
     ProgramOptions options;
     if (argc < 2) {
         throw std::runtime_error(
             "Usage:\n"
-            "  pack <files...> -o <output.makaka> [-c lzma|zstd]\n"
-            "  unpack <archive.makaka> [-o output_dir] [-v]\n"
-            "  list <archive.makaka>"
+            "  pack <files...> -o <output.makaka> [-c " + codecPresetNames() + "] [-f auto|none|x86|arm64|delta[:N]]\n"
+            "       [--order=args|similarity] [--read-order=args|physical]\n"
+            "       [--prefetch=<MiB>] [--chunk-size=N[K|M|G]] [--hash-index] [--checkpoint=<sec>] [--resume]\n"
+            "       [--volume-size=N[K|M|G]] [--volume-dirs=dir1,dir2,...] [--repository=<dir>]\n"
+            "  unpack <archive.makaka> [entries...] [-o output_dir] [-v] [--volume-dirs=...]\n"
+            "         [--update[=mtime|checksum]] [--duplicates=reflink|hardlink|none] [--repository=<dir>]\n"
+            "  pack/unpack I/O: [--bwlimit=N[K|M|G]] [--iops-limit=N] [--ionice=idle|be[:0-7]]\n"
+            "                   (SIGUSR1 halves the limits, SIGUSR2 doubles them)\n"
+            "                   [--sync=none|end|batch|each]\n"
+            "  threads: [-j N] [--pin=none|cpu|numa] [--stats]\n"
+            "  list <archive.makaka> [--volume-dirs=...]\n"
+            "  index <archives...>   (writes <archive>.idx for archives without an embedded index)\n"
+            "  reindex <archives...>\n"
+            "  catalog <archives|dirs...> -o <catalog> [--volume-dirs=...]\n"
+            "  locate <catalog> <entries...>\n"
+            "  find <archives|dirs...> [--name=<entry>] [--content=<file>] [--volume-dirs=...]\n"
+            "  serve <socket> <archives...> [--cache=<MiB>] [--repository=<dir>] [--access-log=<file>]\n"
+            "  gc <repository> [-v]\n"
+            "  retier <archive.makaka> [hot entries...] -o <output.makaka> [--access-log=<file>] [--min-reads=N]\n"
+            "         [--hot=" + codecPresetNames() + "] [--cold=...] [--repository=<dir>]\n"
+            "  client <socket> list|stat|read <archive> [entry] [offset] [length] [-o file]"
         );
     }
 
@@ -250,10 +3344,108 @@ ProgramOptions parseArguments(int argc, char* argv[]) {
         if (arg == "-o" && i + 1 < argc) {
             options.output_path = argv[++i];
         } else if (arg == "-c" && i + 1 < argc) {
-            std::string method = argv[++i];
-            if (method == "lzma") options.compression = COMPRESS_LZMA;
-            else if (method == "zstd") options.compression = COMPRESS_ZSTD;
-            else throw std::runtime_error("Unknown compression method");
+            const CodecPreset* preset = findCodecPreset(argv[++i]);
+            if (!preset) throw std::runtime_error("Unknown compression method");
+            options.pack.compression = preset->compression;
+            options.pack.level = preset->level;
+        } else if (arg == "-f" && i + 1 < argc) {
+            std::string filter = argv[++i];
+            options.pack.filter_mode = FILTER_MODE_FIXED;
+            if (filter == "auto") options.pack.filter_mode = FILTER_MODE_AUTO;
+            else if (filter == "none") options.pack.filter.type = FILTER_NONE;
+            else if (filter == "x86") options.pack.filter.type = FILTER_X86;
+            else if (filter == "arm64") options.pack.filter.type = FILTER_ARM64;
+            else if (filter == "delta" || (filter.size() > 6 && filter.rfind("delta:", 0) == 0
+                                            && filter.find_first_not_of("0123456789", 6) == std::string::npos)) {
+                int distance = filter == "delta" ? 1 : filter.size() > 9 ? 0 : std::stoi(filter.substr(6));
+                if (distance < 1 || distance > 256) throw std::runtime_error("Delta distance must be 1..256");
+                options.pack.filter.type = FILTER_DELTA;
+                options.pack.filter.param = static_cast<uint8_t>(distance - 1);
+            }
+            else throw std::runtime_error("Unknown filter");
+        } else if (arg.rfind("--order=", 0) == 0) {
+            std::string order = arg.substr(8);
+            if (order == "args") options.order = ORDER_ARGS;
+            else if (order == "similarity") options.order = ORDER_SIMILARITY;
+            else throw std::runtime_error("Unknown entry order");
+        } else if (arg.rfind("--read-order=", 0) == 0) {
+            std::string order = arg.substr(13);
+            if (order == "args") options.pack.read_order = READ_ORDER_ARGS;
+            else if (order == "physical") options.pack.read_order = READ_ORDER_PHYSICAL;
+            else throw std::runtime_error("Unknown read order");
+        } else if (arg.rfind("--prefetch=", 0) == 0) {
+            options.pack.prefetch_bytes = std::stoull(arg.substr(11)) << 20;
+        } else if (arg.rfind("--chunk-size=", 0) == 0) {
+            uint64_t chunk_size = parseByteSize(arg.substr(13));
+            if (chunk_size != 0 && (chunk_size < PackPipeline::FILTER_SAMPLE_BYTES || chunk_size > (1ULL << 30))) {
+                throw std::runtime_error("Chunk size must be 0 (no splitting) or 64K..1G");
+            }
+            options.pack.chunk_size = static_cast<uint32_t>(chunk_size);
+        } else if (arg.rfind("--checkpoint=", 0) == 0) {
+            options.pack.checkpoint_seconds = static_cast<unsigned>(std::stoul(arg.substr(13)));
+        } else if (arg == "--update" || arg.rfind("--update=", 0) == 0) {
+            std::string mode = arg.size() > 9 ? arg.substr(9) : "mtime";
+            if (mode == "mtime") options.update = UPDATE_MTIME;
+            else if (mode == "checksum") options.update = UPDATE_CHECKSUM;
+            else throw std::runtime_error("Unknown update mode");
+        } else if (arg.rfind("--sync=", 0) == 0) {
+            std::string policy = arg.substr(7);
+            if (policy == "none") options.pack.sync = SYNC_NONE;
+            else if (policy == "end") options.pack.sync = SYNC_END;
+            else if (policy == "batch") options.pack.sync = SYNC_BATCH;
+            else if (policy == "each") options.pack.sync = SYNC_EACH;
+            else throw std::runtime_error("Unknown sync policy");
+        } else if (arg.rfind("--duplicates=", 0) == 0) {
+            std::string mode = arg.substr(13);
+            if (mode == "reflink") options.duplicates = DUPLICATES_REFLINK;
+            else if (mode == "hardlink") options.duplicates = DUPLICATES_HARDLINK;
+            else if (mode == "none") options.duplicates = DUPLICATES_NONE;
+            else throw std::runtime_error("Unknown duplicates mode");
+        } else if (arg == "--resume") {
+            options.pack.resume = true;
+        } else if (arg.rfind("--cache=", 0) == 0) {
+            options.cache_bytes = std::stoull(arg.substr(8)) << 20;
+        } else if (arg.rfind("--repository=", 0) == 0) {
+            options.repository = arg.substr(13);
+        } else if (arg.rfind("--access-log=", 0) == 0) {
+            options.access_log = arg.substr(13);
+        } else if (arg.rfind("--min-reads=", 0) == 0) {
+            options.min_reads = std::stoull(arg.substr(12));
+        } else if (arg.rfind("--hot=", 0) == 0) {
+            options.hot_codec = arg.substr(6);
+        } else if (arg.rfind("--cold=", 0) == 0) {
+            options.cold_codec = arg.substr(7);
+        } else if (arg.rfind("--name=", 0) == 0) {
+            options.find_name = arg.substr(7);
+        } else if (arg.rfind("--content=", 0) == 0) {
+            options.find_content = arg.substr(10);
+        } else if (arg.rfind("--volume-size=", 0) == 0) {
+            options.pack.volume_size = parseByteSize(arg.substr(14));
+            if (options.pack.volume_size < 4096) throw std::runtime_error("Volume size must be at least 4K");
+        } else if (arg.rfind("--volume-dirs=", 0) == 0) {
+            std::string dirs = arg.substr(14);
+            for (size_t start = 0, comma; start <= dirs.size(); start = comma + 1) {
+                comma = std::min(dirs.find(',', start), dirs.size());
+                if (comma > start) options.pack.volume_dirs.push_back(dirs.substr(start, comma - start));
+            }
+        } else if (arg.rfind("--bwlimit=", 0) == 0) {
+            options.bwlimit = parseByteSize(arg.substr(10));
+        } else if (arg.rfind("--iops-limit=", 0) == 0) {
+            options.iops_limit = std::stoull(arg.substr(13));
+        } else if (arg.rfind("--ionice=", 0) == 0) {
+            options.ionice = arg.substr(9);
+        } else if (arg == "-j" && i + 1 < argc) {
+            setWorkerLimit(static_cast<unsigned>(std::stoul(argv[++i])));
+        } else if (arg.rfind("--pin=", 0) == 0) {
+            std::string pin = arg.substr(6);
+            if (pin == "none") setPinMode(PIN_NONE);
+            else if (pin == "cpu") setPinMode(PIN_CPU);
+            else if (pin == "numa") setPinMode(PIN_NUMA);
+            else throw std::runtime_error("Unknown pin mode");
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--hash-index") {
+            options.pack.hash_index = true;
         } else if (arg == "-v") {
             options.verbose = true;
         } else if (arg[0] != '-') {
@@ -263,29 +3455,137 @@ ProgramOptions parseArguments(int argc, char* argv[]) {
     return options;
 }
 
+// --stats: выбранная раскладка потоков и откуда взялись ограничения.
+void printCpuLayout() {
+    const CpuLayout& layout = cpuLayout();
+    std::cerr << "CPUs allowed: " << layout.cpus.size() << " (";
+    for (size_t i = 0; i < layout.cpus.size(); ++i) {
+        size_t j = i;
+        while (j + 1 < layout.cpus.size() && layout.cpus[j + 1] == layout.cpus[j] + 1) ++j;
+        std::cerr << (i ? "," : "") << layout.cpus[i];
+        if (j > i) std::cerr << "-" << layout.cpus[j];
+        i = j;
+    }
+    std::cerr << ")\n";
+
+    std::vector<int> nodes(layout.cpu_nodes);
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    std::cerr << "NUMA nodes: ";
+    if (nodes.empty() || nodes.front() < 0) std::cerr << "unknown";
+    for (size_t i = 0; i < nodes.size() && nodes.front() >= 0; ++i) std::cerr << (i ? "," : "") << nodes[i];
+    std::cerr << "\n";
+
+    std::cerr << "CPU quota: ";
+    if (layout.cpu_quota > 0) std::cerr << layout.cpu_quota << " cores\n";
+    else std::cerr << "none\n";
+    std::cerr << "Memory limit: ";
+    if (layout.memory_limit > 0) std::cerr << (layout.memory_limit >> 20) << " MiB\n";
+    else std::cerr << "none\n";
+
+    const char* pin_names[] = {"none", "cpu", "numa"};
+    std::cerr << "Workers: " << workerCount() << (workerCount() != layout.workers ? " (set by -j)" : "")
+              << ", pinning: " << pin_names[pinMode()] << std::endl;
+}
+
 int main(int argc, char* argv[]) {
     try {
         ProgramOptions options = parseArguments(argc, argv);
+        if (!options.ionice.empty()) setIoPriority(options.ionice);
+        io_throttle.setLimits(options.bwlimit, options.iops_limit);
+        if (options.command == "pack" || options.command == "unpack") IoThrottle::installSignalHandlers();
+        if (options.stats) printCpuLayout();
+        auto started = std::chrono::steady_clock::now();
 
         if (options.command == "pack") {
             if (options.files.empty()) throw std::runtime_error("No input files specified");
             std::string output = options.output_path.empty() ? "archive.makaka" : options.output_path;
-            createArchive(options.files, output, options.compression);
+            if (options.order == ORDER_SIMILARITY) options.files = orderBySimilarity(options.files);
+            if (!options.repository.empty()) createRepositoryArchive(options.files, output, options.pack, options.repository);
+            else createArchive(options.files, output, options.pack);
             std::cout << "Created archive: " << output << std::endl;
         } 
         else if (options.command == "unpack") {
             if (options.files.empty()) throw std::runtime_error("No archive specified");
             std::string output_dir = options.output_path.empty() ? "." : options.output_path;
-            extractArchive(options.files[0], output_dir, options.verbose);
+            std::vector<std::string> names(options.files.begin() + 1, options.files.end());
+            output_sync.setPolicy(options.pack.sync);
+            std::shared_ptr<const ChunkRepository> repository;
+            if (!options.repository.empty()) repository = std::make_shared<ChunkRepository>(options.repository, REPOSITORY_READ);
+            extractArchive(options.files[0], output_dir, options.verbose, names, options.pack.volume_dirs, options.update,
+                           options.duplicates, repository);
+            output_sync.finish(output_dir);
             std::cout << "Extracted to: " << output_dir << std::endl;
         } 
+        else if (options.command == "index" || options.command == "reindex") {
+            if (options.files.empty()) throw std::runtime_error("No archive specified");
+            if (!indexArchives(options.files, options.command == "reindex")) return 1;
+        }
+        else if (options.command == "catalog") {
+            if (options.output_path.empty()) throw std::runtime_error("No catalog specified (-o)");
+            buildCatalog(options.output_path, expandArchivePaths(options.files), options.pack.volume_dirs);
+        }
+        else if (options.command == "locate") {
+            if (options.files.size() < 2) throw std::runtime_error("Usage: locate <catalog> <entries...>");
+            if (!locateEntries(options.files[0], std::vector<std::string>(options.files.begin() + 1, options.files.end()))) return 1;
+        }
+        else if (options.command == "find") {
+            if (options.find_name.empty() && options.find_content.empty()) {
+                throw std::runtime_error("Specify --name=<entry> and/or --content=<file>");
+            }
+            if (!findInArchives(expandArchivePaths(options.files), options.find_name, options.find_content,
+                                options.pack.volume_dirs)) {
+                return 1;
+            }
+        }
+        else if (options.command == "serve") {
+            if (options.files.size() < 2) throw std::runtime_error("Usage: serve <socket> <archives...>");
+            std::shared_ptr<const ChunkRepository> repository;
+            if (!options.repository.empty()) repository = std::make_shared<ChunkRepository>(options.repository, REPOSITORY_READ);
+            serveArchives(options.files[0], std::vector<std::string>(options.files.begin() + 1, options.files.end()),
+                          options.cache_bytes, options.pack.volume_dirs, repository, options.access_log);
+        }
+        else if (options.command == "client") {
+            if (options.files.empty()) throw std::runtime_error("No socket specified");
+            if (!queryServer(options.files[0], std::vector<std::string>(options.files.begin() + 1, options.files.end()),
+                             options.output_path)) return 1;
+        }
+        else if (options.command == "gc") {
+            if (options.files.size() != 1) throw std::runtime_error("Usage: gc <repository>");
+            collectRepository(options.files[0], options.verbose);
+        }
+        else if (options.command == "retier") {
+            if (options.files.empty()) throw std::runtime_error("No archive specified");
+            if (options.output_path.empty()) throw std::runtime_error("No output archive specified (-o)");
+            RetierSettings retier;
+            retier.hot = findCodecPreset(options.hot_codec);
+            retier.cold = findCodecPreset(options.cold_codec);
+            if (!retier.hot || !retier.cold) throw std::runtime_error("Unknown compression method");
+            // Уровень сжатия в архиве не хранится: записи двух пресетов одного кодека (lz4 и lz4hc)
+            // неотличимы, и retier молча ничего бы не пережал.
+            if (retier.hot != retier.cold && retier.hot->compression == retier.cold->compression) {
+                throw std::runtime_error("--hot=" + options.hot_codec + " and --cold=" + options.cold_codec
+                                         + " use the same codec, retier cannot tell their entries apart");
+            }
+            retier.hot_names.insert(options.files.begin() + 1, options.files.end());
+            retier.access_log = options.access_log;
+            retier.min_reads = options.min_reads;
+            retier.repository = options.repository;
+            retierArchive(options.files[0], options.output_path, retier, options.pack);
+            std::cout << "Created archive: " << options.output_path << std::endl;
+        }
         else if (options.command == "list") {
             if (options.files.empty()) throw std::runtime_error("No archive specified");
-            listArchiveContents(options.files[0]);
+            listArchiveContents(options.files[0], options.pack.volume_dirs);
         } 
         else {
             throw std::runtime_error("Unknown command: " + options.command);
         }
+
+        if (options.stats) {
+            std::cerr << "Elapsed: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count()
+                      << " s" << std::endl;
+        }
     } 
     catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
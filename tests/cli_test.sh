@@ -0,0 +1,459 @@
+#!/bin/sh
+# Сквозные тесты makakatool: cli_test.sh <makakatool> [тест...]. Каждый тест работает в своём
+# временном каталоге; код возврата 0 — все прошли.
+set -u
+TOOL=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+ROOT=$(mktemp -d "${TMPDIR:-/tmp}/makaka-cli.XXXXXX")
+trap 'rm -rf "$ROOT"' EXIT
+FAILED=0
+
+fail() {
+    echo "  $*" >&2
+    return 1
+}
+
+# Детерминированное наполнение: текст, двоичные данные и таблица чисел.
+make_inputs() {
+    mkdir -p src/sub
+    i=0
+    while [ $i -lt 2000 ]; do echo "line $i of a fairly repetitive text file"; i=$((i + 1)); done > src/text.txt
+    head -c 300000 /dev/urandom > src/random.bin
+    printf '\350\021\042\350\370\000\000\000\351\377\377\377\377\350\000\000\000\000' > src/calls.bin
+    cat src/calls.bin src/calls.bin src/text.txt src/calls.bin > src/sub/calls2.bin
+    awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%08d", i * 7 }' > src/sub/table.dat
+    : > src/empty
+}
+
+# Распаковывает архив $1 в каталог $2 (остальные аргументы — unpack) и сверяет с src.
+check_unpack() {
+    archive=$1
+    out=$2
+    shift 2
+    rm -rf "$out"
+    "$TOOL" unpack "$archive" -o "$out" "$@" > /dev/null || fail "unpack $archive failed" || return 1
+    diff -r src "$out/src" > /dev/null || fail "unpacked $archive differs from src"
+}
+
+test_filters() {
+    make_inputs
+    for codec in lzma zstd lz4 none; do
+        for filter in auto none x86 arm64 delta delta:8; do
+            "$TOOL" pack $(find src -type f) -o a.makaka -c $codec -f $filter > /dev/null \
+                || fail "pack -c $codec -f $filter failed" || return 1
+            check_unpack a.makaka out || fail "-c $codec -f $filter" || return 1
+        done
+    done
+    for filter in deltaXYZ delta: delta:0 delta:257 delta:1x; do
+        if "$TOOL" pack src/text.txt -o bad.makaka -f $filter > /dev/null 2>&1; then
+            fail "-f $filter was accepted"
+            return 1
+        fi
+    done
+}
+
+test_ionice() {
+    make_inputs
+    for ionice in idle be be:0 be:7; do
+        "$TOOL" pack src/text.txt -o a.makaka --ionice=$ionice > /dev/null || fail "--ionice=$ionice failed" || return 1
+    done
+    for ionice in bexyz be7 be: be:8 be:9 be:3x be:-1 be:07 rt idle:1; do
+        if "$TOOL" pack src/text.txt -o bad.makaka --ionice=$ionice > /dev/null 2>&1; then
+            fail "--ionice=$ionice was accepted"
+            return 1
+        fi
+    done
+}
+
+test_similarity_order() {
+    mkdir -p src
+    head -c 200000 /dev/urandom > src/a1.bin
+    head -c 200000 /dev/urandom > src/b1.bin
+    { head -c 100 /dev/urandom; cat src/a1.bin; } > src/a2.bin
+    { cat src/b1.bin; head -c 100 /dev/urandom; } > src/b2.bin
+    head -c 200000 /dev/urandom > src/c1.bin
+    "$TOOL" pack src/a1.bin src/b1.bin src/c1.bin src/a2.bin src/b2.bin -o a.makaka --order=similarity > /dev/null \
+        || fail "pack --order=similarity failed" || return 1
+    order=$("$TOOL" unpack a.makaka -o out -v | sed -n 's/^Extracting src\/\([a-z0-9]*\)\.bin.*/\1/p' | tr '\n' ' ')
+    [ "$order" = "a1 a2 b1 b2 c1 " ] || fail "unexpected entry order: $order" || return 1
+    check_unpack a.makaka out
+}
+
+# Пачки мелких файлов, средние и разбитые на куски записи при крошечном бюджете и любом порядке
+# чтения: нужная запись не должна ждать остальных.
+test_pipeline_orders() {
+    make_inputs
+    head -c 3000000 /dev/urandom > src/big.bin
+    head -c 1500000 /dev/urandom > src/medium.bin
+    i=0
+    while [ $i -lt 50 ]; do echo "small $i" > src/sub/s$i; i=$((i + 1)); done
+    files=$(find src -type f | sort -r)
+    for order in args physical; do
+        for chunk in 0 256K; do
+            "$TOOL" pack $files -o a.makaka --read-order=$order --prefetch=1 --chunk-size=$chunk -j 3 > /dev/null \
+                || fail "pack --read-order=$order --chunk-size=$chunk failed" || return 1
+            check_unpack a.makaka out || return 1
+        done
+    done
+}
+
+# Пропавший вход пропускается с предупреждением, ошибка чтения (EIO на /proc/self/mem) прерывает
+# упаковку.
+test_input_errors() {
+    make_inputs
+    "$TOOL" pack src/text.txt missing.txt -o a.makaka > /dev/null 2> err.txt || fail "missing input failed pack" || return 1
+    grep -q "Skipping missing file missing.txt" err.txt || fail "no warning for missing input" || return 1
+    [ -r /proc/self/mem ] || return 0
+    # Большой вход перед плохим: к ошибке часть нового архива уже записана.
+    head -c 6000000 /dev/urandom > big.bin
+    for repository in "" --repository=repo; do
+        if "$TOOL" pack big.bin /proc/self/mem -o b.makaka -c none $repository > /dev/null 2>&1; then
+            fail "unreadable input was skipped silently ($repository)"
+            return 1
+        fi
+        [ ! -e b.makaka ] && [ ! -e b.makaka.tmp ] || fail "failed pack left a file ($repository)" || return 1
+    done
+
+    # Неудачная упаковка поверх готового архива (в том числе многотомного) оставляет его прежним.
+    mkdir -p d1 d2
+    for args in "" "--volume-size=64K --volume-dirs=d1,d2"; do
+        rm -f a.makaka
+        "$TOOL" pack $(find src -type f) -o a.makaka $args > /dev/null || fail "pack $args failed" || return 1
+        find . -name 'a.makaka*' -type f -exec cksum {} + | sort > before.txt
+        if "$TOOL" pack big.bin /proc/self/mem -o a.makaka -c none $args > /dev/null 2>&1; then
+            fail "unreadable input was skipped silently ($args)"
+            return 1
+        fi
+        find . -name 'a.makaka*' -type f -exec cksum {} + | sort > after.txt
+        cmp -s before.txt after.txt || fail "failed pack $args changed the previous archive" || return 1
+        check_unpack a.makaka out $args || fail "previous archive $args" || return 1
+    done
+}
+
+# Неудачная распаковка записи по частям не оставляет на её месте файл (или временный файл).
+test_failed_unpack_leaves_no_file() {
+    mkdir -p src
+    head -c 300000 /dev/urandom > src/a.bin
+    "$TOOL" pack src/a.bin -o r.makaka --repository=repo > /dev/null || fail "pack --repository failed" || return 1
+    rm -f repo/packs/*
+    if "$TOOL" unpack r.makaka -o out --repository=repo > /dev/null 2>&1; then
+        fail "unpack with missing chunks succeeded"
+        return 1
+    fi
+    [ -z "$(ls -A out/src 2>/dev/null)" ] || fail "left behind: $(ls -A out/src)" || return 1
+
+    awk 'BEGIN { for (i = 0; i < 100000; i++) printf "%d,", i * i }' > src/b.txt
+    "$TOOL" pack src/b.txt -o c.makaka -c lzma --chunk-size=64K > /dev/null || fail "pack --chunk-size failed" || return 1
+    size=$(wc -c < c.makaka)
+    printf 'garbage!garbage!garbage!' | dd of=c.makaka bs=1 seek=$((size / 2)) conv=notrunc 2> /dev/null
+    if "$TOOL" unpack c.makaka -o out2 > /dev/null 2>&1; then
+        fail "unpack of a corrupted chunk succeeded"
+        return 1
+    fi
+    [ -z "$(ls -A out2/src 2>/dev/null)" ] || fail "left behind: $(ls -A out2/src)"
+}
+
+test_resume_after_interruption() {
+    mkdir -p src
+    for i in 1 2 3; do head -c 700000 /dev/urandom > src/f$i.bin; done
+    "$TOOL" pack src/f1.bin -o plain.makaka > /dev/null || fail "pack failed" || return 1
+    [ ! -e plain.makaka.ckpt ] || fail "checkpoint written without --checkpoint" || return 1
+
+    # --bwlimit растягивает упаковку на секунды: процесс убивается после первой точки.
+    "$TOOL" pack src/*.bin -o a.makaka --chunk-size=64K --checkpoint=1 --bwlimit=512K > /dev/null &
+    pid=$!
+    while [ ! -e a.makaka.ckpt ] && kill -0 $pid 2> /dev/null; do sleep 0.1; done
+    sleep 0.5
+    kill -9 $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    [ -e a.makaka.ckpt ] || fail "pack finished before its first checkpoint" || return 1
+    "$TOOL" pack src/*.bin -o a.makaka --chunk-size=64K --resume | grep -q '^Resuming' \
+        || fail "pack --resume did not resume" || return 1
+    [ ! -e a.makaka.ckpt ] || fail "checkpoint left after a finished pack" || return 1
+    check_unpack a.makaka out
+}
+
+test_duplicates() {
+    mkdir -p src/sub
+    head -c 200000 /dev/urandom > src/a.bin
+    cp src/a.bin src/sub/a.bin
+    # Разное содержимое с одинаковыми CRC64 и длиной: копией друг друга они не считаются.
+    printf '\155\141\153\141\153\141\055\143\157\154\154\151\163\151\157\156\055\101\072\000\000\000\000\000\000\000\000' > src/c1.bin
+    printf '\155\141\153\141\153\141\055\143\157\154\154\151\163\151\157\156\055\102\072\027\023\161\345\266\212\073\375' > src/c2.bin
+    "$TOOL" pack src/a.bin src/sub/a.bin src/c1.bin src/c2.bin -o a.makaka -c none -f none > /dev/null \
+        || fail "pack failed" || return 1
+    for mode in reflink hardlink; do
+        check_unpack a.makaka out-$mode --duplicates=$mode || fail "--duplicates=$mode" || return 1
+    done
+    "$TOOL" unpack a.makaka -o out-v --duplicates=hardlink -v | grep -q '^Linking src/sub/a.bin from src/a.bin' \
+        || fail "hardlinked copy not reported as Linking" || return 1
+    [ "$(stat -c %i out-v/src/a.bin)" = "$(stat -c %i out-v/src/sub/a.bin)" ] || fail "copy is not a hardlink" || return 1
+
+    # Повторная распаковка поверх жёстких ссылок не должна писать одну запись в файл другой.
+    head -c 7000 /dev/urandom > src/a.bin
+    head -c 7000 /dev/urandom > src/sub/a.bin
+    "$TOOL" pack src/a.bin src/sub/a.bin src/c1.bin src/c2.bin -o b.makaka > /dev/null || fail "repack failed" || return 1
+    for args in "" "--update" "--duplicates=none"; do
+        cp -al out-v out-again
+        "$TOOL" unpack b.makaka -o out-again $args > /dev/null || fail "unpack over hardlinks $args failed" || return 1
+        diff -r src out-again/src > /dev/null || fail "unpack over hardlinks $args corrupted files" || return 1
+        ls -A out-again/src | grep -q makaka-part && fail "temporary file left behind" && return 1
+        rm -rf out-again
+    done
+}
+
+test_repository_gc() {
+    make_inputs
+    head -c 2000000 /dev/urandom > extra.bin
+    "$TOOL" pack $(find src -type f) -o a.makaka --repository=repo -c none > /dev/null || fail "pack a failed" || return 1
+    "$TOOL" pack $(find src -type f) extra.bin -o b.makaka --repository=repo -c none > /dev/null \
+        || fail "pack b failed" || return 1
+
+    # a удалён: gc убирает только куски, на которые больше никто не ссылается.
+    rm a.makaka
+    "$TOOL" gc repo > gc.log || fail "gc failed" || return 1
+    grep -q '^Archives: 1 (1 removed)' gc.log || fail "gc did not forget a.makaka" || return 1
+    rm -rf out
+    "$TOOL" unpack b.makaka -o out --repository=repo > /dev/null || fail "unpack after gc failed" || return 1
+    diff -r src out/src > /dev/null && cmp -s extra.bin out/extra.bin || fail "b.makaka differs after gc" || return 1
+
+    # Испорченный кусок (кодек none распаковывает его без ошибки) отвергается по id.
+    pack=$(ls repo/packs/* | head -n 1)
+    size=$(wc -c < "$pack")
+    printf 'garbage!' | dd of="$pack" bs=1 seek=$((size / 2)) conv=notrunc 2> /dev/null
+    if "$TOOL" unpack b.makaka -o out2 --repository=repo > /dev/null 2>&1; then
+        fail "unpack of a corrupted chunk succeeded"
+    fi
+}
+
+test_retier() {
+    make_inputs
+    "$TOOL" pack $(find src -type f) -o a.makaka -c lzma --chunk-size=64K > /dev/null || fail "pack failed" || return 1
+    "$TOOL" retier a.makaka src/random.bin -o b.makaka --hot=lz4 --cold=zstd > /dev/null || fail "retier failed" || return 1
+    check_unpack b.makaka out || fail "retiered archive" || return 1
+    if "$TOOL" retier a.makaka src/text.txt -o h.makaka --hot=lz4hc --cold=lz4 > /dev/null 2>&1; then
+        fail "retier with two presets of one codec succeeded"
+        return 1
+    fi
+
+    # Испорченная запись после 6 МБ скопированных: retier падает, не оставив на месте вывода ничего.
+    head -c 6000000 /dev/urandom > big.bin
+    awk 'BEGIN { for (i = 0; i < 100000; i++) printf "%d,", i * i }' > squares.txt
+    "$TOOL" pack big.bin squares.txt -o c.makaka -c none --chunk-size=64K > /dev/null || fail "pack -c none failed" || return 1
+    "$TOOL" retier c.makaka squares.txt -o d.makaka --hot=lzma --cold=lz4 > /dev/null || fail "retier to lzma failed" || return 1
+    size=$(wc -c < d.makaka)
+    printf 'garbage!garbage!garbage!' | dd of=d.makaka bs=1 seek=$((size - 20000)) conv=notrunc 2> /dev/null
+    if "$TOOL" retier d.makaka squares.txt -o e.makaka --hot=zstd --cold=lz4 > /dev/null 2>&1; then
+        fail "retier of a corrupted chunk succeeded"
+        return 1
+    fi
+    [ ! -e e.makaka ] && [ ! -e e.makaka.tmp ] || fail "failed retier left a file" || return 1
+
+    # Архив со ссылками на хранилище: копия регистрируется в нём и переживает gc после удаления оригинала.
+    "$TOOL" pack $(find src -type f) -o r.makaka --repository=repo > /dev/null || fail "pack --repository failed" || return 1
+    if "$TOOL" retier r.makaka -o r2.makaka > /dev/null 2>&1; then
+        fail "retier of a repository archive without --repository succeeded"
+        return 1
+    fi
+    "$TOOL" retier r.makaka -o r2.makaka --repository=repo > /dev/null || fail "retier --repository failed" || return 1
+    # Зарегистрированный, но так и не записанный архив gc просто забывает.
+    if "$TOOL" retier r.makaka -o missing/r3.makaka --repository=repo > /dev/null 2>&1; then
+        fail "retier into a missing directory succeeded"
+        return 1
+    fi
+    rm r.makaka
+    "$TOOL" gc repo | grep -q '^Archives: 1 (2 removed)' || fail "gc failed" || return 1
+    check_unpack r2.makaka out2 --repository=repo || fail "retiered repository archive after gc"
+}
+
+test_update() {
+    make_inputs
+    "$TOOL" pack $(find src -type f) -o a.makaka > /dev/null || fail "pack failed" || return 1
+    check_unpack a.makaka out || return 1
+    n=$(find src -type f | wc -l)
+
+    "$TOOL" unpack a.makaka -o out --update | grep -q "^Up to date: $n, extracted: 0" \
+        || fail "unchanged tree was extracted again" || return 1
+
+    # Другой размер и другое время изменения при том же размере — распаковываются заново.
+    echo tail >> out/src/random.bin
+    touch -d '2001-01-01' out/src/sub/table.dat
+    "$TOOL" unpack a.makaka -o out --update | grep -q "^Up to date: $((n - 2)), extracted: 2" \
+        || fail "--update missed changed files" || return 1
+    diff -r src out/src > /dev/null || fail "--update did not restore src" || return 1
+
+    # checksum: время изменения не важно, подменённый байт при том же размере — важен.
+    touch -d '2001-01-01' out/src/text.txt
+    printf 'X' | dd of=out/src/sub/table.dat bs=1 seek=100 conv=notrunc 2> /dev/null
+    "$TOOL" unpack a.makaka -o out --update=checksum | grep -q "^Up to date: $((n - 1)), extracted: 1" \
+        || fail "--update=checksum miscounted" || return 1
+    diff -r src out/src > /dev/null || fail "--update=checksum did not restore src"
+}
+
+# Тома по 64 КиБ по кругу в двух ещё не созданных каталогах; записи пересекают границы томов.
+test_volumes() {
+    make_inputs
+    dirs=--volume-dirs=d1,d2
+    "$TOOL" pack $(find src -type f) -o v.makaka -c none --volume-size=64K $dirs > /dev/null || fail "pack failed" || return 1
+    [ ! -e v.makaka ] || fail "single-file archive written" || return 1
+    n=$(ls d1 d2 | grep -c '^v\.makaka\.[0-9]*$')
+    [ "$n" -ge 6 ] || fail "only $n volumes" || return 1
+    v=1
+    while [ $v -le $n ]; do
+        dir=d$(( (v - 1) % 2 + 1 ))
+        file=$dir/$(printf 'v.makaka.%03d' $v)
+        [ -f "$file" ] || fail "$file missing" || return 1
+        size=$(wc -c < "$file")
+        if [ $v -lt $n ]; then
+            [ "$size" -eq 65536 ] || fail "$file has $size bytes" || return 1
+        else
+            [ "$size" -le 65536 ] || fail "last volume has $size bytes" || return 1
+        fi
+        v=$((v + 1))
+    done
+
+    check_unpack v.makaka out $dirs || return 1
+    check_unpack d1/v.makaka.001 out2 $dirs || fail "unpack by the first volume" || return 1
+    # Индекс в последнем томе, данные записи — в нескольких.
+    "$TOOL" list v.makaka $dirs | grep -q '^src/random.bin (300000 bytes' || fail "list failed" || return 1
+    rm -rf out3
+    "$TOOL" unpack v.makaka src/random.bin -o out3 $dirs > /dev/null || fail "selective unpack failed" || return 1
+    cmp -s src/random.bin out3/src/random.bin || fail "entry across volumes differs" || return 1
+
+    if "$TOOL" unpack v.makaka -o out4 > /dev/null 2>&1; then fail "unpack without --volume-dirs succeeded"; return 1; fi
+    mkdir away && mv d2/v.makaka.002 away/
+    if "$TOOL" unpack v.makaka -o out4 $dirs > /dev/null 2>&1; then fail "unpack with a missing volume succeeded"; return 1; fi
+}
+
+test_catalog_find() {
+    make_inputs
+    echo extra > extra.txt
+    mkdir -p arch
+    "$TOOL" pack $(find src -type f) -o arch/a.makaka > /dev/null || fail "pack a failed" || return 1
+    "$TOOL" pack src/text.txt extra.txt -o arch/b.makaka > /dev/null || fail "pack b failed" || return 1
+    "$TOOL" pack $(find src -type f) -o arch/v.makaka --volume-size=64K --volume-dirs=arch/d1,arch/d2 > /dev/null \
+        || fail "pack volumes failed" || return 1
+    dirs=--volume-dirs=arch/d1,arch/d2
+
+    "$TOOL" catalog arch -o c.cat $dirs 2> err.txt | grep -q '^Catalog c.cat: 3 archives (3 scanned, 0 unchanged, 0 removed)' \
+        || fail "catalog miscounted" || return 1
+    [ ! -s err.txt ] || fail "catalog: $(cat err.txt)" || return 1
+    [ "$("$TOOL" locate c.cat src/text.txt | wc -l)" -eq 3 ] || fail "locate missed an archive" || return 1
+    "$TOOL" locate c.cat extra.txt | grep -q '^extra.txt: arch/b.makaka @ ' || fail "locate extra.txt failed" || return 1
+    if "$TOOL" locate c.cat nope > found.txt; then fail "locate of a missing entry succeeded"; return 1; fi
+    grep -qx 'nope: not found' found.txt || fail "locate of a missing entry printed $(cat found.txt)" || return 1
+
+    # Повторно сканируется только изменившийся архив, удалённый выпадает из каталога.
+    "$TOOL" pack src/text.txt src/empty -o arch/b.makaka > /dev/null || fail "repack b failed" || return 1
+    rm arch/a.makaka
+    "$TOOL" catalog arch -o c.cat $dirs | grep -q '^Catalog c.cat: 2 archives (1 scanned, 1 unchanged, 1 removed)' \
+        || fail "incremental catalog miscounted" || return 1
+    [ "$("$TOOL" locate c.cat src/text.txt | wc -l)" -eq 2 ] || fail "locate after update" || return 1
+    if "$TOOL" locate c.cat extra.txt > /dev/null; then fail "stale entry left in the catalog"; return 1; fi
+
+    "$TOOL" find arch --name=src/empty $dirs > found.txt 2> err.txt || fail "find --name failed" || return 1
+    [ ! -s err.txt ] || fail "find: $(cat err.txt)" || return 1
+    sort found.txt > sorted.txt
+    printf 'arch/b.makaka: src/empty\narch/d1/v.makaka.001: src/empty\n' | cmp -s - sorted.txt \
+        || fail "find --name: $(cat found.txt)" || return 1
+    "$TOOL" find arch --content=src/sub/calls2.bin $dirs | grep -qx 'arch/d1/v.makaka.001: src/sub/calls2.bin (content)' \
+        || fail "find --content missed the volumes" || return 1
+    if "$TOOL" find arch --name=nope $dirs > found.txt || [ -s found.txt ]; then fail "find of a missing name"; return 1; fi
+    if "$TOOL" find arch --content=extra.txt $dirs > found.txt || [ -s found.txt ]; then
+        fail "find of missing content"
+        return 1
+    fi
+}
+
+# Запросы по сокету идут подряд без ожидания ответов: perl serve_pipeline.pl <сокет> <архив> <запись>
+# <раз> <ожидаемый файл> шлёт столько чтений записи и одно чтение несуществующей, ждёт секунду
+# (вывод сервера упирается в предел) и сверяет все ответы.
+write_pipeline_client() {
+    cat > serve_pipeline.pl <<'PERL'
+use strict;
+use IO::Socket::UNIX;
+my ($socket, $archive, $name, $count, $expected) = @ARGV;
+open(my $file, '<:raw', $expected) or die "$expected: $!";
+my $want = do { local $/; <$file> };
+my $s = IO::Socket::UNIX->new(Peer => $socket) or die "connect: $!";
+my $request = sub { pack('VCx3VVQ<Q<', 0x4D4B5251, 3, length $archive, length $_[0], 0, ~0) . $archive . $_[0] };
+my $message = $request->($name) x $count . $request->('missing');
+for (my $done = 0; $done < length $message;) {
+    $done += syswrite($s, $message, length($message) - $done, $done) // die "write: $!";
+}
+sleep 1;
+my $take = sub {
+    my $data = '';
+    while (length $data < $_[0]) { sysread($s, $data, $_[0] - length $data, length $data) or die "short read" }
+    return $data;
+};
+for my $i (0 .. $count) {
+    my ($status, $size) = unpack('Vx4Q<', $take->(16));
+    my $payload = $take->($size);
+    if ($i < $count) { die "response $i: status $status" unless $status == 0 && $payload eq $want }
+    else { die "missing entry: status $status" unless $status == 2 }
+}
+PERL
+}
+
+test_serve() {
+    make_inputs
+    head -c 1048576 /dev/urandom > src/mib.bin
+    "$TOOL" pack $(find src -type f) -o a.makaka --chunk-size=64K > /dev/null || fail "pack failed" || return 1
+    cp a.makaka b.makaka
+    "$TOOL" serve s.sock a.makaka --cache=1 --access-log=access.log > serve.log &
+    pid=$!
+    # Тест идёт в подоболочке: сервер останавливается и при провале проверки.
+    trap 'kill $pid 2> /dev/null' EXIT
+    while [ ! -S s.sock ] && kill -0 $pid 2> /dev/null; do sleep 0.1; done
+    [ -S s.sock ] || fail "serve did not start" || return 1
+
+    [ "$("$TOOL" client s.sock list a.makaka | wc -l)" -eq "$(find src -type f | wc -l)" ] \
+        || fail "list is incomplete" || return 1
+    "$TOOL" client s.sock stat a.makaka src/random.bin | grep -q '^src/random.bin (300000 bytes' \
+        || fail "stat is wrong" || return 1
+    for name in src/text.txt src/random.bin src/empty; do
+        "$TOOL" client s.sock read a.makaka $name -o got || fail "read $name failed" || return 1
+        cmp -s $name got || fail "read $name returned other bytes" || return 1
+    done
+    # Диапазоны: через границу кусков, длина за концом обрезается, смещение за концом — пусто.
+    "$TOOL" client s.sock read a.makaka src/random.bin 65000 1000 -o got || fail "read range failed" || return 1
+    tail -c +65001 src/random.bin | head -c 1000 | cmp -s - got || fail "range across chunks differs" || return 1
+    "$TOOL" client s.sock read a.makaka src/random.bin 299990 100 -o got || fail "read tail failed" || return 1
+    tail -c 10 src/random.bin | cmp -s - got || fail "length not clamped" || return 1
+    "$TOOL" client s.sock read a.makaka src/random.bin 400000 -o got || fail "read past end failed" || return 1
+    [ ! -s got ] || fail "offset past the end returned data" || return 1
+
+    if "$TOOL" client s.sock stat a.makaka nope 2> err.txt; then fail "stat of a missing entry succeeded"; return 1; fi
+    grep -q 'Entry not found: nope' err.txt || fail "no error for a missing entry" || return 1
+    if "$TOOL" client s.sock list b.makaka 2> err.txt; then fail "list of an unserved archive succeeded"; return 1; fi
+    grep -q 'Archive not served: b.makaka' err.txt || fail "no error for an unserved archive" || return 1
+
+    # 24 ответа по МиБ — больше предела вывода в 16 МиБ: остальные запросы разбираются после отправки.
+    if command -v perl > /dev/null; then
+        write_pipeline_client
+        perl serve_pipeline.pl s.sock a.makaka src/mib.bin 24 src/mib.bin || fail "pipelined requests failed" || return 1
+    fi
+
+    kill -TERM $pid
+    wait $pid || fail "serve exited with an error" || return 1
+    [ ! -e s.sock ] || fail "socket left behind" || return 1
+    grep -q "^Cache: " serve.log || fail "no cache statistics" || return 1
+    # Чтения (и за концом записи) считаются, stat — нет.
+    printf '4\t%s\tsrc/random.bin\n' "$PWD/a.makaka" | grep -qxF -f - access.log \
+        || fail "access log does not count reads of src/random.bin" || return 1
+}
+
+TESTS=$(sed -n 's/^test_\([a-z_0-9]*\)() {$/\1/p' "$0")
+[ $# -gt 0 ] && TESTS="$*"
+for name in $TESTS; do
+    dir="$ROOT/$name"
+    mkdir -p "$dir"
+    if (cd "$dir" && "test_$name"); then
+        echo "PASS $name"
+    else
+        echo "FAIL $name"
+        FAILED=1
+    fi
+done
+exit $FAILED
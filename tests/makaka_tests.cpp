@@ -0,0 +1,617 @@
+// Тесты библиотеки makaka. Без аргументов запускает все, иначе — названные; код возврата 0 —
+// все проверки прошли.
+#include "makaka.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <functional>
+#include <fstream>
+#include <future>
+#include <cstdio>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+std::vector<TestCase>& testCases() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+struct TestRegistration {
+    TestRegistration(const char* name, void (*run)()) { testCases().push_back({name, run}); }
+};
+
+int failures = 0;
+
+#define TEST(name)                                             \
+    void test_##name();                                        \
+    TestRegistration register_##name(#name, test_##name);      \
+    void test_##name()
+
+#define CHECK(condition)                                                                   \
+    do {                                                                                   \
+        if (!(condition)) {                                                                \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed\n"; \
+            ++failures;                                                                    \
+        }                                                                                  \
+    } while (0)
+
+// Детерминированные псевдослучайные данные.
+std::vector<uint8_t> randomBytes(size_t size, uint64_t seed) {
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) data[i] = static_cast<uint8_t>(mix64(seed + i));
+    return data;
+}
+
+// Временный файл, удаляемый вместе с sidecar в деструкторе.
+struct TempFile {
+    std::string path;
+    explicit TempFile(const std::string& name)
+        : path((getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp") + std::string("/makaka-test-") + std::to_string(getpid()) + "-" + name) {}
+    ~TempFile() {
+        std::remove(path.c_str());
+        std::remove(sidecarPath(path).c_str());
+    }
+};
+
+bool fileExists(const std::string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+void writeFile(const std::string& path, const std::string& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    if (!out) throw std::runtime_error("Failed to write " + path);
+}
+
+// Архив версии 2.0 (без встроенного индекса) из несжатых записей.
+std::string legacyArchive(const std::vector<std::pair<std::string, std::string>>& entries) {
+    std::string archive;
+    appendPod(archive, MAKAKA_SIGNATURE);
+    appendPod(archive, MAKAKA_VERSION_2_0);
+    appendPod(archive, static_cast<uint16_t>(COMPRESS_NONE));
+    appendPod(archive, static_cast<uint32_t>(entries.size()));
+    std::string previous;
+    for (const auto& entry : entries) {
+        EntryHeader header;
+        header.name = entry.first;
+        header.original_size = header.compressed_size = entry.second.size();
+        archive += encodeEntryHeader(previous, header) + entry.second;
+        previous = entry.first;
+    }
+    return archive;
+}
+
+// Архив текущей версии со встроенным индексом, сжатый ZSTD; записи больше chunk_size хранятся
+// кусками (ENTRY_CHUNKED).
+std::string indexedArchive(const std::vector<std::pair<std::string, std::vector<uint8_t>>>& entries,
+                           uint32_t chunk_size) {
+    const uint16_t compression = COMPRESS_ZSTD;
+    std::string archive;
+    appendPod(archive, MAKAKA_SIGNATURE);
+    appendPod(archive, MAKAKA_VERSION);
+    appendPod(archive, compression);
+    appendPod(archive, static_cast<uint32_t>(entries.size()));
+
+    std::vector<IndexEntry> index_entries;
+    std::string previous;
+    for (const auto& entry : entries) {
+        EntryHeader header;
+        header.name = entry.first;
+        header.original_size = entry.second.size();
+        std::string data;
+        if (entry.second.size() > chunk_size) {
+            header.flags = ENTRY_CHUNKED;
+            std::vector<uint32_t> sizes;
+            std::string chunks;
+            for (size_t offset = 0; offset < entry.second.size(); offset += chunk_size) {
+                std::vector<uint8_t> chunk(entry.second.begin() + offset,
+                                           entry.second.begin() + std::min<size_t>(offset + chunk_size, entry.second.size()));
+                std::vector<uint8_t> stored = encodeEntryData(compression, 3, EntryFilter(), chunk);
+                sizes.push_back(static_cast<uint32_t>(stored.size()));
+                chunks.append(stored.begin(), stored.end());
+            }
+            data = encodeChunkTable(chunk_size, sizes) + chunks;
+        } else {
+            std::vector<uint8_t> copy = entry.second;
+            std::vector<uint8_t> stored = encodeEntryData(compression, 3, EntryFilter(), copy);
+            data.assign(stored.begin(), stored.end());
+        }
+        header.compressed_size = data.size();
+        archive += encodeEntryHeader(previous, header);
+
+        IndexEntry index_entry;
+        index_entry.name = entry.first;
+        index_entry.record = {};
+        index_entry.record.data_offset = archive.size();
+        index_entry.record.original_size = header.original_size;
+        index_entry.record.compressed_size = header.compressed_size;
+        index_entry.record.archive_position = static_cast<uint32_t>(index_entries.size());
+        index_entry.record.flags = recordFlags(header);
+        index_entries.push_back(index_entry);
+        archive += data;
+        previous = entry.first;
+    }
+
+    ArchiveFooter footer = {archive.size(), 0, FOOTER_MAGIC};
+    std::string index = buildCentralIndex(index_entries);
+    footer.index_size = index.size();
+    archive += index;
+    appendPod(archive, footer);
+    return archive;
+}
+
+bool filterRoundTrip(const std::vector<uint8_t>& original, EntryFilter filter) {
+    std::vector<uint8_t> data = original;
+    applyFilter(data, filter, true);
+    applyFilter(data, filter, false);
+    return data == original;
+}
+
+TEST(x86_filter_overlapping_calls) {
+    EntryFilter x86;
+    x86.type = FILTER_X86;
+    // E8 с неподходящим старшим байтом (0xF8), за которым в пределах четырёх байт идёт E8: его
+    // перевод (0xF8 + 8) делает этот старший байт нулевым.
+    std::vector<uint8_t> overlap = {0xE8, 0x11, 0x22, 0xE8, 0xF8, 0x00, 0x00, 0x00, 0x90, 0x90};
+    CHECK(filterRoundTrip(overlap, x86));
+    std::vector<uint8_t> chain(64, 0xE8);
+    CHECK(filterRoundTrip(chain, x86));
+
+    // Плотные E8/E9 вперемешку с 0x00/0xFF — все варианты перекрытий.
+    const uint8_t alphabet[] = {0xE8, 0xE9, 0x00, 0xFF, 0x12, 0x80};
+    for (uint64_t seed = 0; seed < 200; ++seed) {
+        std::vector<uint8_t> data(4096);
+        for (size_t i = 0; i < data.size(); ++i) data[i] = alphabet[mix64(seed * 4096 + i) % sizeof(alphabet)];
+        CHECK(filterRoundTrip(data, x86));
+    }
+}
+
+TEST(filters_round_trip) {
+    std::vector<uint8_t> data = randomBytes(100000, 1);
+    for (FilterType type : {FILTER_NONE, FILTER_X86, FILTER_ARM64, FILTER_DELTA}) {
+        for (uint8_t param : {0, 3, 255}) {
+            EntryFilter filter;
+            filter.type = type;
+            filter.param = param;
+            CHECK(filterRoundTrip(data, filter));
+        }
+    }
+}
+
+TEST(codecs_round_trip) {
+    std::vector<std::vector<uint8_t>> inputs = {{}, {42}, randomBytes(200000, 2), std::vector<uint8_t>(300000, 'a')};
+    std::string text;
+    for (int i = 0; i < 5000; ++i) text += "entry " + std::to_string(i * 7) + "\n";
+    inputs.emplace_back(text.begin(), text.end());
+    for (const char* name : {"none", "lzma", "zstd", "lz4", "lz4hc"}) {
+        const CodecPreset* preset = findCodecPreset(name);
+        CHECK(preset != nullptr);
+        if (!preset) continue;
+        CHECK(findCodec(preset->compression) != nullptr);
+        for (FilterType type : {FILTER_NONE, FILTER_X86, FILTER_DELTA}) {
+            EntryFilter filter;
+            filter.type = type;
+            for (const auto& input : inputs) {
+                std::vector<uint8_t> data = input;
+                std::vector<uint8_t> stored = encodeEntryData(preset->compression, preset->level, filter, data);
+                CHECK(decodeEntryData(preset->compression, filter, input.size(), stored) == input);
+            }
+        }
+    }
+}
+
+TEST(index_lookup) {
+    // Имена с длинными общими префиксами (фронтальное кодирование) в нескольких блоках.
+    std::vector<IndexEntry> entries;
+    for (uint64_t i = 0; i < 5000; ++i) {
+        IndexEntry entry;
+        entry.name = "dir" + std::to_string(i % 37) + "/file" + std::to_string(i);
+        entry.record.data_offset = 1000 + i;
+        entry.record.original_size = i;
+        entries.push_back(entry);
+    }
+    std::vector<std::string> names;
+    for (const auto& entry : entries) names.push_back(entry.name);
+
+    for (bool with_hash_index : {false, true}) {
+        std::vector<IndexEntry> sorted = entries;
+        std::string data = buildCentralIndex(sorted, with_hash_index);
+        ArchiveIndex index(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+        CHECK(index.size() == entries.size());
+        CHECK(index.hasHashIndex() == with_hash_index);
+
+        std::string previous;
+        uint64_t count = 0;
+        index.forEach([&](const std::string& name, const IndexRecord& record) {
+            CHECK(count == 0 || previous < name);
+            CHECK(record.data_offset == 1000 + record.original_size);
+            previous = name;
+            ++count;
+        });
+        CHECK(count == entries.size());
+
+        for (size_t i = 0; i < names.size(); ++i) {
+            IndexRecord found, looked_up;
+            CHECK(index.find(names[i], found) && found.data_offset == 1000 + i);
+            CHECK(index.lookup(names[i], looked_up) && looked_up.data_offset == 1000 + i);
+        }
+        IndexRecord record;
+        for (const char* missing : {"", "dir0", "dir0/file", "dir0/file00", "zzz", "dir1/file1x"}) {
+            CHECK(!index.find(missing, record));
+            CHECK(!index.lookup(missing, record));
+        }
+    }
+
+    // Повторяющееся имя: find и lookup (с хеш-таблицей и без) дают первое вхождение, даже если
+    // повторы тянутся через несколько групп рестарта и блоков или начинают блок.
+    for (uint64_t before : {0u, 5u, 100u, INDEX_BLOCK_ENTRIES, INDEX_BLOCK_ENTRIES + INDEX_RESTART_INTERVAL}) {
+        for (uint64_t copies : {2, 40, 300}) {
+            std::vector<IndexEntry> duplicates;
+            for (uint64_t i = 0; i < before; ++i) {
+                IndexEntry entry;
+                entry.name = "a" + std::to_string(1000 + i);
+                entry.record.data_offset = 1000 + i;
+                duplicates.push_back(entry);
+            }
+            for (uint64_t i = 0; i < copies; ++i) {
+                IndexEntry entry;
+                entry.name = "dup";
+                entry.record.data_offset = i;
+                duplicates.push_back(entry);
+            }
+            IndexEntry last;
+            last.name = "z";
+            last.record.data_offset = 5000;
+            duplicates.push_back(last);
+
+            for (bool with_hash_index : {false, true}) {
+                std::vector<IndexEntry> sorted = duplicates;
+                std::string data = buildCentralIndex(sorted, with_hash_index);
+                ArchiveIndex index(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+                IndexRecord found, looked_up;
+                CHECK(index.find("dup", found) && found.data_offset == 0);
+                CHECK(index.lookup("dup", looked_up) && looked_up.data_offset == 0);
+                CHECK(index.find("z", found) && found.data_offset == 5000);
+                CHECK(!index.find("dupe", found) && !index.find("du", found));
+                if (before > 0) CHECK(index.find("a1000", found) && found.data_offset == 1000);
+            }
+        }
+    }
+}
+
+// Блок, из которого распаковывается больше имён, чем у него записей, отвергается как повреждённый
+// и не читает записи за пределами массива.
+TEST(index_rejects_overlong_block) {
+    std::vector<IndexEntry> entries;
+    for (uint64_t i = 0; i < 200; ++i) {
+        IndexEntry entry;
+        entry.name = "file" + std::to_string(1000 + i);
+        entry.record.data_offset = i;
+        entries.push_back(entry);
+    }
+    std::string valid = buildCentralIndex(entries);
+    IndexHeader header;
+    std::memcpy(&header, valid.data(), sizeof(header));
+
+    // Меньше записей, чем имён в блоках; меньше записей на блок, чем в первом блоке имён.
+    IndexHeader fewer_entries = header;
+    fewer_entries.entry_count = 150;
+    IndexHeader fewer_per_block = header;
+    fewer_per_block.block_entries = 100;
+    // Имя, номер которого выходит за подделанный предел.
+    std::vector<std::pair<IndexHeader, std::string>> cases = {{fewer_entries, "file1199"}, {fewer_per_block, "file1110"}};
+    for (const auto& [forged, past_limit] : cases) {
+        std::string data = valid;
+        std::memcpy(&data[0], &forged, sizeof(forged));
+        ArchiveIndex index(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+
+        std::string error;
+        try {
+            index.forEach([](const std::string&, const IndexRecord&) {});
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+        CHECK(error == "Corrupted index: bad block");
+
+        error.clear();
+        IndexRecord record;
+        try {
+            index.find(past_limit, record);
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+        CHECK(error == "Corrupted index: bad block");
+    }
+}
+
+TEST(sidecar_written_only_on_request) {
+    TempFile file("legacy.makaka");
+    writeFile(file.path, legacyArchive({{"a", "alpha"}, {"b/c", "gamma"}}));
+    {
+        IndexedArchive archive(file.path);
+        CHECK(archive.source() == INDEX_IN_MEMORY);
+        IndexRecord record;
+        CHECK(archive.index().lookup("b/c", record));
+        std::vector<uint8_t> data = archive.readCompressed(record);
+        CHECK(std::string(data.begin(), data.end()) == "gamma");
+    }
+    CHECK(!fileExists(sidecarPath(file.path)));
+
+    bool threw = false;
+    try {
+        IndexedArchive archive(file.path, INDEX_BUILD_NONE);
+    } catch (const std::exception&) {
+        threw = true;
+    }
+    CHECK(threw);
+
+    {
+        IndexedArchive archive(file.path, INDEX_BUILD_SIDECAR);
+        CHECK(archive.source() == INDEX_SIDECAR);
+    }
+    CHECK(fileExists(sidecarPath(file.path)));
+    IndexedArchive archive(file.path, INDEX_BUILD_NONE);
+    CHECK(archive.source() == INDEX_SIDECAR);
+    CHECK(archive.index().size() == 2);
+}
+
+// Один ArchiveReader из нескольких потоков сразу: read и readRange по записям с кусками и без,
+// с кэшем и без, дают те же байты, что и последовательное чтение.
+TEST(reader_concurrent_reads) {
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> entries = {
+        {"chunked", randomBytes(300000, 3)},
+        {"empty", {}},
+        {"small", randomBytes(5000, 4)},
+        {"text", std::vector<uint8_t>(100000, 'x')},
+    };
+    TempFile file("concurrent.makaka");
+    writeFile(file.path, indexedArchive(entries, 64 << 10));
+    {
+        IndexedArchive archive(file.path);
+        IndexRecord record;
+        CHECK(archive.index().lookup("chunked", record) && (record.flags & ENTRY_CHUNKED));
+        CHECK(archive.index().lookup("small", record) && !(record.flags & ENTRY_CHUNKED));
+    }
+
+    for (uint64_t cache_bytes : {0, 1 << 20}) {
+        auto cache = cache_bytes ? std::make_shared<BlockCache>(cache_bytes) : nullptr;
+        ArchiveReader reader(file.path, cache);
+        CHECK(reader.size() == entries.size());
+        std::vector<std::vector<uint8_t>> expected;
+        for (const auto& entry : entries) {
+            expected.push_back(reader.read(entry.first));
+            CHECK(expected.back() == entry.second);
+        }
+
+        std::atomic<int> mismatches{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; ++t) {
+            threads.emplace_back([&, t] {
+                for (uint64_t i = 0; i < 200; ++i) {
+                    size_t e = mix64(t * 1000 + i) % entries.size();
+                    const std::vector<uint8_t>& want = expected[e];
+                    if (i % 4 == 0) {
+                        if (reader.read(entries[e].first) != want) ++mismatches;
+                        continue;
+                    }
+                    // Диапазоны внутри куска, через границу кусков и за концом записи.
+                    uint64_t offset = want.empty() ? 0 : mix64(t * 7919 + i) % (want.size() + 100);
+                    uint64_t length = mix64(t * 104729 + i) % 150000;
+                    std::vector<uint8_t> range = reader.readRange(entries[e].first, offset, length);
+                    uint64_t from = std::min<uint64_t>(offset, want.size());
+                    uint64_t to = std::min<uint64_t>(from + length, want.size());
+                    if (range != std::vector<uint8_t>(want.begin() + from, want.begin() + to)) ++mismatches;
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        CHECK(mismatches == 0);
+    }
+}
+
+// Счётчики кэша при чтении диапазонов: запись без кусков кэшируется целиком, запись с кусками —
+// по кускам; вытесняются давно не читанные блоки, блок больше доли шарда не кэшируется.
+TEST(block_cache_counters) {
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> entries = {
+        {"chunked", randomBytes(16384, 5)},
+        {"large", randomBytes(3000, 6)},
+        {"medium", randomBytes(3000, 7)},
+        {"small", randomBytes(1000, 8)},
+    };
+    TempFile file("cache.makaka");
+    writeFile(file.path, indexedArchive(entries, 4096));
+    auto range = [&](size_t e, uint64_t offset, uint64_t length) {
+        const std::vector<uint8_t>& data = entries[e].second;
+        return std::vector<uint8_t>(data.begin() + offset, data.begin() + std::min<uint64_t>(offset + length, data.size()));
+    };
+
+    // Один шард: порядок вытеснения — чистый LRU.
+    auto cache = std::make_shared<BlockCache>(10000, 1);
+    ArchiveReader reader(file.path, cache);
+    CHECK(reader.readRange("small", 10, 100) == range(3, 10, 100));
+    CHECK(reader.readRange("small", 500, 100) == range(3, 500, 100));
+    BlockCacheStats stats = cache->stats();
+    CHECK(stats.misses == 1 && stats.hits == 1 && stats.blocks == 1 && stats.bytes == 1000);
+
+    // Диапазон через границу кусков распаковывает и кэширует ровно два куска.
+    CHECK(reader.readRange("chunked", 4000, 200) == range(0, 4000, 200));
+    CHECK(reader.readRange("chunked", 4096, 10) == range(0, 4096, 10));
+    stats = cache->stats();
+    CHECK(stats.misses == 3 && stats.hits == 2 && stats.blocks == 3 && stats.bytes == 1000 + 2 * 4096);
+
+    // 3000 байт не помещаются: вытесняются small и первый кусок, второй (читанный последним) остаётся.
+    CHECK(reader.readRange("medium", 0, 10) == range(2, 0, 10));
+    stats = cache->stats();
+    CHECK(stats.evictions == 2 && stats.blocks == 2 && stats.bytes == 4096 + 3000);
+    CHECK(reader.readRange("chunked", 4100, 10) == range(0, 4100, 10));
+    CHECK(cache->stats().hits == 3);
+    CHECK(reader.readRange("small", 0, 10) == range(3, 0, 10));
+    CHECK(cache->stats().misses == 5);
+
+    // Четыре шарда по 750 байт: запись в 3000 байт не кэшируется, хотя кэш вместил бы её.
+    auto sharded = std::make_shared<BlockCache>(3000, 4);
+    ArchiveReader sharded_reader(file.path, sharded);
+    CHECK(sharded_reader.readRange("large", 0, 3000) == entries[1].second);
+    CHECK(sharded_reader.readRange("large", 0, 3000) == entries[1].second);
+    stats = sharded->stats();
+    CHECK(stats.misses == 2 && stats.hits == 0 && stats.blocks == 0 && stats.bytes == 0);
+
+    // Сколько ни вставляй, каждый шард держит не больше своей доли.
+    for (uint64_t i = 0; i < 100; ++i) {
+        sharded->insert({99, i}, std::make_shared<const std::vector<uint8_t>>(700));
+        CHECK(sharded->stats().bytes <= 4 * 700);
+    }
+    stats = sharded->stats();
+    CHECK(stats.blocks <= 4 && stats.evictions == 100 - stats.blocks);
+}
+
+// Бросает ли future исключение с текстом, содержащим message.
+template <typename T>
+bool failsWith(std::future<T>& future, const std::string& message) {
+    try {
+        future.get();
+    } catch (const std::exception& e) {
+        return std::string(e.what()).find(message) != std::string::npos;
+    }
+    return false;
+}
+
+// Выполняет готовые обратные вызовы AsyncReader, пока их не наберётся count (ждёт completionFd).
+size_t runCompletions(AsyncReader& async, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        pollfd fd = {async.completionFd(), POLLIN, 0};
+        if (poll(&fd, 1, 5000) != 1) break;
+        done += async.runCompletions();
+    }
+    return done;
+}
+
+TEST(async_reader_results) {
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> entries = {
+        {"chunked", randomBytes(200000, 9)},
+        {"small", randomBytes(3000, 10)},
+    };
+    TempFile file("async.makaka");
+    writeFile(file.path, indexedArchive(entries, 64 << 10));
+    AsyncReader async(2);
+
+    auto opened = async.open(file.path);
+    std::shared_ptr<ArchiveReader> reader = opened.get();
+    CHECK(reader && reader->size() == 2);
+    auto info = async.stat(reader, "chunked");
+    CHECK(info.get().original_size == 200000);
+    auto data = async.readRange(reader, "chunked", 70000, 1000);
+    CHECK(data.get() == std::vector<uint8_t>(entries[0].second.begin() + 70000, entries[0].second.begin() + 71000));
+
+    auto missing_stat = async.stat(reader, "missing");
+    CHECK(failsWith(missing_stat, "Entry not found"));
+    auto missing_read = async.readRange(reader, "missing", 0, 10);
+    CHECK(failsWith(missing_read, "Entry not found"));
+    auto missing_archive = async.open(file.path + ".missing");
+    CHECK(failsWith(missing_archive, ""));
+
+    // Обратные вызовы выполняются только в runCompletions и на вызывающем его потоке.
+    std::thread::id caller = std::this_thread::get_id();
+    int calls = 0;
+    bool on_caller = true;
+    std::vector<uint8_t> small;
+    std::string error;
+    async.readRange(reader, "small", 0, UINT64_MAX, [&](AsyncReader::Data result, std::exception_ptr failure) {
+        ++calls;
+        on_caller &= std::this_thread::get_id() == caller;
+        if (!failure) small = std::move(result);
+    });
+    async.stat(reader, "missing", [&](EntryInfo, std::exception_ptr failure) {
+        ++calls;
+        on_caller &= std::this_thread::get_id() == caller;
+        try {
+            if (failure) std::rethrow_exception(failure);
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+    });
+    pollfd fd = {async.completionFd(), POLLIN, 0};
+    CHECK(poll(&fd, 1, 5000) == 1);
+    CHECK(calls == 0);
+    CHECK(runCompletions(async, 2) == 2);
+    CHECK(calls == 2 && on_caller);
+    CHECK(small == entries[1].second);
+    CHECK(error.find("Entry not found: missing") != std::string::npos);
+    CHECK(async.runCompletions() == 0);
+}
+
+TEST(async_reader_queue_full) {
+    TempFile file("queue.makaka");
+    writeFile(file.path, indexedArchive({{"a", randomBytes(1000, 11)}}, 64 << 10));
+    auto reader = std::make_shared<ArchiveReader>(file.path);
+    TempFile fifo("queue.fifo");
+    CHECK(mkfifo(fifo.path.c_str(), 0600) == 0);
+
+    AsyncReader async(1, 2);
+    // Единственный поток застревает в open() канала, пока в него никто не пишет; очередь — два места.
+    auto blocked = async.open(fifo.path);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto first = async.stat(reader, "a");
+    auto second = async.readRange(reader, "a", 0, 10);
+    auto rejected = async.readRange(reader, "a", 0, 10);
+    CHECK(rejected.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    CHECK(failsWith(rejected, "queue is full"));
+    std::string callback_error;
+    async.stat(reader, "a", [&](EntryInfo, std::exception_ptr failure) {
+        try {
+            if (failure) std::rethrow_exception(failure);
+        } catch (const std::exception& e) {
+            callback_error = e.what();
+        }
+    });
+    CHECK(runCompletions(async, 1) == 1);
+    CHECK(callback_error.find("queue is full") != std::string::npos);
+
+    // Писатель открывает канал и сразу закрывает: open() возвращается, чтение пустого канала падает.
+    int writer = open(fifo.path.c_str(), O_WRONLY);
+    CHECK(writer >= 0);
+    if (writer >= 0) close(writer);
+    CHECK(failsWith(blocked, ""));
+    CHECK(first.get().original_size == 1000);
+    CHECK(second.get().size() == 10);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    size_t run = 0;
+    for (const auto& test : testCases()) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i) selected |= std::strcmp(argv[i], test.name) == 0;
+        if (!selected) continue;
+        int before = failures;
+        try {
+            test.run();
+        } catch (const std::exception& e) {
+            std::cerr << test.name << ": exception: " << e.what() << "\n";
+            ++failures;
+        }
+        std::cout << (failures == before ? "PASS " : "FAIL ") << test.name << std::endl;
+        ++run;
+    }
+    if (!run) {
+        std::cerr << "No tests selected\n";
+        return 1;
+    }
+    return failures ? 1 : 0;
+}